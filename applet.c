@@ -0,0 +1,34 @@
+#include <string.h>
+
+#include "applet.h"
+
+// Sorted by name
+const struct applet applets[] = {
+	{"cat", cat_main},
+	{"hexdump", hexdump_main},
+	{"mkdir", mkdir_main},
+	{"ps", ps_main},
+	{"rmdir", rmdir_main},
+	{"whoami", whoami_main},
+};
+
+const size_t num_applets = sizeof(applets) / sizeof(*applets);
+
+const struct applet *find_applet(const char *name)
+{
+	size_t lo = 0, hi = num_applets, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = strcmp(applets[mid].name, name);
+		if (!cmp)
+			return &applets[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
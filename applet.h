@@ -0,0 +1,28 @@
+#ifndef APPLET_H
+#define APPLET_H
+
+#include <stddef.h>
+
+// An applet is one of the coreutils built as an entry point rather than as
+// its own executable, so that coreutils can dispatch on argv[0] and pshell
+// can call it without an exec.
+// An applet returns its exit status and must not call exit(); its output
+// goes through stdio and the caller flushes it.
+struct applet {
+	const char *name;
+	int (*main)(int argc, char **argv);
+};
+
+int cat_main(int argc, char **argv);
+int hexdump_main(int argc, char **argv);
+int mkdir_main(int argc, char **argv);
+int ps_main(int argc, char **argv);
+int rmdir_main(int argc, char **argv);
+int whoami_main(int argc, char **argv);
+
+extern const struct applet applets[];
+extern const size_t num_applets;
+
+const struct applet *find_applet(const char *name);
+
+#endif
@@ -0,0 +1,95 @@
+// Reserved word lookup: the old linear scan against the perfect hash
+//
+// usage: keywords [rounds]
+//
+// Classifies a mix of 15 common words rounds times (default 10 million)
+// with each lookup and prints the time per word in nanoseconds. The hash
+// is pshell's own match_reserved(); the scan is a copy of the code it
+// replaced.
+
+#define main pshell_main
+#include "../pshell.c"
+#undef main
+
+#include <time.h>
+
+static const struct tok_def old_res_words[] = {
+    {"!", TOK_BANG},
+    {"{", TOK_LBRACE},
+    {"}", TOK_RBRACE},
+    {"case", TOK_CASE},
+    {"do", TOK_DO},
+    {"done", TOK_DONE},
+    {"elif", TOK_ELIF},
+    {"else", TOK_ELSE},
+    {"esac", TOK_ESAC},
+    {"fi", TOK_FI},
+    {"for", TOK_FOR},
+    {"if", TOK_IF},
+    {"in", TOK_IN},
+    {"then", TOK_THEN},
+    {"until", TOK_UNTIL},
+    {"while", TOK_WHILE},
+    {NULL, TOK_EOF},
+};
+
+static enum tok old_match_reserved(const str_t *tok)
+{
+    const struct tok_def *def;
+    for (def = old_res_words; def->tok; def++)
+        if (str_ceq(tok, def->tok))
+            return def->type;
+    return TOK_EOF;
+}
+
+static const char *const mix[] = {
+    "if", "[", "-n", "then", "echo", "fi", "for", "x", "in", "do",
+    "done", "while", "case", "esac", "x=1",
+};
+
+#define NUM_MIX (sizeof(mix) / sizeof(*mix))
+
+static double time_lookup(enum tok (*match)(const str_t *), const str_t *words,
+                          long rounds)
+{
+    struct timespec start, end;
+    volatile unsigned sum = 0;
+    long i;
+    size_t j;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < rounds; i++)
+        for (j = 0; j < NUM_MIX; j++)
+            sum += match(&words[j]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_nsec - start.tv_nsec)) / ((double)rounds * NUM_MIX);
+}
+
+int main(int argc, char **argv)
+{
+    long rounds = argc > 1 ? atol(argv[1]) : 10000000;
+    str_t words[NUM_MIX];
+    size_t i;
+
+    if (rounds <= 0) {
+        fprintf(stderr, "usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < NUM_MIX; i++) {
+        memset(&words[i], 0, sizeof(words[i]));
+        words[i].start = (unsigned char *)mix[i];
+        words[i].end = words[i].start + strlen(mix[i]);
+        if (match_reserved(&words[i]) != old_match_reserved(&words[i])) {
+            fprintf(stderr, "%s: lookups disagree\n", mix[i]);
+            return 1;
+        }
+    }
+
+    printf("linear scan: %6.1f ns/word\n",
+           time_lookup(old_match_reserved, words, rounds));
+    printf("perfect hash: %5.1f ns/word\n",
+           time_lookup(match_reserved, words, rounds));
+    return 0;
+}
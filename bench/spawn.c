@@ -0,0 +1,111 @@
+// Launch latency of fork, vfork and posix_spawn as the heap grows
+//
+// usage: spawn [runs [program]]
+//
+// For each heap size, touches that much memory and then starts program
+// (default /bin/true) runs times (default 200) with each method, printing
+// the average time from start to reap in microseconds.
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <spawn.h>
+
+extern char **environ;
+
+static const size_t heap_mib[] = {0, 64, 256, 1024};
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void reap(pid_t pid)
+{
+    int status;
+    if (pid < 0) {
+        perror("spawn");
+        exit(1);
+    }
+    while (waitpid(pid, &status, 0) < 0)
+        ;
+}
+
+static void run_fork(char **argv)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        execve(argv[0], argv, environ);
+        _exit(127);
+    }
+    reap(pid);
+}
+
+static void run_vfork(char **argv)
+{
+    pid_t pid = vfork();
+    if (pid == 0) {
+        execve(argv[0], argv, environ);
+        _exit(127);
+    }
+    reap(pid);
+}
+
+static void run_posix_spawn(char **argv)
+{
+    pid_t pid;
+    if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ))
+        pid = -1;
+    reap(pid);
+}
+
+static double time_runs(void (*run)(char **), char **argv, int runs)
+{
+    double start = now_us();
+    int i;
+    for (i = 0; i < runs; i++)
+        run(argv);
+    return (now_us() - start) / runs;
+}
+
+int main(int argc, char **argv)
+{
+    int runs = argc > 1 ? atoi(argv[1]) : 200;
+    char *child[] = {argc > 2 ? argv[2] : "/bin/true", NULL};
+    size_t i;
+    char *heap;
+
+    if (runs <= 0) {
+        fprintf(stderr, "usage: %s [runs [program]]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%8s %9s %9s %13s\n", "heap", "fork", "vfork", "posix_spawn");
+    for (i = 0; i < sizeof(heap_mib) / sizeof(*heap_mib); i++) {
+        heap = NULL;
+        if (heap_mib[i]) {
+            // Touch every page so fork has page tables to copy
+            heap = malloc(heap_mib[i] << 20);
+            if (!heap)
+                abort();
+            memset(heap, 1, heap_mib[i] << 20);
+        }
+        printf("%4zu MiB ", heap_mib[i]);
+        printf("%7.0fus ", time_runs(run_fork, child, runs));
+        printf("%7.0fus ", time_runs(run_vfork, child, runs));
+        printf("%11.0fus\n", time_runs(run_posix_spawn, child, runs));
+        fflush(stdout);
+        free(heap);
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Shell variable lookup as the number of variables grows
+#
+# usage: bench/vars.sh [shell...]
+#
+# For each shell (default ./pshell), prints the best of 3 user CPU times
+# for scripts that define N variables and then run 20k assignments that
+# expand three of them, and the wall time of 200 runs of `SHELL -c x=1`
+# with 2000 exported environment variables.
+
+shells=("$@")
+[ ${#shells[@]} -gt 0 ] || shells=(./pshell)
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+for n in 10 1000 100000; do
+    awk -v n=$n 'BEGIN {
+        for (i = 1; i <= n; i++)
+            printf "v%d=%d\n", i, i
+        for (i = 0; i < 20000; i++)
+            printf "x=$v1$v%d$v%d\n", int((n + 1) / 2), n
+    }' > "$dir/vars$n"
+done
+
+best_user()
+{
+    local best= t i
+    for i in 1 2 3; do
+        t=$( { TIMEFORMAT=%U; time "$@" > /dev/null; } 2>&1 )
+        if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+        fi
+    done
+    echo "${best}s"
+}
+
+for sh in "${shells[@]}"; do
+    echo "$sh:"
+    for n in 10 1000 100000; do
+        printf '  N = %-8s %s user\n' "$n:" "$(best_user "$sh" "$dir/vars$n")"
+    done
+    t=$( {
+        TIMEFORMAT=%R
+        time env $(seq -f 'BENCH_VAR%g=x' 2000) \
+            sh -c 'for i in $(seq 200); do "$0" -c x=1; done' "$sh"
+    } 2>&1 )
+    echo "  startup, 2000 exported: ${t}s wall for 200 runs"
+done
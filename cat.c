@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#include "applet.h"
 #include "arg.h"
 
 static const struct long_def long_args[] = {
@@ -31,7 +32,7 @@ struct options {
     int last_was_lf;
 };
 
-void do_squeeze(char *buf, size_t *size, struct options *opts)
+static void do_squeeze(char *buf, size_t *size, struct options *opts)
 {
     char *out = buf, *end = buf + *size, *input = buf;
     if (!opts->squeeze)
@@ -50,7 +51,7 @@ void do_squeeze(char *buf, size_t *size, struct options *opts)
     *size = out - buf;
 }
 
-int print_numbers_and_ends(char *buf, size_t size, struct options *opts)
+static int print_numbers_and_ends(char *buf, size_t size, struct options *opts)
 {
     char *ptr = buf, *line_end, *end = buf + size;
 
@@ -60,7 +61,7 @@ int print_numbers_and_ends(char *buf, size_t size, struct options *opts)
     while (ptr < end) {
         if (*ptr == '\n') {
             if (!opts->within_line && opts->number)
-                fprintf(stdout, "%6zd  ", ++opts->count);
+                fprintf(stdout, "%6zu\t", ++opts->count);
             if (opts->show_end)
                 putc('$', stdout);
             putc('\n', stdout);
@@ -68,9 +69,9 @@ int print_numbers_and_ends(char *buf, size_t size, struct options *opts)
             ptr++;
         } else {
             if (!opts->within_line && (opts->number || opts->number_non_empty))
-                fprintf(stdout, "%6zd  ", ++opts->count);
+                fprintf(stdout, "%6zu\t", ++opts->count);
             opts->within_line = 1;
-            line_end = memchr(ptr, '\n', size);
+            line_end = memchr(ptr, '\n', end - ptr);
             if (!line_end) {
                 fwrite(ptr, 1, end - ptr, stdout);
                 ptr = end;
@@ -84,7 +85,7 @@ int print_numbers_and_ends(char *buf, size_t size, struct options *opts)
     return 1;
 }
 
-void write_output(char *buf, size_t size, struct options *opts)
+static void write_output(char *buf, size_t size, struct options *opts)
 {
     do_squeeze(buf, &size, opts);
 
@@ -94,35 +95,50 @@ void write_output(char *buf, size_t size, struct options *opts)
     fwrite(buf, 1, size, stdout);
 }
 
-void do_cat(const char *name, struct options *opts)
+// Copies by byte counts, so NULs pass through, and hands on each read as it
+// comes so that cat on a pipe or a terminal does not hold output back
+static int do_cat(const char *name, struct options *opts)
 {
     static char buf[1024 * 1024];
-    FILE *file;
+    ssize_t size;
+    int fd, err = 0;
 
     if (!strcmp(name, "-")) {
-        file = stdin;
+        fd = STDIN_FILENO;
     } else {
-        file = fopen(name, "rb");
-        if (file == NULL) {
-            fprintf(stderr, "Could not open %s: %s", name, strerror(errno));
-            return;
+        fd = open(name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            return 1;
         }
     }
 
-    while (fgets(buf, sizeof(buf), file))
-        write_output(buf, strlen(buf), opts);
+    while ((size = read(fd, buf, sizeof(buf))) != 0) {
+        if (size < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            err = 1;
+            break;
+        }
+        write_output(buf, size, opts);
+        fflush(stdout);
+    }
 
-    if (file != stdin)
-        fclose(file);
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return err;
 }
 
-int main(int argc, char **argv)
+int cat_main(int argc, char **argv)
 {
-    int c, has_files;
+    int c, has_files, err = 0;
     const char *arg;
     struct arg_state arg_state;
     struct options o;
     memset(&o, 0, sizeof(o));
+    // the start of the input counts as a line end for -s
+    o.last_was_lf = 1;
 
     has_files = 0;
     start_args(&arg_state, long_args, argc, argv, 1);
@@ -143,7 +159,7 @@ int main(int argc, char **argv)
             o.squeeze = 1;
             break;
         case ARG_WORD:
-            do_cat(arg, &o);
+            err |= do_cat(arg, &o);
             has_files = 1;
             break;
 	case ARG_UNKNOWN_LONG:
@@ -156,7 +172,7 @@ int main(int argc, char **argv)
     }
 
     if (!has_files)
-        do_cat("-", &o);
+        err |= do_cat("-", &o);
 
-    return 0;
+    return err;
 }
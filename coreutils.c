@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "applet.h"
+
+// Runs the applet named by the last component of argv[0], so that each
+// utility can be a link to this binary; "coreutils NAME ARGS..." also works.
+int main(int argc, char **argv)
+{
+	const struct applet *applet;
+	const char *name;
+	size_t i;
+	int ret;
+
+	if (argc < 1)
+		return 1;
+
+	name = strrchr(argv[0], '/');
+	name = name ? name + 1 : argv[0];
+	if (!strcmp(name, "coreutils")) {
+		if (argc < 2) {
+			fprintf(stderr, "usage: coreutils APPLET [ARG]...\n"
+				"applets:");
+			for (i = 0; i < num_applets; i++)
+				fprintf(stderr, " %s", applets[i].name);
+			fprintf(stderr, "\n");
+			return 1;
+		}
+		argc--;
+		argv++;
+		name = argv[0];
+	}
+
+	applet = find_applet(name);
+	if (!applet) {
+		fprintf(stderr, "coreutils: %s: applet not found\n", name);
+		return 127;
+	}
+
+	ret = applet->main(argc, argv);
+	if (fflush(stdout) == EOF && !ret)
+		ret = 1;
+	return ret;
+}
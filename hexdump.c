@@ -5,7 +5,9 @@
 #include <string.h>
 #include <errno.h>
 
-size_t do_hexdump(const unsigned char *buf, size_t size, size_t offset)
+#include "applet.h"
+
+static size_t do_hexdump(const unsigned char *buf, size_t size, size_t offset)
 {
 	size_t i;
 
@@ -35,7 +37,7 @@ size_t do_hexdump(const unsigned char *buf, size_t size, size_t offset)
 	return offset + size;
 }
 
-int main(int argc, char *argv[])
+int hexdump_main(int argc, char *argv[])
 {
 	char *default_argv[] = {argv[0], "-"};
 	char buf[16];
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "applet.h"
 #include "arg.h"
 
 static int is_dir(const char *name) {
@@ -63,7 +64,7 @@ static const struct long_def long_args[] = {
 	{0, NULL}
 };
 
-int main(int argc, char **argv)
+int mkdir_main(int argc, char **argv)
 {
 	struct arg_state arg_state;
 	const char *arg;
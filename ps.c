@@ -12,9 +12,10 @@
 #include <sys/stat.h>
 #include <pwd.h>
 
+#include "applet.h"
 #include "arg.h"
 
-void show_process(pid_t pid, int show_all)
+static void show_process(pid_t pid, int show_all)
 {
 	char name[64];
 	struct stat sb;
@@ -48,7 +49,7 @@ void show_process(pid_t pid, int show_all)
 	printf("\n");
 }
 
-int main(int argc, char *argv[])
+int ps_main(int argc, char *argv[])
 {
 	struct arg_state arg_state;
 	const char *arg;
@@ -87,5 +88,6 @@ int main(int argc, char *argv[])
 		show_process(pid, show_all);
 	}
 
+	closedir(dir);
 	return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <assert.h>
 #include <stdarg.h>
@@ -5,31 +6,58 @@
 #include <ctype.h>
 #include <limits.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
-#define _XOPEN_SOURCE
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
+#include <sys/times.h>
 #include <unistd.h>
 #include <errno.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <spawn.h>
+
+#include "applet.h"
+
+// Strings shorter than STR_INLINE bytes live in small, inside the str itself,
+// and only longer ones get a buffer of their own. A str that owns its bytes
+// has buf_start set; a view has it NULL.
+#define STR_INLINE 16
 
 typedef struct str {
     unsigned char *start, *end;
     void *buf_start, *buf_end;
+    unsigned char small[STR_INLINE];
 } str_t;
 
+static inline void str_init(str_t *str)
+{
+    str->start = str->end = str->buf_start = str->small;
+    str->buf_end = str->small + STR_INLINE;
+    str->small[0] = 0;
+}
+
 static inline str_t *new_str(void)
 {
     str_t *str = malloc(sizeof(*str));
     if (!str)
         abort();
+    str_init(str);
+    return str;
+}
+
+// Releases the buffer of an owning str, but not the str itself
+static inline void str_free_buf(str_t *str)
+{
+    if (str->buf_start != str->small)
+        free(str->buf_start);
     str->start = str->end = NULL;
     str->buf_start = str->buf_end = NULL;
-    return str;
 }
 
 static inline void free_str(const str_t *s)
@@ -37,9 +65,7 @@ static inline void free_str(const str_t *s)
     str_t *str = (void *)s;
     if (!str)
         return;
-    free(str->buf_start);
-    str->start = str->end = NULL;
-    str->buf_start = str->buf_end = NULL;
+    str_free_buf(str);
     free(str);
 }
 
@@ -63,20 +89,35 @@ static inline str_t *dup_str(const str_t *str)
     size_t len = str_len(str);
     if (!new_str)
         abort();
-    new_str->start = new_str->end = NULL;
-    new_str->buf_start = new_str->buf_end = NULL;
+    str_init(new_str);
     if (!len)
         return new_str;
-    if (!(new_str->buf_start = malloc(len + 1)))
-        abort();
-    new_str->buf_end = (char *)new_str->buf_start + len;
+    if (len >= STR_INLINE) {
+        if (!(new_str->buf_start = malloc(len + 1)))
+            abort();
+        new_str->buf_end = (char *)new_str->buf_start + len;
+    }
     new_str->start = new_str->buf_start;
-    new_str->end = new_str->buf_end;
+    new_str->end = new_str->start + len;
     memcpy(new_str->start, str->start, len);
     new_str->start[len] = 0;
     return new_str;
 }
 
+// A str that points into memory owned by someone else. It is never written
+// through; the first str_reserve() takes a private copy.
+static inline str_t *str_view(const void *start, size_t len)
+{
+    str_t *str = new_str();
+    str->start = (void *)start;
+    str->end = str->start + len;
+    str->buf_start = str->buf_end = NULL;
+    return str;
+}
+
+// printf("%.*s", STR_FMT(s)) for strs that may not be NUL terminated
+#define STR_FMT(s) (int)str_len(s), (const char *)(s)->start
+
 static inline int str_eq(const str_t *a, const str_t *b)
 {
     size_t len = str_len(b);
@@ -102,6 +143,22 @@ static void str_reserve(str_t *str, size_t size)
 {
     unsigned char *ptr;
     size_t buf_size, avail_size, req_size, offset;
+    if (!str->buf_start) {
+        buf_size = str_len(str);
+        if (buf_size < STR_INLINE) {
+            ptr = str->small;
+            str->buf_end = ptr + STR_INLINE;
+        } else {
+            if (!(ptr = malloc(buf_size + 1)))
+                abort();
+            str->buf_end = ptr + buf_size;
+        }
+        if (buf_size)
+            memmove(ptr, str->start, buf_size);
+        ptr[buf_size] = 0;
+        str->start = str->buf_start = ptr;
+        str->end = ptr + buf_size;
+    }
     avail_size = (size_t)((unsigned char *)str->buf_end - str->end);
     offset = str->start - (unsigned char *)str->buf_start;
     buf_size = (char *)str->buf_end - (char *)str->buf_start;
@@ -123,8 +180,12 @@ static void str_reserve(str_t *str, size_t size)
             abort();
         buf_size *= 2;
     }
-    ptr = realloc(str->buf_start, buf_size);
-    assert(ptr);
+    if (str->buf_start == str->small) {
+        if ((ptr = malloc(buf_size)))
+            memcpy(ptr, str->small, STR_INLINE);
+    } else {
+        ptr = realloc(str->buf_start, buf_size);
+    }
     if (!ptr)
         abort();
     str->start = ptr + (str->start - (unsigned char *)str->buf_start);
@@ -156,6 +217,581 @@ static inline int str_getc(str_t *str)
     return *str->start++;
 }
 
+/*
+ * Arenas
+ *
+ * Parse trees are bump allocated out of an arena and all released together
+ * by arena_drop(). Anything that owns resources outside the arena registers
+ * a cleanup with arena_defer(), which arena_drop() runs first. Strings put in
+ * an arena are views, so they must never be grown in place.
+ */
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & \
+        ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+};
+
+struct arena_cleanup {
+    struct arena_cleanup *next;
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+struct arena {
+    struct arena_chunk *chunk;
+    unsigned char *pos, *end;
+    struct arena_cleanup *cleanups;
+    size_t chunk_size;
+};
+
+static void init_arena(struct arena *a, size_t chunk_size)
+{
+    a->chunk = NULL;
+    a->pos = a->end = NULL;
+    a->cleanups = NULL;
+    a->chunk_size = chunk_size;
+}
+
+static struct arena_chunk *arena_chunk(size_t size, struct arena_chunk *prev)
+{
+    struct arena_chunk *chunk;
+    if (size > SIZE_MAX - ARENA_HEADER)
+        abort();
+    if (!(chunk = malloc(ARENA_HEADER + size)))
+        abort();
+    chunk->prev = prev;
+    chunk->size = size;
+    return chunk;
+}
+
+static void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_chunk *chunk;
+    void *ptr;
+    if (size > SIZE_MAX - ARENA_ALIGN)
+        abort();
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size > (size_t)(a->end - a->pos)) {
+        // Big blocks get a chunk of their own behind the current one, which
+        // keeps the rest of the current chunk in use
+        if (a->chunk && size > a->chunk_size / 4) {
+            chunk = arena_chunk(size, a->chunk->prev);
+            a->chunk->prev = chunk;
+            return (unsigned char *)chunk + ARENA_HEADER;
+        }
+        chunk = arena_chunk(size > a->chunk_size ? size : a->chunk_size,
+                a->chunk);
+        a->chunk = chunk;
+        a->pos = (unsigned char *)chunk + ARENA_HEADER;
+        a->end = a->pos + chunk->size;
+    }
+    ptr = a->pos;
+    a->pos += size;
+    return ptr;
+}
+
+static void arena_defer(struct arena *a, void (*fn)(void *arg), void *arg)
+{
+    struct arena_cleanup *c = arena_alloc(a, sizeof(*c));
+    c->fn = fn;
+    c->arg = arg;
+    c->next = a->cleanups;
+    a->cleanups = c;
+}
+
+// Releases everything in the arena. One chunk is kept for reuse so that
+// parsing a short command does not have to go back to malloc.
+static void arena_drop(struct arena *a)
+{
+    struct arena_chunk *chunk, *prev, *keep = NULL;
+    struct arena_cleanup *c;
+    for (c = a->cleanups; c; c = c->next)
+        c->fn(c->arg);
+    a->cleanups = NULL;
+    for (chunk = a->chunk; chunk; chunk = prev) {
+        prev = chunk->prev;
+        if (!keep && chunk->size == a->chunk_size)
+            keep = chunk;
+        else
+            free(chunk);
+    }
+    a->chunk = keep;
+    a->pos = a->end = NULL;
+    if (keep) {
+        keep->prev = NULL;
+        a->pos = (unsigned char *)keep + ARENA_HEADER;
+        a->end = a->pos + keep->size;
+    }
+}
+
+static void destroy_arena(struct arena *a)
+{
+    arena_drop(a);
+    free(a->chunk);
+    init_arena(a, a->chunk_size);
+}
+
+static str_t *arena_view(struct arena *a, const void *start, size_t len)
+{
+    str_t *str = arena_alloc(a, sizeof(*str));
+    str->start = (void *)start;
+    str->end = str->start + len;
+    str->buf_start = str->buf_end = NULL;
+    return str;
+}
+
+// A NUL terminated copy of len bytes, header and all in one allocation
+static str_t *arena_str(struct arena *a, const void *data, size_t len)
+{
+    str_t *str;
+    if (len > SIZE_MAX - sizeof(*str) - 1)
+        abort();
+    str = arena_alloc(a, sizeof(*str) + (len < STR_INLINE ? 0 : len + 1));
+    str->start = len < STR_INLINE ? str->small : (unsigned char *)(str + 1);
+    str->end = str->start + len;
+    str->buf_start = str->buf_end = NULL;
+    if (len)
+        memcpy(str->start, data, len);
+    *str->end = 0;
+    return str;
+}
+
+static inline str_t *arena_dup_str(struct arena *a, const str_t *str)
+{
+    if (!str)
+        return NULL;
+    return arena_str(a, str->start, str_len(str));
+}
+
+static uint64_t hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *ptr = data, *end = ptr + len;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; ptr < end; ptr++) {
+        hash ^= *ptr;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Symbols
+ *
+ * Variable and function names are interned once, when they are parsed, so
+ * that everything after the parser compares them by pointer. Symbols are
+ * never freed; they live in an arena of their own for the life of the shell.
+ */
+#define SYMBOL_CHUNK_SIZE 4096
+
+struct symbol {
+    struct symbol *next;
+    uint64_t hash;
+    const str_t *name;
+};
+
+static struct {
+    struct arena arena;
+    struct symbol **buckets;
+    size_t mask, count;
+} symbols;
+
+static void grow_symbols(void)
+{
+    size_t size = symbols.buckets ? (symbols.mask + 1) * 2 : 64, i;
+    struct symbol **buckets, *sym, *next;
+    if (!symbols.buckets)
+        init_arena(&symbols.arena, SYMBOL_CHUNK_SIZE);
+    if (!(buckets = calloc(size, sizeof(*buckets))))
+        abort();
+    for (i = 0; symbols.buckets && i <= symbols.mask; i++) {
+        for (sym = symbols.buckets[i]; sym; sym = next) {
+            next = sym->next;
+            sym->next = buckets[sym->hash & (size - 1)];
+            buckets[sym->hash & (size - 1)] = sym;
+        }
+    }
+    free(symbols.buckets);
+    symbols.buckets = buckets;
+    symbols.mask = size - 1;
+}
+
+static struct symbol *lookup_symbol(const void *name, size_t len,
+        uint64_t hash)
+{
+    struct symbol *sym;
+    if (!symbols.buckets)
+        return NULL;
+    for (sym = symbols.buckets[hash & symbols.mask]; sym; sym = sym->next)
+        if (sym->hash == hash && str_len(sym->name) == len &&
+                (!len || !memcmp(sym->name->start, name, len)))
+            return sym;
+    return NULL;
+}
+
+// The symbol for name if it has been interned, without adding one for a name
+// that only comes up at run time, like a command name
+static const struct symbol *find_symbol(const void *name, size_t len)
+{
+    return lookup_symbol(name, len, hash_bytes(name, len));
+}
+
+static const struct symbol *intern(const void *name, size_t len)
+{
+    uint64_t hash = hash_bytes(name, len);
+    struct symbol *sym, **bucket;
+    if ((sym = lookup_symbol(name, len, hash)))
+        return sym;
+    if (symbols.count >= symbols.mask)
+        grow_symbols();
+    bucket = &symbols.buckets[hash & symbols.mask];
+    sym = arena_alloc(&symbols.arena, sizeof(*sym));
+    sym->hash = hash;
+    sym->name = arena_str(&symbols.arena, name, len);
+    sym->next = *bucket;
+    *bucket = sym;
+    symbols.count++;
+    return sym;
+}
+
+static inline const struct symbol *intern_str(const str_t *name)
+{
+    return intern(name->start, str_len(name));
+}
+
+/*
+ * $((...)) is parsed once, when it is lexed, into an array of nodes. Each
+ * node comes after its operands and refers back to them by distance, so the
+ * last node is the root and a pointer to it is all a word has to keep.
+ */
+enum arith_op {
+    ARITH_NUM,
+    ARITH_NAME,     // x
+    ARITH_PARAM,    // $x, ${x}, $1, $#, ...
+    ARITH_NEG, ARITH_NOT, ARITH_BITNOT,
+    ARITH_MUL, ARITH_DIV, ARITH_MOD, ARITH_ADD, ARITH_SUB,
+    ARITH_SHL, ARITH_SHR, ARITH_LT, ARITH_LE, ARITH_GT, ARITH_GE,
+    ARITH_EQ, ARITH_NE, ARITH_BITAND, ARITH_XOR, ARITH_BITOR,
+    ARITH_AND, ARITH_OR,
+    ARITH_COND,     // a ? b : c
+    ARITH_ASSIGN,   // sym = a, or sym op= a for any other assign
+};
+
+struct arith {
+    uint8_t op, assign;
+    uint32_t a, b, c;
+    int64_t num;
+    const struct symbol *sym;
+};
+
+#define ARITH_ARG(n, which) ((n) - (n)->which)
+
+struct arith_parser {
+    const unsigned char *pos, *end;
+    struct arith *nodes;
+    uint32_t count, size;
+    const char *err;
+};
+
+// Binary and assignment operators, longest first so that << is not taken
+// for <. prec is 0 for the assignments.
+static const struct arith_binop {
+    const char *tok;
+    uint8_t op, prec;
+} arith_binops[] = {
+    {"<<=", ARITH_SHL, 0}, {">>=", ARITH_SHR, 0},
+    {"<<", ARITH_SHL, 8}, {">>", ARITH_SHR, 8},
+    {"<=", ARITH_LE, 7}, {">=", ARITH_GE, 7},
+    {"==", ARITH_EQ, 6}, {"!=", ARITH_NE, 6},
+    {"&&", ARITH_AND, 2}, {"||", ARITH_OR, 1},
+    {"*=", ARITH_MUL, 0}, {"/=", ARITH_DIV, 0}, {"%=", ARITH_MOD, 0},
+    {"+=", ARITH_ADD, 0}, {"-=", ARITH_SUB, 0},
+    {"&=", ARITH_BITAND, 0}, {"^=", ARITH_XOR, 0}, {"|=", ARITH_BITOR, 0},
+    {"*", ARITH_MUL, 10}, {"/", ARITH_DIV, 10}, {"%", ARITH_MOD, 10},
+    {"+", ARITH_ADD, 9}, {"-", ARITH_SUB, 9},
+    {"<", ARITH_LT, 7}, {">", ARITH_GT, 7},
+    {"&", ARITH_BITAND, 5}, {"^", ARITH_XOR, 4}, {"|", ARITH_BITOR, 3},
+    {"=", ARITH_NUM, 0},
+};
+
+static uint32_t arith_expr(struct arith_parser *ap);
+
+static uint32_t arith_node(struct arith_parser *ap, int op)
+{
+    struct arith *n;
+    if (ap->count == ap->size) {
+        if (ap->size > UINT32_MAX / 2 / sizeof(*n))
+            abort();
+        ap->size = ap->size ? ap->size * 2 : 16;
+        if (!(ap->nodes = realloc(ap->nodes, ap->size * sizeof(*n))))
+            abort();
+    }
+    n = &ap->nodes[ap->count];
+    memset(n, 0, sizeof(*n));
+    n->op = op;
+    return ap->count++;
+}
+
+// Links the operands given as node indexes to the node at idx
+static uint32_t arith_link(struct arith_parser *ap, uint32_t idx, uint32_t a,
+        uint32_t b, uint32_t c)
+{
+    struct arith *n = &ap->nodes[idx];
+    n->a = idx - a;
+    n->b = idx - b;
+    n->c = idx - c;
+    return idx;
+}
+
+static int arith_peek(struct arith_parser *ap)
+{
+    while (ap->pos < ap->end && (*ap->pos == ' ' || *ap->pos == '\t' ||
+                *ap->pos == '\n'))
+        ap->pos++;
+    return ap->pos < ap->end ? *ap->pos : EOF;
+}
+
+static int arith_accept(struct arith_parser *ap, const char *tok)
+{
+    size_t len = strlen(tok);
+    arith_peek(ap);
+    if ((size_t)(ap->end - ap->pos) < len || memcmp(ap->pos, tok, len))
+        return 0;
+    ap->pos += len;
+    return 1;
+}
+
+static const struct arith_binop *arith_peek_binop(struct arith_parser *ap)
+{
+    size_t i, len;
+    arith_peek(ap);
+    for (i = 0; i < sizeof(arith_binops) / sizeof(*arith_binops); i++) {
+        if (ap->pos == ap->end || *ap->pos != *arith_binops[i].tok)
+            continue;
+        len = strlen(arith_binops[i].tok);
+        if ((size_t)(ap->end - ap->pos) >= len &&
+                !memcmp(ap->pos, arith_binops[i].tok, len))
+            return &arith_binops[i];
+    }
+    return NULL;
+}
+
+static int arith_name_char(int ch, int first)
+{
+    return ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+        (!first && ch >= '0' && ch <= '9');
+}
+
+/*
+ * Reads an integer constant: decimal, octal with a leading 0 or hex with a
+ * leading 0x. Returns 0 if there is none at s or it runs into a name.
+ */
+static size_t arith_scan_number(const unsigned char *s,
+        const unsigned char *end, int64_t *num)
+{
+    const unsigned char *p = s;
+    uint64_t val = 0;
+    int base = 10, digit;
+    if (p == end || *p < '0' || *p > '9')
+        return 0;
+    if (*p == '0') {
+        base = 8;
+        p++;
+        if (p < end && (*p == 'x' || *p == 'X')) {
+            base = 16;
+            if (++p == end)
+                return 0;
+        }
+    }
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9')
+            digit = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            digit = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            digit = *p - 'A' + 10;
+        else if (arith_name_char(*p, 0))
+            return 0;
+        else
+            break;
+        if (digit >= base)
+            return 0;
+        // overflow wraps, as it does for everything else
+        val = val * base + digit;
+    }
+    *num = (int64_t)val;
+    return p - s;
+}
+
+// $name, ${name}, the special parameters and $((...)) inside an expression
+static uint32_t arith_dollar(struct arith_parser *ap)
+{
+    const unsigned char *name;
+    uint32_t idx;
+    int brace = 0;
+    if (ap->pos < ap->end && *ap->pos == '(') {
+        if (ap->end - ap->pos < 2 || ap->pos[1] != '(') {
+            ap->err = "command substitution";
+            return 0;
+        }
+        ap->pos += 2;
+        idx = arith_expr(ap);
+        if (!ap->err && !arith_accept(ap, "))"))
+            ap->err = "expected ))";
+        return idx;
+    }
+    if (ap->pos < ap->end && *ap->pos == '{') {
+        brace = 1;
+        ap->pos++;
+    }
+    name = ap->pos;
+    if (ap->pos < ap->end && *ap->pos >= '0' && *ap->pos <= '9') {
+        do
+            ap->pos++;
+        while (brace && ap->pos < ap->end && *ap->pos >= '0' && *ap->pos <= '9');
+    } else if (ap->pos < ap->end && *ap->pos && strchr("#?$@*", *ap->pos)) {
+        ap->pos++;
+    } else {
+        while (ap->pos < ap->end && arith_name_char(*ap->pos, ap->pos == name))
+            ap->pos++;
+    }
+    if (ap->pos == name || (brace && (ap->pos == ap->end || *ap->pos++ != '}'))) {
+        ap->err = "bad substitution";
+        return 0;
+    }
+    idx = arith_node(ap, ARITH_PARAM);
+    ap->nodes[idx].sym = intern(name, ap->pos - name - brace);
+    return idx;
+}
+
+static uint32_t arith_unary(struct arith_parser *ap)
+{
+    const unsigned char *name;
+    uint32_t idx, a;
+    size_t len;
+    int ch = arith_peek(ap), op;
+    switch (ch) {
+    case '-': case '+': case '!': case '~':
+        ap->pos++;
+        a = arith_unary(ap);
+        if (ch == '+')
+            return a;
+        op = ch == '-' ? ARITH_NEG : ch == '!' ? ARITH_NOT : ARITH_BITNOT;
+        return arith_link(ap, arith_node(ap, op), a, a, a);
+    case '(':
+        ap->pos++;
+        idx = arith_expr(ap);
+        if (!ap->err && !arith_accept(ap, ")"))
+            ap->err = "expected )";
+        return idx;
+    case '$':
+        ap->pos++;
+        return arith_dollar(ap);
+    }
+    if (ch >= '0' && ch <= '9') {
+        idx = arith_node(ap, ARITH_NUM);
+        if (!(len = arith_scan_number(ap->pos, ap->end, &ap->nodes[idx].num)))
+            ap->err = "bad number";
+        ap->pos += len;
+        return idx;
+    }
+    if (ch != EOF && arith_name_char(ch, 1)) {
+        name = ap->pos;
+        while (ap->pos < ap->end && arith_name_char(*ap->pos, 0))
+            ap->pos++;
+        idx = arith_node(ap, ARITH_NAME);
+        ap->nodes[idx].sym = intern(name, ap->pos - name);
+        return idx;
+    }
+    ap->err = ch == EOF ? "expected an operand" : "unexpected character";
+    return 0;
+}
+
+// Operators that bind at least as tightly as prec, by precedence climbing
+static uint32_t arith_binary(struct arith_parser *ap, int prec)
+{
+    const struct arith_binop *bop;
+    uint32_t lhs = arith_unary(ap), rhs;
+    while (!ap->err && (bop = arith_peek_binop(ap)) && bop->prec &&
+            bop->prec >= prec) {
+        ap->pos += strlen(bop->tok);
+        rhs = arith_binary(ap, bop->prec + 1);
+        lhs = arith_link(ap, arith_node(ap, bop->op), lhs, rhs, rhs);
+    }
+    return lhs;
+}
+
+static uint32_t arith_expr(struct arith_parser *ap)
+{
+    const struct arith_binop *bop;
+    uint32_t cond = arith_binary(ap, 1), a, b, idx;
+    if (ap->err)
+        return 0;
+    if (arith_accept(ap, "?")) {
+        a = arith_expr(ap);
+        if (!ap->err && !arith_accept(ap, ":"))
+            ap->err = "expected :";
+        if (ap->err)
+            return 0;
+        b = arith_expr(ap);
+        return arith_link(ap, arith_node(ap, ARITH_COND), cond, a, b);
+    }
+    bop = arith_peek_binop(ap);
+    if (!bop || bop->prec)
+        return cond;
+    if (ap->nodes[cond].op != ARITH_NAME) {
+        ap->err = "assignment to something that is not a variable";
+        return 0;
+    }
+    ap->pos += strlen(bop->tok);
+    a = arith_expr(ap);
+    idx = arith_link(ap, arith_node(ap, ARITH_ASSIGN), a, a, a);
+    ap->nodes[idx].assign = bop->op;
+    ap->nodes[idx].sym = ap->nodes[cond].sym;
+    return idx;
+}
+
+/*
+ * Parses len bytes of s. On success the nodes are left in ap->nodes, to be
+ * freed by the caller, with the root last; otherwise ap->err says what went
+ * wrong.
+ */
+static int arith_parse(struct arith_parser *ap, const void *s, size_t len)
+{
+    ap->pos = s;
+    ap->end = ap->pos + len;
+    ap->nodes = NULL;
+    ap->count = ap->size = 0;
+    ap->err = NULL;
+    // $(()) is 0
+    if (arith_peek(ap) == EOF) {
+        arith_node(ap, ARITH_NUM);
+        return 1;
+    }
+    arith_expr(ap);
+    if (!ap->err && arith_peek(ap) != EOF)
+        ap->err = "unexpected character";
+    return !ap->err;
+}
+
+// Parses text into arena, returning the root node or NULL with *err set
+static const struct arith *arith_compile(struct arena *a, const str_t *text,
+        const char **err)
+{
+    struct arith_parser ap;
+    struct arith *nodes = NULL;
+    if (arith_parse(&ap, text->start, str_len(text))) {
+        nodes = arena_alloc(a, ap.count * sizeof(*nodes));
+        memcpy(nodes, ap.nodes, ap.count * sizeof(*nodes));
+        nodes += ap.count - 1;
+    }
+    *err = ap.err;
+    free(ap.nodes);
+    return nodes;
+}
+
 enum word_type {
     WORD_STRING,
     WORD_PARAMETER,
@@ -164,24 +800,34 @@ enum word_type {
     WORD_BACKTICK,
 };
 
+// What a WORD_PARAMETER does with its value. In ${name:-word} and the other
+// colon forms an empty value counts as unset.
+enum param_op {
+    PARAM_PLAIN,        // $name, ${name}
+    PARAM_LENGTH,       // ${#name}
+    PARAM_DEFAULT,      // ${name-word}
+    PARAM_ASSIGN,       // ${name=word}
+    PARAM_ERROR,        // ${name?word}
+    PARAM_ALTERNATE,    // ${name+word}
+    PARAM_SUFFIX,       // ${name%word}
+    PARAM_LONG_SUFFIX,  // ${name%%word}
+    PARAM_PREFIX,       // ${name#word}
+    PARAM_LONG_PREFIX,  // ${name##word}
+};
+
 typedef struct word_part {
     enum word_type type;
     struct word_part *next;
     int quoted, was_quoted;
     str_t *tok;
+    const struct symbol *sym; // the name of a WORD_PARAMETER
+    enum param_op op;
+    int colon;
+    struct word_part *arg; // the word after op
+    const struct arith *arith; // the root of a WORD_ARITHMETIC
+    union node *body; // the commands of a WORD_COMMAND or WORD_BACKTICK
 } word_t;
 
-static void free_word(word_t *part)
-{
-    word_t *next;
-    while (part) {
-        next = part->next;
-        free_str(part->tok);
-        free(part);
-        part = next;
-    }
-}
-
 enum tok {
     TOK_EOF = -1,
 
@@ -248,108 +894,401 @@ char *stok(enum tok type)
     }
 }
 
+// Documents bigger than a pipe can take in one write are kept in a memfd,
+// which is reopened for every redirection that uses them.
+#define HEREDOC_MEMFD_MIN PIPE_BUF
+#define HEREDOC_FLUSH_SIZE (64 * 1024)
+
 struct heredoc {
     struct heredoc *next;
-    int refs, is_valid;
+    int strip_tabs, fd;
     str_t *end;
     str_t *doc;
 };
 
-struct lexer {
-    enum tok type, saved_type;
-    int quoted, has_token, backslash, is_op, was_quoted, errored;
-    str_t *tok, *src;
-    struct heredoc *heredoc, **heredoc_link;
-    word_t *word, **word_end;
-    int has_ungot, ungotch;
-};
-
-static void lex_link_part(struct lexer *lex, enum word_type type)
+// The heredoc itself lives in the parse tree's arena, but its memfd and the
+// buffer its body is collected in do not
+static void heredoc_cleanup(void *arg)
 {
-    word_t *word = malloc(sizeof(*word));
-    if (!word)
-        abort();
-    word->next = NULL;
-    word->type = type;
-    word->quoted = lex->quoted;
-    word->was_quoted = lex->was_quoted;
-    word->tok = dup_str(lex->tok);
-    str_clear(lex->tok);
-    *lex->word_end = word;
-    lex->word_end = &word->next;
+    struct heredoc *doc = arg;
+    if (doc->fd >= 0)
+        close(doc->fd);
+    doc->fd = -1;
+    str_free_buf(doc->doc);
 }
 
-static word_t *lex_take_word(struct lexer *lex)
+static int write_all(int fd, const void *data, size_t len)
 {
-    word_t *word = lex->word;
-    if (!word)
-        return NULL;
-    lex->word = NULL;
-    lex->word_end = &lex->word;
-    return word;
+    const char *ptr = data;
+    ssize_t ret;
+    while (len) {
+        ret = write(fd, ptr, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return -1;
+        ptr += ret;
+        len -= ret;
+    }
+    return 0;
 }
 
-static void init_lex(struct lexer *lex, str_t *src)
+// Moves an fd the shell keeps open above the 0-9 that scripts redirect by
+// number, so that a redirection like 3>file does not land on it
+static int fd_above_user(int fd)
 {
-    lex->type = TOK_EOF;
-    lex->saved_type = TOK_EOF;
-    lex->quoted = 0;
-    lex->has_token = 0;
-    lex->backslash = 0;
-    lex->is_op = 0;
-    lex->errored = 0;
-    lex->was_quoted = 0;
-    lex->tok = new_str();
-    lex->word = NULL;
-    lex->word_end = &lex->word;
-    lex->heredoc = NULL;
-    lex->heredoc_link = &lex->heredoc;
-    lex->has_ungot = 0;
-    lex->ungotch = 0;
-    lex->src = src ? dup_str(src) : NULL;
+    int moved;
+    if (fd < 0 || fd >= 10)
+        return fd;
+    moved = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    return moved;
 }
 
-static void free_doc(struct heredoc *doc)
+static void doc_flush(struct heredoc *doc)
 {
-    if (!doc || --doc->refs)
+    if (doc->fd < 0 || str_empty(doc->doc))
         return;
-    assert(!doc->next);
-    free_str(doc->end);
-    free_str(doc->doc);
-    free(doc);
+    if (write_all(doc->fd, doc->doc->start, str_len(doc->doc)) < 0)
+        perror("heredoc");
+    str_clear(doc->doc);
 }
 
-static void destroy_lex(struct lexer *lex)
+static void doc_put(struct heredoc *doc, const void *data, size_t len)
 {
-    struct heredoc *doc, *next;
-    free_str(lex->tok);
-    free_word(lex->word);
-    free_str(lex->src);
-    for (doc = lex->heredoc; doc; doc = next) {
-        next = doc->next;
-        doc->next = NULL;
-        doc->is_valid = 1;
-        free_doc(doc);
+    size_t total = str_len(doc->doc) + len;
+    if (doc->fd < 0 && total > HEREDOC_MEMFD_MIN)
+        doc->fd = fd_above_user(memfd_create("heredoc", MFD_CLOEXEC));
+    if (doc->fd >= 0 && total > HEREDOC_FLUSH_SIZE) {
+        doc_flush(doc);
+        if (len > HEREDOC_FLUSH_SIZE) {
+            if (write_all(doc->fd, data, len) < 0)
+                perror("heredoc");
+            return;
+        }
     }
+    str_put(doc->doc, data, len);
 }
 
-static int lex_getc(struct lexer *lex)
+#define INPUT_BLOCK_SIZE (64 * 1024)
+
+enum input_mode {
+    INPUT_STRING,
+    INPUT_FILE,
+    INPUT_TTY,
+    INPUT_PIPE,
+};
+
+// Unread input is always [pos, end). A regular file is read a block at a
+// time and the fd is seeked back to the consumed offset before anything else
+// gets to use it. Pipes can't be seeked, so they are read a byte at a time
+// and never past the end of the current line.
+struct input {
+    enum input_mode mode;
+    int fd;
+    unsigned char *buf, *pos, *end;
+    size_t size;
+    void *map;
+    size_t map_size;
+};
+
+static void init_input_fd(struct input *in, int fd)
 {
-    if (lex->has_ungot) {
-        lex->has_ungot = 0;
-        return lex->ungotch;
-    }
-    if (lex->src)
-        return str_getc(lex->src);
-    return getc(stdin);
+    struct stat sb;
+    in->fd = fd;
+    if (isatty(fd))
+        in->mode = INPUT_TTY;
+    else if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode))
+        in->mode = INPUT_FILE;
+    else
+        in->mode = INPUT_PIPE;
+    in->size = in->mode == INPUT_FILE ? INPUT_BLOCK_SIZE : 4096;
+    in->buf = malloc(in->size);
+    if (!in->buf)
+        abort();
+    in->pos = in->end = in->buf;
+    in->map = NULL;
+    in->map_size = 0;
 }
 
-static void lex_ungetc(struct lexer *lex, int ch)
+static void init_input_str(struct input *in, str_t *src)
 {
-    if (ch < 0)
-        return;
-    lex->has_ungot = 1;
-    lex->ungotch = ch;
+    in->mode = INPUT_STRING;
+    in->fd = -1;
+    in->buf = NULL;
+    in->size = 0;
+    in->pos = src ? src->start : NULL;
+    in->end = src ? src->end : NULL;
+    in->map = NULL;
+    in->map_size = 0;
+}
+
+static void destroy_input(struct input *in)
+{
+    free(in->buf);
+    if (in->map)
+        munmap(in->map, in->map_size);
+    if (in->fd > STDERR_FILENO)
+        close(in->fd);
+    in->buf = in->pos = in->end = NULL;
+    in->map = NULL;
+}
+
+static ssize_t input_read(struct input *in, void *buf, size_t size)
+{
+    ssize_t ret;
+    do {
+        ret = read(in->fd, buf, size);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Reads more input after what is still unread, moving the unread bytes to
+// the front of the buffer and growing it as needed. Returns the number of
+// bytes added.
+static size_t input_more(struct input *in)
+{
+    unsigned char *ptr, *start;
+    size_t unread = in->end - in->pos;
+    ssize_t ret;
+    if (in->mode == INPUT_STRING)
+        return 0;
+    if (in->pos > in->buf) {
+        memmove(in->buf, in->pos, unread);
+        in->pos = in->buf;
+        in->end = in->buf + unread;
+    }
+    if (unread == in->size) {
+        if (in->size > SIZE_MAX / 2)
+            abort();
+        ptr = realloc(in->buf, in->size * 2);
+        if (!ptr)
+            abort();
+        in->size *= 2;
+        in->pos = in->buf = ptr;
+        in->end = ptr + unread;
+    }
+    start = in->end;
+    switch (in->mode) {
+    case INPUT_FILE:
+    case INPUT_TTY:
+        ret = input_read(in, in->end, in->buf + in->size - in->end);
+        if (ret > 0)
+            in->end += ret;
+        break;
+    default:
+        for (ptr = in->end; ptr < in->buf + in->size; ptr++) {
+            if (input_read(in, ptr, 1) <= 0)
+                break;
+            in->end++;
+            if (*ptr == '\n')
+                break;
+        }
+        break;
+    }
+    return in->end - start;
+}
+
+// Refills an empty buffer; returns the number of bytes now available
+static size_t input_fill(struct input *in)
+{
+    if (in->pos < in->end)
+        return in->end - in->pos;
+    if (in->mode == INPUT_STRING)
+        return 0;
+    in->pos = in->end = in->buf;
+    return input_more(in);
+}
+
+// Makes sure the whole current line is buffered and returns its '\n', or the
+// end of the input if the last line has none.
+static unsigned char *input_line(struct input *in)
+{
+    unsigned char *nl;
+    size_t scanned = 0;
+    while (1) {
+        if (in->pos + scanned < in->end &&
+                (nl = memchr(in->pos + scanned, '\n', in->end - in->pos - scanned)))
+            return nl;
+        scanned = in->end - in->pos;
+        if (!input_more(in))
+            return in->end;
+    }
+}
+
+// Gives back whatever was read ahead so the next reader of the fd, usually a
+// child we are about to fork, starts right after the last consumed byte. If
+// the seek fails the buffer is kept, so no input is lost either way.
+static void input_sync(struct input *in)
+{
+    if (in->mode != INPUT_FILE || in->pos == in->end)
+        return;
+    if (lseek(in->fd, -(off_t)(in->end - in->pos), SEEK_CUR) < 0)
+        return;
+    in->pos = in->end = in->buf;
+}
+
+struct lexer {
+    enum tok type, saved_type;
+    int quoted, has_token, backslash, is_op, was_quoted, errored;
+    str_t *tok, *src;
+    struct heredoc *heredoc, **heredoc_link;
+    word_t *word, **word_end;
+    struct input in;
+    unsigned char *view;
+    struct arena arena; // everything parsed since the last lex_release()
+    struct lexer *outer; // for a file run with ., the script it came from
+};
+
+#define PARSE_CHUNK_SIZE (16 * 1024)
+
+static word_t *lex_link_part(struct lexer *lex, enum word_type type)
+{
+    word_t *word = arena_alloc(&lex->arena, sizeof(*word));
+    word->next = NULL;
+    word->op = PARAM_PLAIN;
+    word->colon = 0;
+    word->arg = NULL;
+    word->arith = NULL;
+    word->body = NULL;
+    word->type = type;
+    word->quoted = lex->quoted;
+    word->was_quoted = lex->was_quoted;
+    if (lex->view)
+        word->tok = arena_view(&lex->arena, lex->view, str_len(lex->tok));
+    else
+        word->tok = arena_dup_str(&lex->arena, lex->tok);
+    word->sym = type == WORD_PARAMETER ? intern_str(word->tok) : NULL;
+    str_clear(lex->tok);
+    *lex->word_end = word;
+    lex->word_end = &word->next;
+    return word;
+}
+
+static word_t *lex_take_word(struct lexer *lex)
+{
+    word_t *word = lex->word;
+    if (!word)
+        return NULL;
+    lex->word = NULL;
+    lex->word_end = &lex->word;
+    return word;
+}
+
+// Reads from src, which the lexer takes over, or from fd if src is NULL
+static void init_lex(struct lexer *lex, str_t *src, int fd)
+{
+    lex->type = TOK_EOF;
+    lex->saved_type = TOK_EOF;
+    lex->quoted = 0;
+    lex->has_token = 0;
+    lex->backslash = 0;
+    lex->is_op = 0;
+    lex->errored = 0;
+    lex->was_quoted = 0;
+    lex->tok = new_str();
+    lex->word = NULL;
+    lex->word_end = &lex->word;
+    lex->heredoc = NULL;
+    lex->heredoc_link = &lex->heredoc;
+    lex->view = NULL;
+    lex->outer = NULL;
+    init_arena(&lex->arena, PARSE_CHUNK_SIZE);
+    lex->src = src;
+    if (lex->src)
+        init_input_str(&lex->in, lex->src);
+    else
+        init_input_fd(&lex->in, fd);
+}
+
+// Scripts that are regular files are mapped and lexed in place; anything
+// else is read like stdin.
+static int init_lex_file(struct lexer *lex, const char *path)
+{
+    struct stat sb;
+    void *map;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || !sb.st_size) {
+        init_lex(lex, NULL, fd_above_user(fd));
+        return 0;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        init_lex(lex, NULL, fd_above_user(fd));
+        return 0;
+    }
+    close(fd);
+    init_lex(lex, str_view(map, sb.st_size), -1);
+    lex->in.map = map;
+    lex->in.map_size = sb.st_size;
+    return 0;
+}
+
+// Drops every tree parsed so far. Only called between commands, when the
+// lexer is not holding on to a token.
+static void lex_release(struct lexer *lex)
+{
+    lex->word = NULL;
+    lex->word_end = &lex->word;
+    lex->heredoc = NULL;
+    lex->heredoc_link = &lex->heredoc;
+    arena_drop(&lex->arena);
+}
+
+static void destroy_lex(struct lexer *lex)
+{
+    lex_release(lex);
+    destroy_arena(&lex->arena);
+    free_str(lex->tok);
+    free_str(lex->src);
+    destroy_input(&lex->in);
+}
+
+static inline int lex_getc(struct lexer *lex)
+{
+    if (lex->in.pos < lex->in.end || input_fill(&lex->in))
+        return *lex->in.pos++;
+    return EOF;
+}
+
+// Only ever called with the character lex_getc just returned, which is still
+// sitting in the buffer right behind pos.
+static inline void lex_ungetc(struct lexer *lex, int ch)
+{
+    if (ch < 0)
+        return;
+    assert(lex->in.pos > (lex->in.buf ? lex->in.buf : lex->src->start));
+    lex->in.pos--;
+}
+
+// Appends bytes that come straight out of the input buffer. While the token
+// is one unbroken slice of a source that outlives the parse tree, lex->view
+// points at its start and the word part can reference the source instead of
+// copying it.
+static void lex_put_input(struct lexer *lex, unsigned char *ptr, size_t len)
+{
+    if (lex->in.mode != INPUT_STRING)
+        lex->view = NULL;
+    else if (str_empty(lex->tok))
+        lex->view = ptr;
+    else if (lex->view && lex->view + str_len(lex->tok) != ptr)
+        lex->view = NULL;
+    str_put(lex->tok, ptr, len);
+}
+
+// Appends the character lex_getc just returned
+static inline void lex_put_last(struct lexer *lex)
+{
+    lex_put_input(lex, lex->in.pos - 1, 1);
+}
+
+// Appends a character that isn't a copy of the input at this point
+static inline void lex_putc(struct lexer *lex, int ch)
+{
+    lex->view = NULL;
+    str_putc(lex->tok, ch);
 }
 
 struct tok_def {
@@ -357,53 +1296,147 @@ struct tok_def {
     enum tok type;
 };
 
+// (text, token, token for the text minus its last char, last char)
+#define OPERATORS(X) \
+    X("&", TOK_AND, TOK_EOF, '&') \
+    X("|", TOK_PIPE, TOK_EOF, '|') \
+    X("<", TOK_LESS, TOK_EOF, '<') \
+    X(">", TOK_GREAT, TOK_EOF, '>') \
+    X(";", TOK_SEMI, TOK_EOF, ';') \
+    X("(", TOK_LPAREN, TOK_EOF, '(') \
+    X(")", TOK_RPAREN, TOK_EOF, ')') \
+    X("&&", TOK_AND_IF, TOK_AND, '&') \
+    X("||", TOK_OR_IF, TOK_PIPE, '|') \
+    X(";;", TOK_DSEMI, TOK_SEMI, ';') \
+    X("<<", TOK_DLESS, TOK_LESS, '<') \
+    X(">>", TOK_DGREAT, TOK_GREAT, '>') \
+    X("<&", TOK_LESSAND, TOK_LESS, '&') \
+    X(">&", TOK_GREATAND, TOK_GREAT, '&') \
+    X("<>", TOK_LESSGREAT, TOK_LESS, '>') \
+    X("<<-", TOK_DLESSDASH, TOK_DLESS, '-') \
+    X(">|", TOK_CLOBBER, TOK_GREAT, '|')
+
 static const struct tok_def ops[] = {
-    {"&", TOK_AND},
-    {"|", TOK_PIPE},
-    {"<", TOK_LESS},
-    {">", TOK_GREAT},
-    {";", TOK_SEMI},
-    {"(", TOK_LPAREN},
-    {")", TOK_RPAREN},
-    {"&&", TOK_AND_IF},
-    {"||", TOK_OR_IF},
-    {";;", TOK_DSEMI},
-    {"<<", TOK_DLESS},
-    {">>", TOK_DGREAT},
-    {"<&", TOK_LESSAND},
-    {">&", TOK_GREATAND},
-    {"<>", TOK_LESSGREAT},
-    {"<<-", TOK_DLESSDASH},
-    {">|", TOK_CLOBBER},
+#define X(text, type, prev, last) {text, type},
+    OPERATORS(X)
+#undef X
     {NULL, TOK_EOF},
 };
 
-static int is_opstart(int ch)
+// Operator DFA: op_dfa[current operator + 1][next char] is the operator they
+// form together, or TOK_WORD (0) if they don't.
+static const unsigned char op_dfa[TOK_CLOBBER + 2][128] = {
+#define X(text, type, prev, last) [(prev) + 1][last] = type,
+    OPERATORS(X)
+#undef X
+};
+
+enum char_class {
+    CC_SPACE = 1 << 0,
+    CC_OP = 1 << 1,
+    CC_QUOTE = 1 << 2,
+    CC_DQUOTE = 1 << 3,
+    CC_COMMENT = 1 << 4,
+
+    // Bytes that end an unquoted run of plain word characters
+    CC_WORD_END = CC_SPACE | CC_OP | CC_QUOTE,
+};
+
+static const unsigned char char_class[256] = {
+    ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE, ['\r'] = CC_SPACE, [' '] = CC_SPACE,
+    ['&'] = CC_OP, ['|'] = CC_OP, ['<'] = CC_OP, ['>'] = CC_OP,
+    [';'] = CC_OP, ['('] = CC_OP, [')'] = CC_OP,
+    ['\''] = CC_QUOTE,
+    ['"'] = CC_QUOTE | CC_DQUOTE, ['\\'] = CC_QUOTE | CC_DQUOTE,
+    ['$'] = CC_QUOTE | CC_DQUOTE, ['`'] = CC_QUOTE | CC_DQUOTE,
+    ['#'] = CC_COMMENT,
+};
+
+static inline int is_opstart(int ch)
 {
-    const struct tok_def *def;
-    for (def = ops; def->tok; def++)
-        if (ch == *def->tok)
-            return 1;
-    return 0;
+    return char_class[ch & 0xff] & CC_OP;
 }
 
-static int tok_build_op(struct lexer *lex, int ch)
+static inline int is_blank(int ch)
 {
-    const struct tok_def *def;
-    char op[4] = {0}, end[2] = {ch, 0};
-    if (ch == 0)
-        return 0;
-    if (!str_empty(lex->tok))
-        strcat(op, (void *)lex->tok->start);
-    strcat(op, end);
-    for (def = ops; def->tok; def++) {
-        if (!strcmp(def->tok, op)) {
-            str_putc(lex->tok, ch);
-            lex->type = def->type;
-            return 1;
+    return char_class[ch & 0xff] & CC_SPACE;
+}
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+typedef __m256i vec_t;
+#define VEC_SIZE 32
+#define vec_load(p) _mm256_loadu_si256((const void *)(p))
+#define vec_set1(c) _mm256_set1_epi8(c)
+#define vec_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vec_or(a, b) _mm256_or_si256(a, b)
+#define vec_sub(a, b) _mm256_sub_epi8(a, b)
+#define vec_max(a, b) _mm256_max_epu8(a, b)
+#define vec_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+typedef __m128i vec_t;
+#define VEC_SIZE 16
+#define vec_load(p) _mm_loadu_si128((const void *)(p))
+#define vec_set1(c) _mm_set1_epi8(c)
+#define vec_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define vec_or(a, b) _mm_or_si128(a, b)
+#define vec_sub(a, b) _mm_sub_epi8(a, b)
+#define vec_max(a, b) _mm_max_epu8(a, b)
+#define vec_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#endif
+
+#ifdef VEC_SIZE
+static inline vec_t vec_eqc(vec_t v, char c)
+{
+    return vec_eq(v, vec_set1(c));
+}
+
+static inline vec_t vec_range(vec_t v, unsigned char lo, unsigned char hi)
+{
+    vec_t width = vec_set1(hi - lo);
+    return vec_eq(vec_max(vec_sub(v, vec_set1(lo)), width), width);
+}
+#endif
+
+// Returns the first byte in [ptr, end) that has any of the classes in mask
+static unsigned char *scan_class(unsigned char *ptr, unsigned char *end, int mask)
+{
+#ifdef VEC_SIZE
+    vec_t v, m;
+    uint32_t bits;
+    assert(mask == CC_WORD_END || mask == CC_DQUOTE);
+    for (; end - ptr >= VEC_SIZE; ptr += VEC_SIZE) {
+        v = vec_load(ptr);
+        m = vec_or(vec_or(vec_eqc(v, '"'), vec_eqc(v, '\\')),
+                   vec_or(vec_eqc(v, '$'), vec_eqc(v, '`')));
+        if (mask == CC_WORD_END) {
+            m = vec_or(m, vec_or(vec_range(v, '\t', '\r'), vec_eqc(v, ' ')));
+            m = vec_or(m, vec_or(vec_range(v, '&', ')'), vec_range(v, ';', '<')));
+            m = vec_or(m, vec_or(vec_eqc(v, '>'), vec_eqc(v, '|')));
         }
+        if ((bits = vec_mask(m)))
+            return ptr + __builtin_ctz(bits);
     }
-    return 0;
+#endif
+    while (ptr < end && !(char_class[*ptr] & mask))
+        ptr++;
+    return ptr;
+}
+
+static int tok_build_op(struct lexer *lex, int ch)
+{
+    enum tok type;
+    assert(lex->type >= TOK_EOF && lex->type <= TOK_CLOBBER);
+    if (ch <= 0 || ch >= 128)
+        return 0;
+    type = op_dfa[lex->type + 1][ch];
+    if (type == TOK_WORD)
+        return 0;
+    lex_put_last(lex);
+    lex->type = type;
+    return 1;
 }
 
 void unget_tok(struct lexer *lex, enum tok type)
@@ -424,22 +1457,22 @@ static int is_number(const str_t *s)
 
 static inline long parse_number(str_t *s, int base, int *err)
 {
-    int saved_errno = errno;
-    long val;
-    if (!is_number(s))
-        goto error;
-    errno = 0;
-    val = strtol((void *)s->start, NULL, base);
-    if (errno)
+    const unsigned char *tok;
+    long val = 0, digit;
+    if (!is_number(s) || base < 2 || base > 10)
         goto error;
+    for (tok = s->start; tok < s->end; tok++) {
+        digit = *tok - '0';
+        if (digit >= base || val > (LONG_MAX - digit) / base)
+            goto error;
+        val = val * base + digit;
+    }
     if (err)
         *err = 0;
-    errno = saved_errno;
     return val;
 error:
     if (err)
         *err = 1;
-    errno = saved_errno;
     return LONG_MIN;
 }
 
@@ -491,24 +1524,33 @@ static int is_assignment(const str_t *s)
     return 1;
 }
 
-struct tok_def res_words[] = {
-    {"!", TOK_BANG},
-    {"{", TOK_LBRACE},
-    {"}", TOK_RBRACE},
-    {"case", TOK_CASE},
-    {"do", TOK_DO},
-    {"done", TOK_DONE},
-    {"elif", TOK_ELIF},
-    {"else", TOK_ELSE},
-    {"esac", TOK_ESAC},
-    {"fi", TOK_FI},
-    {"for", TOK_FOR},
-    {"if", TOK_IF},
-    {"in", TOK_IN},
-    {"then", TOK_THEN},
-    {"until", TOK_UNTIL},
-    {"while", TOK_WHILE},
-    {NULL, TOK_EOF},
+// (text, token, first char, last char)
+#define RESERVED_WORDS(X) \
+    X("!", TOK_BANG, '!', '!') \
+    X("{", TOK_LBRACE, '{', '{') \
+    X("}", TOK_RBRACE, '}', '}') \
+    X("case", TOK_CASE, 'c', 'e') \
+    X("do", TOK_DO, 'd', 'o') \
+    X("done", TOK_DONE, 'd', 'e') \
+    X("elif", TOK_ELIF, 'e', 'f') \
+    X("else", TOK_ELSE, 'e', 'e') \
+    X("esac", TOK_ESAC, 'e', 'c') \
+    X("fi", TOK_FI, 'f', 'i') \
+    X("for", TOK_FOR, 'f', 'r') \
+    X("if", TOK_IF, 'i', 'f') \
+    X("in", TOK_IN, 'i', 'n') \
+    X("then", TOK_THEN, 't', 'n') \
+    X("until", TOK_UNTIL, 'u', 'l') \
+    X("while", TOK_WHILE, 'w', 'e')
+
+// Perfect hash over the reserved words. A collision would make two
+// initializers below land in the same slot, which -Wextra reports.
+#define RES_HASH(first, last) (((first) * 5 + (last)) & 31)
+
+static const struct tok_def res_words[32] = {
+#define X(text, type, first, last) [RES_HASH(first, last)] = {text, type},
+    RESERVED_WORDS(X)
+#undef X
 };
 
 int is_tok_name(enum tok tok)
@@ -531,19 +1573,34 @@ int is_tok_word(enum tok tok)
 
 static enum tok match_reserved(const str_t *tok)
 {
-    struct tok_def *def;
-    for (def = res_words; def->tok; def++)
-        if (str_ceq(tok, def->tok))
-            return def->type;
+    const struct tok_def *def;
+    size_t len = str_len(tok);
+    if (!len || len > 5)
+        return TOK_EOF;
+    def = &res_words[RES_HASH(tok->start[0], tok->end[-1])];
+    if (def->tok && str_ceq(tok, def->tok))
+        return def->type;
     return TOK_EOF;
 }
 
+// Whether the word so far has a part that makes a field of its own, even
+// when everything it expands to is empty
+static int lex_word_has_field(struct lexer *lex)
+{
+    word_t *part;
+    for (part = lex->word; part; part = part->next)
+        if (part->quoted || part->type == WORD_STRING)
+            return 1;
+    return 0;
+}
+
 static void tok_rec(struct lexer *lex, int ch, enum word_type type)
 {
     str_t *tok;
     enum tok res;
 
-    if (!str_empty(lex->tok))
+    // an empty "" or '' still has to leave a (empty) string behind
+    if (!str_empty(lex->tok) || (lex->was_quoted && !lex_word_has_field(lex)))
         lex_link_part(lex, type);
 
     lex->has_token = 1;
@@ -594,7 +1651,6 @@ void syntax_error(struct lexer *lex, char *fmt, ...)
 
 void lex_reset_skip_line(struct lexer *lex)
 {
-    struct heredoc *doc, *next;
     int c;
     while ((c = lex_getc(lex)) != '\n')
         if (c == -1)
@@ -603,52 +1659,37 @@ void lex_reset_skip_line(struct lexer *lex)
     lex->type = TOK_EOF;
     lex->has_token = 1;
     lex->errored = 0;
-    for (doc = lex->heredoc; doc; doc = next) {
-        next = doc->next;
-        doc->next = NULL;
-        doc->is_valid = 1;
-        free_doc(doc);
-    }
     lex->heredoc = NULL;
     lex->heredoc_link = &lex->heredoc;
 }
 
+// Reads whole lines out of the input buffer until the delimiter line, which
+// is left unconsumed from its newline on.
 static void read_heredoc(struct lexer *lex, struct heredoc *doc)
 {
-    int ch;
-    unsigned char *cur;
-
-    while ((ch = lex_getc(lex)) != '\n')
-        if (ch < 0)
-            return;
-
-    while (1) {
-        for (cur = doc->end->start; cur < doc->end->end; cur++) {
-            ch = lex_getc(lex);
-            if (ch < 0)
-                return;
-            if (ch != *cur) {
-                lex_ungetc(lex, ch);
-                break;
-            }
-        }
-
-        if (cur == doc->end->end) {
-            ch = lex_getc(lex);
-            lex_ungetc(lex, ch);
-            if (ch < 0 || ch == '\n')
-                return;
+    struct input *in = &lex->in;
+    unsigned char *line, *nl;
+    size_t len = str_len(doc->end);
+
+    nl = input_line(in);
+    in->pos = nl < in->end ? nl + 1 : nl;
+
+    while (in->pos < in->end || input_fill(in)) {
+        nl = input_line(in);
+        line = in->pos;
+        if (doc->strip_tabs)
+            while (line < nl && *line == '\t')
+                line++;
+        if ((size_t)(nl - line) == len && !memcmp(line, doc->end->start, len)) {
+            in->pos = nl;
+            break;
         }
-
-        str_put(doc->doc, doc->end->start, cur - doc->end->start);
-
-        do {
-            ch = lex_getc(lex);
-            if (ch < 0)
-                return;
-            str_putc(doc->doc, ch);
-        } while (ch != '\n');
+        if (nl < in->end)
+            nl++;
+        doc_put(doc, line, nl - line);
+        in->pos = nl;
     }
+    doc_flush(doc);
 }
 
 static void lex_read_heredocs(struct lexer *lex)
@@ -656,62 +1697,478 @@ static void lex_read_heredocs(struct lexer *lex)
     struct heredoc *doc;
     while ((doc = lex->heredoc)) {
         read_heredoc(lex, doc);
-        doc->is_valid = 1;
         if (!(lex->heredoc = doc->next))
             lex->heredoc_link = &lex->heredoc;
         doc->next = NULL;
-        free_doc(doc);
     }
 }
 
-enum tok get_tok(struct lexer *lex)
+// Appends the rest of a run of plain word characters straight from the input
+// buffer, up to the next byte one of the rules below has to look at.
+static void lex_scan_word(struct lexer *lex)
 {
-    int ch;
+    struct input *in = &lex->in;
+    unsigned char *run;
+    int mask = lex->quoted ? CC_DQUOTE : CC_WORD_END;
+    do {
+        run = scan_class(in->pos, in->end, mask);
+        if (run > in->pos)
+            lex_put_input(lex, in->pos, run - in->pos);
+        in->pos = run;
+    } while (run == in->end && input_fill(in));
+}
 
-    if (lex->errored)
-        return TOK_EOF;
+// Appends everything up to the closing quote; returns 0 on EOF
+static int lex_scan_quote(struct lexer *lex)
+{
+    struct input *in = &lex->in;
+    unsigned char *run;
+    do {
+        run = memchr(in->pos, '\'', in->end - in->pos);
+        if (!run)
+            run = in->end;
+        if (run > in->pos)
+            lex_put_input(lex, in->pos, run - in->pos);
+        in->pos = run;
+        if (run < in->end) {
+            in->pos++;
+            return 1;
+        }
+    } while (input_fill(in));
+    return 0;
+}
 
-    if (lex->saved_type != TOK_EOF) {
-        lex->type = lex->saved_type;
-        lex->saved_type = TOK_EOF;
-        lex->has_token = 1;
-        return lex->type;
-    }
+static void lex_skip_comment(struct lexer *lex)
+{
+    struct input *in = &lex->in;
+    unsigned char *run;
+    do {
+        run = memchr(in->pos, '\n', in->end - in->pos);
+        in->pos = run ? run : in->end;
+        if (run)
+            return;
+    } while (input_fill(in));
+}
 
-    if (lex->has_token) {
-        lex->type = TOK_EOF;
-        lex->has_token = 0;
-        lex->was_quoted = 0;
-        str_clear(lex->tok);
-        free_word(lex->word);
-        lex->word = NULL;
-        lex->word_end = &lex->word;
-    }
+static int is_name_char(int ch, int first)
+{
+    return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') ||
+        ch == '_' || (!first && ch >= '0' && ch <= '9');
+}
 
-    while (1) {
-        ch = lex_getc(lex);
+static int is_special_param(int ch)
+{
+    return (ch >= '0' && ch <= '9') || ch == '#' || ch == '@' ||
+        ch == '*' || ch == '?' || ch == '$';
+}
 
-        // rule 1 - end of input
-        if (ch == EOF) {
-            tok_rec(lex, 0, WORD_STRING);
-            return lex->type;
-        }
+// Links what is in tok as a string that is quoted no matter where it is
+static void lex_link_quoted(struct lexer *lex)
+{
+    int quoted = lex->quoted;
+    lex->quoted = 1;
+    lex_link_part(lex, WORD_STRING);
+    lex->quoted = quoted;
+}
 
-        if (lex->is_op) {
-            // rule 2 - try to form an operator
-            if (tok_build_op(lex, ch))
-                continue;
+static void lex_dollar(struct lexer *lex);
 
-            // rule 3 - finish an operator
-            if (ch == '\\') {
+// The word after the operator in ${name<op>word}, up to the closing brace,
+// lexed into parts of its own. Returns 0 on EOF.
+static int lex_brace_word(struct lexer *lex)
+{
+    int ch, outer = lex->quoted, inner = 0;
+    while (1) {
+        ch = lex_getc(lex);
+        if (ch == EOF)
+            return 0;
+        if (lex->backslash || ch == '\\') {
+            if (!lex->backslash)
                 ch = lex_getc(lex);
-                if (ch == '\n')
-                    continue;
-                lex->backslash = 1;
+            lex->backslash = 0;
+            if (ch == '\n')
+                continue;
+            if (ch == EOF)
+                return 0;
+            if (lex->quoted && ch != '$' && ch != '`' && ch != '"' &&
+                    ch != '\\' && ch != '}') {
+                lex_putc(lex, '\\');
+                lex_put_last(lex);
+                continue;
             }
-            assert(lex->type != TOK_EOF);
-            lex_ungetc(lex, ch);
-            lex->is_op = 0;
+            if (!str_empty(lex->tok))
+                lex_link_part(lex, WORD_STRING);
+            lex_put_last(lex);
+            lex_link_quoted(lex);
+            continue;
+        }
+        if (ch == '\'' && !lex->quoted) {
+            lex->was_quoted = 1;
+            if (!str_empty(lex->tok))
+                lex_link_part(lex, WORD_STRING);
+            if (!lex_scan_quote(lex))
+                return 0;
+            lex_link_quoted(lex);
+            continue;
+        }
+        if (ch == '"') {
+            lex->was_quoted = 1;
+            if (!str_empty(lex->tok))
+                lex_link_part(lex, WORD_STRING);
+            inner = !inner;
+            lex->quoted = outer || inner;
+            continue;
+        }
+        if (ch == '$') {
+            lex_dollar(lex);
+            continue;
+        }
+        if (ch == '}' && !inner) {
+            if (!str_empty(lex->tok))
+                lex_link_part(lex, WORD_STRING);
+            return 1;
+        }
+        lex_put_last(lex);
+    }
+}
+
+// ${...}, with the ${ already read
+static void lex_brace(struct lexer *lex)
+{
+    enum param_op op = PARAM_PLAIN;
+    word_t *part, *outer, **outer_end;
+    int ch, colon = 0, quoted = lex->quoted;
+
+    ch = lex_getc(lex);
+    if (ch == '#') {
+        ch = lex_getc(lex);
+        if (ch == '}') {
+            lex_putc(lex, '#');
+            lex_link_part(lex, WORD_PARAMETER);
+            return;
+        }
+        op = PARAM_LENGTH;
+    }
+    if (ch >= '0' && ch <= '9') {
+        do {
+            lex_put_last(lex);
+            ch = lex_getc(lex);
+        } while (ch >= '0' && ch <= '9');
+    } else if (is_special_param(ch)) {
+        lex_put_last(lex);
+        ch = lex_getc(lex);
+    } else {
+        while (is_name_char(ch, str_empty(lex->tok))) {
+            lex_put_last(lex);
+            ch = lex_getc(lex);
+        }
+    }
+    if (str_empty(lex->tok))
+        goto bad;
+    part = lex_link_part(lex, WORD_PARAMETER);
+    part->op = op;
+    if (ch == '}')
+        return;
+    if (op == PARAM_LENGTH)
+        goto bad;
+    if (ch == ':') {
+        colon = 1;
+        ch = lex_getc(lex);
+    }
+    switch (ch) {
+    case '-':
+        op = PARAM_DEFAULT;
+        break;
+    case '=':
+        op = PARAM_ASSIGN;
+        break;
+    case '?':
+        op = PARAM_ERROR;
+        break;
+    case '+':
+        op = PARAM_ALTERNATE;
+        break;
+    case '%': case '#':
+        if (colon)
+            goto bad;
+        op = ch == '%' ? PARAM_SUFFIX : PARAM_PREFIX;
+        if ((ch = lex_getc(lex)) == (op == PARAM_SUFFIX ? '%' : '#'))
+            op = op == PARAM_SUFFIX ? PARAM_LONG_SUFFIX : PARAM_LONG_PREFIX;
+        else
+            lex_ungetc(lex, ch);
+        break;
+    default:
+        goto bad;
+    }
+    part->op = op;
+    part->colon = colon;
+
+    outer = lex->word;
+    outer_end = lex->word_end;
+    lex->word = NULL;
+    lex->word_end = &lex->word;
+    // a pattern is only quoted by the quotes inside the braces
+    if (op >= PARAM_SUFFIX)
+        lex->quoted = 0;
+    if (!lex_brace_word(lex))
+        syntax_error(lex, "Unterminated ${\n");
+    part->arg = lex->word;
+    lex->word = outer;
+    lex->word_end = outer_end;
+    lex->quoted = quoted;
+    return;
+
+bad:
+    str_clear(lex->tok);
+    syntax_error(lex, "Bad substitution\n");
+}
+
+static void lex_backtick(struct lexer *lex);
+static word_t *copy_word(struct arena *a, const word_t *word);
+
+// The text of a $((...)) as a word of its own, expanded as if in double
+// quotes, for an expression with expansions that arith_parse() does not
+// take, such as ${#x}, ${x:-5} or $(cmd)
+static word_t *lex_arith_word(struct lexer *lex, const str_t *text)
+{
+    struct lexer sub;
+    word_t *word = NULL;
+    int ch;
+    init_lex(&sub, dup_str(text), -1);
+    sub.quoted = 1;
+    while ((ch = lex_getc(&sub)) != EOF) {
+        if (ch == '$') {
+            lex_dollar(&sub);
+            continue;
+        }
+        if (ch == '`') {
+            lex_backtick(&sub);
+            continue;
+        }
+        if (ch == '\\' && (ch = lex_getc(&sub)) != '$' && ch != '`' &&
+                ch != '\\') {
+            lex_putc(&sub, '\\');
+            if (ch == EOF)
+                break;
+        }
+        lex_putc(&sub, ch);
+    }
+    if (!str_empty(sub.tok))
+        lex_link_part(&sub, WORD_STRING);
+    if (sub.errored)
+        lex->errored = 1;
+    else
+        word = copy_word(&lex->arena, sub.word);
+    destroy_lex(&sub);
+    return word;
+}
+
+// $((...)), with the $(( already read. The expression is kept as written,
+// for the cache, and parsed right away. One with expansions in it that the
+// expression parser does not take is expanded first, when it is evaluated.
+static void lex_arith(struct lexer *lex)
+{
+    word_t *part;
+    const char *err;
+    int ch, depth = 0;
+    while (1) {
+        ch = lex_getc(lex);
+        if (ch == EOF) {
+            syntax_error(lex, "Unterminated $((\n");
+            return;
+        }
+        if (ch == '(') {
+            depth++;
+        } else if (ch == ')' && depth) {
+            depth--;
+        } else if (ch == ')') {
+            if (lex_getc(lex) == ')')
+                break;
+            syntax_error(lex, "Expected ))\n");
+            return;
+        }
+        lex_put_last(lex);
+    }
+    part = lex_link_part(lex, WORD_ARITHMETIC);
+    if ((part->arith = arith_compile(&lex->arena, part->tok, &err)))
+        return;
+    if (memchr(part->tok->start, '$', str_len(part->tok)) ||
+            memchr(part->tok->start, '`', str_len(part->tok)))
+        part->arg = lex_arith_word(lex, part->tok);
+    else
+        syntax_error(lex, "Bad arithmetic expression: %s\n", err);
+}
+
+int lex_accept(struct lexer *lex, enum tok expected);
+union node *parse_compound(struct lexer *lex);
+union node *parse_all(struct lexer *lex);
+static union node *copy_node(struct arena *a, const union node *node);
+
+// $(...), with the $( already read. The commands are parsed right here by
+// the same lexer, with the word they are part of put aside until the ).
+static void lex_command(struct lexer *lex)
+{
+    enum tok type = lex->type;
+    int quoted = lex->quoted, was_quoted = lex->was_quoted;
+    word_t *outer = lex->word, **outer_end = lex->word_end;
+    union node *body = NULL;
+
+    lex->type = TOK_EOF;
+    lex->quoted = lex->was_quoted = 0;
+    lex->word = NULL;
+    lex->word_end = &lex->word;
+    if (!lex_accept(lex, TOK_RPAREN)) {
+        body = parse_compound(lex);
+        if (body && !lex_accept(lex, TOK_RPAREN))
+            syntax_error(lex, "Expected )\n");
+    }
+
+    str_clear(lex->tok);
+    lex->has_token = 0;
+    lex->type = type;
+    lex->quoted = quoted;
+    lex->was_quoted = was_quoted;
+    lex->word = outer;
+    lex->word_end = outer_end;
+    lex_link_part(lex, WORD_COMMAND)->body = body;
+}
+
+// `...`, with the first ` already read. Backslashes quote $, ` and \ (and "
+// inside double quotes) on the way in, and what is left is parsed on its own
+// and copied into our arena.
+static void lex_backtick(struct lexer *lex)
+{
+    struct lexer sub;
+    str_t *text = new_str();
+    union node *body;
+    int ch;
+
+    if (!str_empty(lex->tok))
+        lex_link_part(lex, WORD_STRING);
+    while ((ch = lex_getc(lex)) != '`') {
+        if (ch == EOF) {
+            free_str(text);
+            syntax_error(lex, "Unterminated `\n");
+            return;
+        }
+        if (ch == '\\') {
+            ch = lex_getc(lex);
+            if (ch != '$' && ch != '`' && ch != '\\' &&
+                    !(lex->quoted && ch == '"'))
+                str_putc(text, '\\');
+            if (ch == EOF)
+                continue;
+        }
+        str_putc(text, ch);
+    }
+
+    init_lex(&sub, text, -1);
+    body = parse_all(&sub);
+    if (sub.errored)
+        lex->errored = 1;
+    else
+        lex_link_part(lex, WORD_BACKTICK)->body = copy_node(&lex->arena, body);
+    destroy_lex(&sub);
+}
+
+// Everything that starts with a $, with the $ already read. Whatever is in
+// tok before it becomes a string part of its own.
+static void lex_dollar(struct lexer *lex)
+{
+    int ch;
+    if (!str_empty(lex->tok))
+        lex_link_part(lex, WORD_STRING);
+    ch = lex_getc(lex);
+    if (ch == '{') {
+        lex_brace(lex);
+        return;
+    }
+    if (ch == '(') {
+        if ((ch = lex_getc(lex)) == '(') {
+            lex_arith(lex);
+        } else {
+            lex_ungetc(lex, ch);
+            lex_command(lex);
+        }
+        return;
+    }
+    if (is_special_param(ch)) {
+        lex_put_last(lex);
+        lex_link_part(lex, WORD_PARAMETER);
+        return;
+    }
+    lex_ungetc(lex, ch);
+    while (1) {
+        ch = lex_getc(lex);
+        if (ch == '\\') {
+            ch = lex_getc(lex);
+            if (ch == '\n')
+                continue;
+            lex_ungetc(lex, ch);
+            lex->backslash = 1;
+            break;
+        }
+        if (!is_name_char(ch, str_empty(lex->tok))) {
+            lex_ungetc(lex, ch);
+            break;
+        }
+        lex_put_last(lex);
+    }
+    if (!str_empty(lex->tok))
+        lex_link_part(lex, WORD_PARAMETER);
+    else
+        lex_putc(lex, '$');
+}
+
+enum tok get_tok(struct lexer *lex)
+{
+    int ch;
+
+    if (lex->errored)
+        return TOK_EOF;
+
+    if (lex->saved_type != TOK_EOF) {
+        lex->type = lex->saved_type;
+        lex->saved_type = TOK_EOF;
+        lex->has_token = 1;
+        return lex->type;
+    }
+
+    if (lex->has_token) {
+        lex->type = TOK_EOF;
+        lex->has_token = 0;
+        lex->was_quoted = 0;
+        str_clear(lex->tok);
+        lex->word = NULL;
+        lex->word_end = &lex->word;
+    }
+
+    while (1) {
+        ch = lex_getc(lex);
+
+        // rule 1 - end of input
+        if (ch == EOF) {
+            if (lex->quoted)
+                syntax_error(lex, "Unterminated quote\n");
+            tok_rec(lex, 0, WORD_STRING);
+            return lex->type;
+        }
+
+        if (lex->is_op) {
+            // rule 2 - try to form an operator
+            if (tok_build_op(lex, ch))
+                continue;
+
+            // rule 3 - finish an operator
+            if (ch == '\\') {
+                ch = lex_getc(lex);
+                if (ch == '\n')
+                    continue;
+                lex->backslash = 1;
+            }
+            assert(lex->type != TOK_EOF);
+            lex_ungetc(lex, ch);
+            lex->is_op = 0;
             tok_rec(lex, 0, WORD_STRING);
             return lex->type;
         }
@@ -724,28 +2181,21 @@ enum tok get_tok(struct lexer *lex)
             if (ch == '\n')
                 continue;
             lex->was_quoted = 1;
-            if (lex->quoted && (ch == '$' || ch == '`' ||
-                        ch == '"' || ch == '\\' ||
-                        ch == '\n')) {
-                lex_ungetc(lex, ch);
-                lex->type = TOK_WORD;
-                str_putc(lex->tok, '\\');
-                continue;
-            }
             lex->type = TOK_WORD;
-            str_putc(lex->tok, ch);
+            // inside double quotes it only quotes the characters that are
+            // special there
+            if (lex->quoted && ch != '$' && ch != '`' && ch != '"' &&
+                    ch != '\\')
+                lex_putc(lex, '\\');
+            lex_put_last(lex);
             continue;
         }
 
         if (!lex->quoted && ch == '\'') {
             lex->was_quoted = 1;
             lex->type = TOK_WORD;
-            while (1) {
-                ch = lex_getc(lex);
-                if (ch == '\'')
-                    break;
-                str_putc(lex->tok, ch);
-            }
+            if (!lex_scan_quote(lex))
+                syntax_error(lex, "Unterminated quote\n");
             continue;
         }
 
@@ -761,36 +2211,16 @@ enum tok get_tok(struct lexer *lex)
         // rule 5 - substitution
         if (ch == '$') {
             //TODO: Arthmetic exprs, etc...
-            if (!str_empty(lex->tok))
-                lex_link_part(lex, WORD_STRING);
-            while (1) {
-                ch = lex_getc(lex);
-                if (ch == '\\') {
-                    ch = lex_getc(lex);
-                    if (ch == '\n')
-                        continue;
-                    lex_ungetc(lex, ch);
-                    lex->backslash = 1;
-                    break;
-                }
-                if (!((ch >= 'A' && ch <= 'Z') ||
-                        (ch >= 'a' && ch <= 'z') ||
-                        (!str_empty(lex->tok) && ch >= '0' && ch <= '9'))) {
-                    lex_ungetc(lex, ch);
-                    break;
-                }
-                str_putc(lex->tok, ch);
-            }
             lex->type = TOK_WORD;
-            if (!str_empty(lex->tok)) {
-                lex_link_part(lex, WORD_PARAMETER);
-            } else {
-                str_putc(lex->tok, '$');
-            }
+            lex_dollar(lex);
             continue;
         }
 
-        //TODO backtick
+        if (ch == '`') {
+            lex->type = TOK_WORD;
+            lex_backtick(lex);
+            continue;
+        }
 
         // rule 6 - start of an operator
         if (!lex->quoted && is_opstart(ch)) {
@@ -817,14 +2247,14 @@ enum tok get_tok(struct lexer *lex)
                     continue;
                 }
                 lex->type = TOK_NEWLINE;
-                str_putc(lex->tok, ch);
+                lex_put_last(lex);
                 tok_rec(lex, 0, WORD_STRING);
                 return lex->type;
             }
         }
 
         // rule 8 - space
-        if (!lex->quoted && isspace(ch)) {
+        if (!lex->quoted && is_blank(ch)) {
             if (lex->type != TOK_EOF) {
                 tok_rec(lex, 0, WORD_STRING);
                 return lex->type;
@@ -834,24 +2264,21 @@ enum tok get_tok(struct lexer *lex)
 
         // rule 9 - word
         if (lex->type == TOK_WORD) {
-            str_putc(lex->tok, ch);
+            lex_put_last(lex);
+            lex_scan_word(lex);
             continue;
         }
 
         // rule 10 - comment
-        if (!lex->quoted && ch == '#') {
-            while (1) {
-                ch = lex_getc(lex);
-                if (ch == '\n' || ch == EOF)
-                    break;
-            }
-            lex_ungetc(lex, ch);
+        if (!lex->quoted && (char_class[ch] & CC_COMMENT)) {
+            lex_skip_comment(lex);
             continue;
         }
 
         // rule 11 - start of a word
         lex->type = TOK_WORD;
-        str_putc(lex->tok, ch);
+        lex_put_last(lex);
+        lex_scan_word(lex);
     }
 }
 
@@ -884,17 +2311,12 @@ int lex_peek(struct lexer *lex, enum tok expected)
 str_t *lex_accept_single_word(struct lexer *lex, enum tok tok)
 {
     word_t *word;
-    str_t *str;
     if (!lex_accept(lex, tok))
         return NULL;
     word = lex_take_word(lex);
-    if (word->next || word->quoted || word->type != WORD_STRING) {
-        free_word(word);
+    if (word->next || word->quoted || word->type != WORD_STRING)
         return NULL;
-    }
-    str = dup_str(word->tok);
-    free_word(word);
-    return str;
+    return word->tok;
 }
 
 word_t *lex_accept_word(struct lexer *lex)
@@ -925,11 +2347,11 @@ struct redirect {
     struct heredoc *doc;
 };
 
-struct heredoc *lex_start_heredoc(struct lexer *lex)
+struct heredoc *lex_start_heredoc(struct lexer *lex, int strip_tabs)
 {
     struct heredoc *doc;
     word_t *first;
-    if (!lex_peek(lex, TOK_WORD))
+    if (!lex_accept(lex, TOK_WORD))
         return NULL;
 
     first = lex->word;
@@ -941,15 +2363,13 @@ struct heredoc *lex_start_heredoc(struct lexer *lex)
         lex->word_end = &lex->word;
     first->next = NULL;
 
-    doc = malloc(sizeof(*doc));
-    if (!doc)
-        abort();
+    doc = arena_alloc(&lex->arena, sizeof(*doc));
     doc->next = NULL;
-    doc->refs = 2;
-    doc->is_valid = 0;
-    doc->end = dup_str(first->tok);
-    free_word(first);
-    doc->doc = new_str();
+    doc->strip_tabs = strip_tabs;
+    doc->fd = -1;
+    doc->end = first->tok;
+    doc->doc = arena_view(&lex->arena, NULL, 0);
+    arena_defer(&lex->arena, heredoc_cleanup, doc);
     *lex->heredoc_link = doc;
     lex->heredoc_link = &doc->next;
     return doc;
@@ -971,7 +2391,7 @@ static struct redirect *parse_redirect(struct lexer *lex)
             syntax_error(lex, "Bad IO_NUMBER\n");
             return NULL;
         }
-        return NULL;
+        must_match = 1;
     }
 
     tok = get_tok(lex);
@@ -1001,7 +2421,7 @@ static struct redirect *parse_redirect(struct lexer *lex)
     }
 
     if (tok == TOK_DLESS || tok == TOK_DLESSDASH) {
-        doc = lex_start_heredoc(lex);
+        doc = lex_start_heredoc(lex, tok == TOK_DLESSDASH);
         if (!doc) {
             syntax_error(lex, "Bad redirection: expected heredoc\n");
             return NULL;
@@ -1014,9 +2434,7 @@ static struct redirect *parse_redirect(struct lexer *lex)
         }
     }
 
-    re = malloc(sizeof(*re));
-    if (!re)
-        abort();
+    re = arena_alloc(&lex->arena, sizeof(*re));
     re->next = NULL;
     re->fd = fd;
     re->op = tok;
@@ -1028,7 +2446,7 @@ static struct redirect *parse_redirect(struct lexer *lex)
 
 struct var {
     struct var *next;
-    str_t *name;
+    const struct symbol *name;
     word_t *val;
 };
 
@@ -1054,7 +2472,6 @@ enum cmd_type {
 
 struct cmd_base {
     enum cmd_type type;
-    int refs;
 };
 
 struct cmd {
@@ -1118,7 +2535,7 @@ struct item {
 
 struct for_loop {
     struct cmd_base base;
-    str_t *name;
+    const struct symbol *name;
     int use_args;
     struct item *items;
     union node *command;
@@ -1126,7 +2543,7 @@ struct for_loop {
 
 struct function {
     struct cmd_base base;
-    str_t *name;
+    const struct symbol *name;
     union node *command;
 };
 
@@ -1151,221 +2568,93 @@ typedef union node {
     struct cases cases;
 } node_t;
 
-static node_t *alloc_node(enum cmd_type type)
+static node_t *alloc_node(struct arena *a, enum cmd_type type)
 {
-    node_t *c = malloc(sizeof(*c));
-    if (!c)
-        abort();
+    node_t *c = arena_alloc(a, sizeof(*c));
     memset(c, 0, sizeof(*c));
     c->base.type = type;
-    c->base.refs = 1;
     return c;
 }
 
-static node_t *ref_node(node_t *node)
+static void link_arg(struct arena *arena, struct arg ***aptr, word_t *arg)
 {
-    node->base.refs++;
-    return node;
+    struct arg *a = arena_alloc(arena, sizeof(*a));
+    a->next = NULL;
+    a->val = arg;
+    **aptr = a;
+    *aptr = &a->next;
 }
 
-static void free_redirects(struct redirect *redirects)
+// Splits name=value in place: the name is interned from the front of the
+// token and the value is what is left of the token once its start skips
+// the '='.
+static void link_var(struct arena *a, struct var ***vptr, word_t *var)
 {
-    struct redirect *r, *nr;
-    for (r = redirects; r; r = nr) {
-        nr = r->next;
-        free_word(r->name);
-        free_doc(r->doc);
-        free(r);
-    }
+    struct var *v = arena_alloc(a, sizeof(*v));
+    unsigned char *eq;
+    eq = memchr(var->tok->start, '=', str_len(var->tok));
+    if (!eq)
+        abort();
+    v->next = NULL;
+    v->name = intern(var->tok->start, eq - var->tok->start);
+    var->tok->start = eq + 1;
+    v->val = var;
+    **vptr = v;
+    *vptr = &v->next;
 }
 
-static void free_items(struct item *items)
+static void link_redirect(struct redirect ***rptr, struct redirect *redir)
 {
-    struct item *next;
-    while (items) {
-        next = items->next;
-        free_word(items->val);
-        free(items);
-        items = next;
-    }
+    **rptr = redir;
+    *rptr = &redir->next;
 }
 
-static void free_args(struct arg *args)
+static node_t *wrap_redirs(struct arena *a, node_t *node, struct redirect *r)
 {
-    struct arg *next;
-    while (args) {
-        next = args->next;
-        free_word(args->val);
-        free(args);
-        args = next;
+    struct redirect **link;
+    node_t *wrapped;
+    if (!r || !node)
+        return node;
+    if (node->type == CMD_REDIRS || node->type == CMD_SIMPLE ||
+            node->type == CMD_ASSIGNMENT) {
+        if (node->type == CMD_REDIRS)
+            link = &node->redirs.redirs;
+        else
+            link = &node->simp.redirs;
+        while (*link)
+            link = &(*link)->next;
+        *link = r;
+        return node;
     }
-}
-
-static void free_vars(struct var *vars)
-{
-    struct var *next;
-    while (vars) {
-        next = vars->next;
-        free_str(vars->name);
-        free_word(vars->val);
-        free(vars);
-        vars = next;
-    }
-}
-
-static void free_node(node_t *node)
-{
-    node_t *next = NULL;
-    for (; node && !--node->base.refs; node = next) {
-        switch (node->type) {
-        case CMD_SIMPLE: case CMD_ASSIGNMENT:
-            free_redirects(node->simp.redirs);
-            free_args(node->simp.args);
-            free_vars(node->simp.vars);
-            free(node);
-            next = NULL;
-            break;
-        case CMD_ANDOR:
-            free_node(node->andor.command);
-            next = (node_t *)node->andor.next;
-            free(node);
-            break;
-        case CMD_PIPELINE:
-            free_node(node->pipe.command);
-            next = (node_t *)node->pipe.next;
-            free(node);
-            break;
-        case CMD_COMPOUND:
-            free_node(node->comp.command);
-            next = (node_t *)node->comp.next;
-            free(node);
-            break;
-        case CMD_SUBSHELL:
-            next = node->sub.commands;
-            free(node);
-            break;
-        case CMD_LOOP:
-            free_node(node->loop.cond);
-            next = node->loop.commands;
-            free(node);
-            break;
-        case CMD_COND:
-            free_node(node->cond.cond);
-            free_node(node->cond.commands);
-            next = node->cond.otherwise;
-            free(node);
-            break;
-        case CMD_REDIRS:
-            free_redirects(node->redirs.redirs);
-            next = node->redirs.command;
-            free(node);
-            break;
-        case CMD_FUNCTION:
-            free_str(node->func.name);
-            next = node->func.command;
-            free(node);
-            break;
-        case CMD_FOR_LOOP:
-            free_str(node->for_loop.name);
-            next = node->for_loop.command;
-            free_items(node->for_loop.items);
-            free(node);
-            break;
-        case CMD_CASES:
-            //TODO
-            free(node);
-            next = NULL;
-            break;
-        }
-    }
-}
-
-static void link_arg(struct arg ***aptr, word_t *arg)
-{
-    struct arg *a = malloc(sizeof(*a));
-    if (!a)
-        abort();
-    a->next = NULL;
-    a->val = arg;
-    **aptr = a;
-    *aptr = &a->next;
-}
-
-static void link_var(struct var ***vptr, word_t *var)
-{
-    struct var *v = malloc(sizeof(*v));
-    str_t name, val, *new_val;
-    unsigned char *eq;
-    if (!v)
-        abort();
-    eq = memchr(var->tok->start, '=', str_len(var->tok));
-    if (!eq)
-        abort();
-    name.start = name.buf_start = var->tok->start;
-    name.end = name.buf_end = eq;
-    val.start = val.buf_start = eq + 1;
-    val.end = val.buf_end = var->tok->end;
-    v->next = NULL;
-    v->name = dup_str(&name);
-    new_val = dup_str(&val);
-    free_str(var->tok);
-    var->tok = new_val;
-    v->val = var;
-    **vptr = v;
-    *vptr = &v->next;
-}
-
-static void link_redirect(struct redirect ***rptr, struct redirect *redir)
-{
-    **rptr = redir;
-    *rptr = &redir->next;
-}
-
-static node_t *wrap_redirs(node_t *node, struct redirect *r)
-{
-    struct redirect **link;
-    node_t *wrapped;
-    if (!r)
-        return node;
-    if (!node) {
-        free_redirects(r);
-        return NULL;
-    }
-    if (node->type == CMD_REDIRS || node->type == CMD_SIMPLE ||
-            node->type == CMD_ASSIGNMENT) {
-        if (node->type == CMD_REDIRS)
-            link = &node->redirs.redirs;
-        else
-            link = &node->simp.redirs;
-        while (*link)
-            link = &(*link)->next;
-        *link = r;
-        return node;
-    }
-    wrapped = alloc_node(CMD_REDIRS);
-    wrapped->redirs.command = node;
-    wrapped->redirs.redirs = r;
-    return wrapped;
+    wrapped = alloc_node(a, CMD_REDIRS);
+    wrapped->redirs.command = node;
+    wrapped->redirs.redirs = r;
+    return wrapped;
 }
 
 node_t *parse_compound(struct lexer *lex);
 node_t *parse_single(struct lexer *lex);
 
-word_t *wrap_word(str_t *str)
+word_t *wrap_word(struct arena *a, str_t *str)
 {
-    word_t *word = malloc(sizeof(*word));
-    if (!word)
-        abort();
+    word_t *word = arena_alloc(a, sizeof(*word));
     word->type = WORD_STRING;
     word->quoted = 0;
+    word->was_quoted = 0;
     word->next = NULL;
-    word->tok = dup_str(str);
+    word->tok = str;
+    word->sym = NULL;
+    word->op = PARAM_PLAIN;
+    word->colon = 0;
+    word->arg = NULL;
+    word->arith = NULL;
+    word->body = NULL;
     return word;
 }
 
 static node_t *parse_simple_command(struct lexer *lex)
 {
-    node_t *node = alloc_node(CMD_SIMPLE);
+    node_t *node = alloc_node(&lex->arena, CMD_SIMPLE);
     struct cmd *cmd = &node->simp;
     node_t *body = NULL;
     word_t *word = NULL;
@@ -1388,13 +2677,11 @@ static node_t *parse_simple_command(struct lexer *lex)
                 goto error;
             }
             node->type = CMD_FUNCTION;
-            node->func.name = name;
+            node->func.name = intern_str(name);
             node->func.command = body;
             return node;
         } else {
-            link_arg(&aptr, wrap_word(name));
-            free_str(name);
-            name = NULL;
+            link_arg(&lex->arena, &aptr, wrap_word(&lex->arena, name));
         }
     } else {
         while (1) {
@@ -1402,11 +2689,11 @@ static node_t *parse_simple_command(struct lexer *lex)
                 link_redirect(&rptr, r);
                 continue;
             } else  if ((word = lex_accept_assignment(lex))) {
-                link_var(&vptr, word);
+                link_var(&lex->arena, &vptr, word);
                 continue;
             } else {
                 if ((word = lex_accept_word(lex)))
-                    link_arg(&aptr, word);
+                    link_arg(&lex->arena, &aptr, word);
                 break;
             }
         }
@@ -1416,7 +2703,7 @@ static node_t *parse_simple_command(struct lexer *lex)
         if ((r = parse_redirect(lex))) {
             link_redirect(&rptr, r);
         } else if ((word = lex_accept_word(lex))) {
-            link_arg(&aptr, word);
+            link_arg(&lex->arena, &aptr, word);
         } else {
             if (!cmd->args && !cmd->vars)
                 goto error;
@@ -1426,26 +2713,18 @@ static node_t *parse_simple_command(struct lexer *lex)
 
     if (!cmd->args) {
         cmd->base.type = CMD_ASSIGNMENT;
-        if (rlist) {
-            free_redirects(rlist);
-            rlist = NULL;
-        }
+        rlist = NULL;
     }
 
-    return wrap_redirs((void *)cmd, rlist);
+    return wrap_redirs(&lex->arena, (void *)cmd, rlist);
 
 error:
-    free_str(name);
-    free_redirects(rlist);
-    free_node(node);
     return NULL;
 }
 
-static void link_item(struct item ***iptr, word_t *word)
+static void link_item(struct arena *a, struct item ***iptr, word_t *word)
 {
-    struct item *item = malloc(sizeof(*item));
-    if (!item)
-        abort();
+    struct item *item = arena_alloc(a, sizeof(*item));
     item->val = word;
     item->next = NULL;
     **iptr = item;
@@ -1471,7 +2750,7 @@ node_t *parse_for(struct lexer *lex)
 
     if (lex_accept(lex, TOK_IN)) {
         while ((word = lex_accept_word(lex)))
-            link_item(&iptr, word);
+            link_item(&lex->arena, &iptr, word);
         if (!lex_accept(lex, TOK_SEMI) && !lex_accept(lex, TOK_NEWLINE)) {
             syntax_error(lex, "Expected ;\n");
             goto error;
@@ -1497,17 +2776,14 @@ node_t *parse_for(struct lexer *lex)
         goto error;
     }
 
-    node = alloc_node(CMD_FOR_LOOP);
-    node->for_loop.name = name;
+    node = alloc_node(&lex->arena, CMD_FOR_LOOP);
+    node->for_loop.name = intern_str(name);
     node->for_loop.use_args = use_args;
     node->for_loop.items = items;
     node->for_loop.command = body;
     return node;
 
 error:
-    free_str(name);
-    free_items(items);
-    free_node(body);
     return NULL;
 }
 
@@ -1534,26 +2810,22 @@ node_t *parse_loop(struct lexer *lex)
 
     if (!lex_accept(lex, TOK_DO)) {
         syntax_error(lex, "Expected do\n");
-        free_node(cond);
         return NULL;
     }
 
     cmds = parse_compound(lex);
     if (!cmds) {
         syntax_error(lex, "Expected commands\n");
-        free_node(cmds);
         return NULL;
     }
 
 
     if (!lex_accept(lex, TOK_DONE)) {
         syntax_error(lex, "Expected done\n");
-        free_node(cond);
-        free_node(cmds);
         return NULL;
     }
 
-    node = alloc_node(CMD_LOOP);
+    node = alloc_node(&lex->arena, CMD_LOOP);
     node->loop.until = is_until;
     node->loop.cond = cond;
     node->loop.commands = cmds;
@@ -1586,7 +2858,7 @@ node_t *parse_cond(struct lexer *lex)
             goto error;
         }
 
-        node = alloc_node(CMD_COND);
+        node = alloc_node(&lex->arena, CMD_COND);
         node->cond.cond = cond;
         node->cond.commands = body;
         *eptr = node;
@@ -1614,7 +2886,6 @@ node_t *parse_cond(struct lexer *lex)
     return root;
 
 error:
-    free_node(root);
     return NULL;
 }
 
@@ -1632,11 +2903,10 @@ node_t *parse_subshell(struct lexer *lex)
 
     if (!lex_accept(lex, TOK_RPAREN)) {
         syntax_error(lex, "Expected )\n");
-        free_node(node);
         return NULL;
     }
 
-    sub = alloc_node(CMD_SUBSHELL);
+    sub = alloc_node(&lex->arena, CMD_SUBSHELL);
     sub->sub.background = 0;
     sub->sub.commands = node;
     return sub;
@@ -1656,7 +2926,6 @@ node_t *parse_brace(struct lexer *lex)
 
     if (!lex_accept(lex, TOK_RBRACE)) {
         syntax_error(lex, "Expected }\n");
-        free_node(node);
         return NULL;
     }
 
@@ -1693,7 +2962,7 @@ node_t *parse_single(struct lexer *lex)
     }
     while ((r = parse_redirect(lex)))
         link_redirect(&rptr, r);
-    return wrap_redirs(node, rlist);
+    return wrap_redirs(&lex->arena, node, rlist);
 }
 
 int peek_special(struct lexer *lex)
@@ -1709,9 +2978,10 @@ int peek_special(struct lexer *lex)
     }
 }
 
-void andor_link(struct andor ***ptr, node_t *cmd, int negated, int and)
+void andor_link(struct arena *a, struct andor ***ptr, node_t *cmd,
+        int negated, int and)
 {
-    struct andor *c = (void *)alloc_node(CMD_ANDOR);
+    struct andor *c = (void *)alloc_node(a, CMD_ANDOR);
     c->command = cmd;
     c->negated = negated;
     c->and = and;
@@ -1719,9 +2989,9 @@ void andor_link(struct andor ***ptr, node_t *cmd, int negated, int and)
     *ptr = &c->next;
 }
 
-void pipeline_link(struct pipeline ***ptr, node_t *cmd)
+void pipeline_link(struct arena *a, struct pipeline ***ptr, node_t *cmd)
 {
-    struct pipeline *c = (void *)alloc_node(CMD_PIPELINE);
+    struct pipeline *c = (void *)alloc_node(a, CMD_PIPELINE);
     c->command = cmd;
     if (**ptr)
         (**ptr)->background = 1;
@@ -1729,7 +2999,7 @@ void pipeline_link(struct pipeline ***ptr, node_t *cmd)
     *ptr = &c->next;
 }
 
-node_t *make_background(node_t *node)
+node_t *make_background(struct arena *a, node_t *node)
 {
     node_t *sub;
     struct pipeline *last;
@@ -1743,7 +3013,7 @@ node_t *make_background(node_t *node)
         while (last->next)
             last = last->next;
         assert(last->command->type != CMD_PIPELINE);
-        last->command = make_background(last->command);
+        last->command = make_background(a, last->command);
         return node;
     case CMD_SIMPLE:
         node->simp.background = 1;
@@ -1751,7 +3021,7 @@ node_t *make_background(node_t *node)
     default:
         break;
     }
-    sub = alloc_node(CMD_SUBSHELL);
+    sub = alloc_node(a, CMD_SUBSHELL);
     sub->sub.background = 1;
     sub->sub.commands = node;
     return sub;
@@ -1777,9 +3047,6 @@ node_t *parse_andor(struct lexer *lex)
             if (!(cmd = parse_single(lex)) && !(cmd = parse_simple_command(lex))) {
                 if (match && !lex->errored)
                     syntax_error(lex, "Expected a command\n");
-                free_node((void *)plist);
-                free_node((void *)alist);
-                free_node(cmd);
                 return NULL;
             }
 
@@ -1788,8 +3055,8 @@ node_t *parse_andor(struct lexer *lex)
             if (!lex_accept(lex, TOK_PIPE))
                 break;
 
-            cmd = make_background(cmd);
-            pipeline_link(&pptr, cmd);
+            cmd = make_background(&lex->arena, cmd);
+            pipeline_link(&lex->arena, &pptr, cmd);
             cmd = NULL;
 
             while (lex_accept(lex, TOK_NEWLINE));
@@ -1797,14 +3064,14 @@ node_t *parse_andor(struct lexer *lex)
 
         if (plist) {
             if (cmd)
-                pipeline_link(&pptr, cmd);
+                pipeline_link(&lex->arena, &pptr, cmd);
             cmd = (void *)plist;
         }
 
         if (!(is_and = lex_accept(lex, TOK_AND_IF)) && !lex_accept(lex, TOK_OR_IF))
             break;
 
-        andor_link(&aptr, cmd, negated, is_and);
+        andor_link(&lex->arena, &aptr, cmd, negated, is_and);
         cmd = NULL;
 
         while (lex_accept(lex, TOK_NEWLINE));
@@ -1812,7 +3079,7 @@ node_t *parse_andor(struct lexer *lex)
 
     if (alist) {
         if (cmd)
-            andor_link(&aptr, cmd, negated, 0);
+            andor_link(&lex->arena, &aptr, cmd, negated, 0);
         cmd = (void *)alist;
     }
 
@@ -1821,19 +3088,14 @@ node_t *parse_andor(struct lexer *lex)
 
 node_t *unwrap_compound(struct compound *c)
 {
-    node_t *ret;
-    if (!c->next) {
-        assert(c->base.refs == 1);
-        ret = c->command;
-        free(c);
-        return ret;
-    }
+    if (!c->next)
+        return c->command;
     return (void *)c;
 }
 
-void compound_link(struct compound ***ptr, node_t *cmd)
+void compound_link(struct arena *a, struct compound ***ptr, node_t *cmd)
 {
-    struct compound *c = (void *)alloc_node(CMD_COMPOUND);
+    struct compound *c = (void *)alloc_node(a, CMD_COMPOUND);
     c->command = cmd;
     **ptr = c;
     *ptr = &c->next;
@@ -1855,13 +3117,15 @@ node_t *parse_compound(struct lexer *lex)
             break;
 
         if (lex_accept(lex, TOK_AND)) {
-            node = make_background(node);
-            compound_link(&cptr, node);
+            node = make_background(&lex->arena, node);
+            compound_link(&lex->arena, &cptr, node);
         } else if (lex_accept(lex, TOK_SEMI) ||lex_accept(lex, TOK_NEWLINE)) {
-            compound_link(&cptr, node);
+            compound_link(&lex->arena, &cptr, node);
+        } else if (peek_special(lex)) {
+            // as in (a; b) or $(a), where the ) ends the last command
+            compound_link(&lex->arena, &cptr, node);
+            break;
         } else {
-            free_node(node);
-            free_node((void *)clist);
             syntax_error(lex, "Expected delimiter\n");
             return NULL;
         }
@@ -1889,16 +3153,14 @@ node_t *parse(struct lexer *lex)
 
     while((node = parse_andor(lex))) {
         if (lex_accept(lex, TOK_AND)) {
-            node = make_background(node);
-            compound_link(&cptr, node);
+            node = make_background(&lex->arena, node);
+            compound_link(&lex->arena, &cptr, node);
         } else if (lex_accept(lex, TOK_SEMI)) {
-            compound_link(&cptr, node);
+            compound_link(&lex->arena, &cptr, node);
         } else if (lex_accept(lex, TOK_NEWLINE) || lex_accept(lex, TOK_EOF)) {
-            compound_link(&cptr, node);
+            compound_link(&lex->arena, &cptr, node);
             break;
         } else {
-            free_node(node);
-            free_node((void *)clist);
             syntax_error(lex, "Expected & ; or LF\n");
             return NULL;
         }
@@ -1909,705 +3171,4383 @@ node_t *parse(struct lexer *lex)
         return NULL;
     }
 
-    return unwrap_compound(clist);
-}
-
-struct shell_var {
-    struct shell_var *next;
-    int exported, read_only;
-    str_t *name, *val;
-};
-
-enum eval_exit {
-    EXIT_NEXT,
-    EXIT_LOOP_CONTINUE,
-    EXIT_LOOP_BREAK,
-    EXIT_RETURN,
-};
-
-enum stack_type {
-    STACK_LOOP,
-};
-
-struct stack_frame {
-    struct stack_frame *prev;
-    node_t *next_node, *loop_node;
-    int argc;
-    char **argv;
-};
-struct shell_func {
-    struct shell_func *next;
-    node_t *def;
-};
-
-struct args_frame {
-    struct args_frame *prev;
-    int argc, shift;
-    char **argv;
-};
-
-struct shell {
-    struct lexer lex;
-    struct shell_var *vars;
-    struct shell_func *funcs;
-    struct args_frame *args;
-    int exit_status;
-    int in_func, break_depth, loop_depth;
-};
+    // a word that failed to lex may have been cut short
+    if (lex->errored)
+        return NULL;
 
-void defun(struct shell *sh, struct function *def)
-{
-    struct shell_func **link, *func;
-    for (link = &sh->funcs; (func = *link); link = &func->next) {
-        if (str_eq(func->def->func.name, def->name)) {
-            free_node(func->def);
-            func->def = ref_node((void *)def);
-            return;
-        }
-    }
-    func = malloc(sizeof(*func));
-    if (!func)
-        abort();
-    func->def = ref_node((void *)def);
-    func->next = NULL;
-    *link = func;
+    return unwrap_compound(clist);
 }
 
-extern char **environ;
-
-struct shell_var **getvarlink(struct shell *sh, const str_t *name)
+// Parses everything that is left into one compound list. Whatever parsed
+// before a syntax error is still returned; check lex->errored.
+node_t *parse_all(struct lexer *lex)
 {
-    struct shell_var *var, **link;
-    for (link = &sh->vars; (var = *link); link = &var->next)
-        if (str_eq(var->name, name))
-            return link;
-    return link;
+    struct compound *clist = NULL, **cptr = &clist;
+    node_t *node;
+    while (!lex->errored && (node = parse(lex)))
+        compound_link(&lex->arena, &cptr, node);
+    if (!clist)
+        return NULL;
+    return unwrap_compound(clist);
 }
 
-static void setvar(struct shell *sh, const str_t *name, const str_t *val, int exported)
+static word_t *copy_word(struct arena *a, const word_t *word)
 {
-    struct shell_var *var, **link;
-    for (link = &sh->vars; (var = *link); link = &var->next) {
-        if (str_eq(var->name, name)) {
-            free_str(var->val);
-            if (exported >= 0)
-                var->exported = exported;
-            var->val = dup_str(val);
-            return;
-        }
+    word_t *copy = NULL, **link = &copy, *part;
+    const char *err;
+    for (; word; word = word->next) {
+        part = arena_alloc(a, sizeof(*part));
+        *part = *word;
+        part->next = NULL;
+        part->tok = arena_dup_str(a, word->tok);
+        part->arg = copy_word(a, word->arg);
+        // parsed a second time rather than walking the nodes to copy them
+        if (word->arith && !(part->arith = arith_compile(a, part->tok, &err)))
+            abort();
+        part->body = copy_node(a, word->body);
+        *link = part;
+        link = &part->next;
     }
-    var = malloc(sizeof(*var));
-    if (!var)
-        abort();
-    memset(var, 0, sizeof(*var));
-    var->exported = (exported > 0);
-    var->name = dup_str(name);
-    var->val = dup_str(val);
-    *link = var;
+    return copy;
 }
 
-static const str_t *getvar(struct shell *sh, const str_t *name)
+static struct heredoc *copy_doc(struct arena *a, const struct heredoc *doc)
 {
-    struct shell_var **link = getvarlink(sh, name);
-    if (!*link)
-        return NULL;
-    return (*link)->val;
+    struct heredoc *copy = arena_alloc(a, sizeof(*copy));
+    copy->next = NULL;
+    copy->strip_tabs = doc->strip_tabs;
+    copy->fd = -1;
+    if (doc->fd >= 0 && (copy->fd = fcntl(doc->fd, F_DUPFD_CLOEXEC, 0)) < 0)
+        perror("heredoc");
+    copy->end = arena_dup_str(a, doc->end);
+    copy->doc = arena_dup_str(a, doc->doc);
+    arena_defer(a, heredoc_cleanup, copy);
+    return copy;
 }
 
-static void shell_init(struct shell *sh)
+static struct redirect *copy_redirs(struct arena *a, const struct redirect *r)
 {
-    str_t name, val;
-    char **env, *eq;
-    memset(sh, 0, sizeof(*sh));
-    for (env = environ; *env; env++) {
-        eq = strchr(*env, '=');
-        if (!eq)
-            continue;
-        name.start = name.buf_start = *env;
-        name.end = name.buf_end = eq;
-        val.start = val.buf_start = eq + 1;
-        val.end = val.buf_end = eq + strlen(eq);
-        setvar(sh, &name, &val, 1);
+    struct redirect *copy = NULL, **link = &copy, *re;
+    for (; r; r = r->next) {
+        re = arena_alloc(a, sizeof(*re));
+        *re = *r;
+        re->next = NULL;
+        re->name = copy_word(a, r->name);
+        if (r->doc)
+            re->doc = copy_doc(a, r->doc);
+        *link = re;
+        link = &re->next;
     }
-    init_lex(&sh->lex, NULL);
+    return copy;
 }
 
-static void destroy_shell(struct shell *sh)
+// Deep copies a tree into a, so it can outlive the arena it was parsed into
+static node_t *copy_node(struct arena *a, const node_t *node)
 {
-    struct shell_var *v, *nv;
-    struct shell_func *f, *nf;
-    for (v = sh->vars; v; v = nv) {
-        nv = v->next;
-        free_str(v->name);
-        free_str(v->val);
-        free(v);
-    }
-    for (f = sh->funcs; f; f = nf) {
-        nf = f->next;
-        free_node(f->def);
-        free(f);
+    const struct arg *arg;
+    const struct var *var;
+    const struct item *item;
+    struct arg **aptr;
+    struct var **vptr, *v;
+    struct item **iptr;
+    node_t *copy;
+
+    if (!node)
+        return NULL;
+    copy = alloc_node(a, node->type);
+    *copy = *node;
+    switch (node->type) {
+    case CMD_SIMPLE: case CMD_ASSIGNMENT:
+        copy->simp.redirs = copy_redirs(a, node->simp.redirs);
+        copy->simp.args = NULL;
+        aptr = &copy->simp.args;
+        for (arg = node->simp.args; arg; arg = arg->next)
+            link_arg(a, &aptr, copy_word(a, arg->val));
+        copy->simp.vars = NULL;
+        vptr = &copy->simp.vars;
+        for (var = node->simp.vars; var; var = var->next) {
+            v = arena_alloc(a, sizeof(*v));
+            v->next = NULL;
+            v->name = var->name;
+            v->val = copy_word(a, var->val);
+            *vptr = v;
+            vptr = &v->next;
+        }
+        break;
+    case CMD_ANDOR:
+        copy->andor.command = copy_node(a, node->andor.command);
+        copy->andor.next = (void *)copy_node(a, (node_t *)node->andor.next);
+        break;
+    case CMD_PIPELINE:
+        copy->pipe.command = copy_node(a, node->pipe.command);
+        copy->pipe.next = (void *)copy_node(a, (node_t *)node->pipe.next);
+        break;
+    case CMD_COMPOUND:
+        copy->comp.command = copy_node(a, node->comp.command);
+        copy->comp.next = (void *)copy_node(a, (node_t *)node->comp.next);
+        break;
+    case CMD_SUBSHELL:
+        copy->sub.commands = copy_node(a, node->sub.commands);
+        break;
+    case CMD_LOOP:
+        copy->loop.cond = copy_node(a, node->loop.cond);
+        copy->loop.commands = copy_node(a, node->loop.commands);
+        break;
+    case CMD_COND:
+        copy->cond.cond = copy_node(a, node->cond.cond);
+        copy->cond.commands = copy_node(a, node->cond.commands);
+        copy->cond.otherwise = copy_node(a, node->cond.otherwise);
+        break;
+    case CMD_REDIRS:
+        copy->redirs.redirs = copy_redirs(a, node->redirs.redirs);
+        copy->redirs.command = copy_node(a, node->redirs.command);
+        break;
+    case CMD_FOR_LOOP:
+        copy->for_loop.items = NULL;
+        iptr = &copy->for_loop.items;
+        for (item = node->for_loop.items; item; item = item->next)
+            link_item(a, &iptr, copy_word(a, item->val));
+        copy->for_loop.command = copy_node(a, node->for_loop.command);
+        break;
+    case CMD_FUNCTION:
+        copy->func.command = copy_node(a, node->func.command);
+        break;
+    case CMD_CASES:
+        break;
     }
-    destroy_lex(&sh->lex);
+    return copy;
 }
 
-static int exists(const char *name)
+/*
+ * Flat trees
+ *
+ * The evaluator does not run the parse tree itself but a flattened copy of
+ * it: one array of nodes in the order they run, linked by 32-bit indices,
+ * with the words, assignments and redirections of every command packed into
+ * arrays of their own. Node 0 is the root, so 0 doubles as "none" for links.
+ * Strings are views into whatever backs the parse tree.
+ */
+struct flat_span {
+    uint32_t start, count;
+};
+
+struct flat_part {
+    unsigned char *start;
+    uint32_t len;
+    uint8_t type, quoted, op, colon;
+    const struct symbol *sym;
+    struct flat_span arg; // parts
+    const struct arith *arith;
+    uint32_t body; // node
+};
+
+struct flat_var {
+    const struct symbol *name;
+    struct flat_span val; // parts
+};
+
+// Strings are kept as a start and a 32-bit length and only turned back into
+// strs where they are used
+static inline str_t flat_str(unsigned char *start, uint32_t len)
 {
-    struct stat sb;
-    return stat(name, &sb) == 0;
+    str_t str = {start, start + len, NULL, NULL, {0}};
+    return str;
 }
 
-static char *slice(const char *str, size_t len)
+static inline uint32_t flat_len(const str_t *str)
 {
-    char *buf = malloc(len + 1), *ptr;
-    if (!buf)
-        return NULL;
-    strncpy(buf, str, len);
-    buf[len] = 0;
-    ptr = realloc(buf, strlen(buf) + 1);
-    return !ptr ? buf : ptr;
+    size_t len = str_len(str);
+    if (len > UINT32_MAX)
+        abort();
+    return len;
 }
 
-static char *find_on_path(struct shell *sh, const char *cmd)
-{
-    const str_t *var;
-    str_t tmp;
-    const char *path, *end;
-    char *name, *prefix;
-    size_t prefix_len;
-
-    tmp.start = tmp.buf_start = "PATH";
-    tmp.end = tmp.buf_end = tmp.start + strlen((void *)tmp.start);
-    var = getvar(sh, &tmp);
-    if (strchr(cmd, '/') || str_empty(var))
-        return strdup(cmd);
-    path = (const char *)var->start;
-    while (path) {
-        end = strchr(path, ':');
-        if (!end) {
-            prefix_len = strlen(path);
-        } else {
-            prefix_len = end - path;
-        }
+struct flat_redir {
+    int fd;
+    enum tok op;
+    struct flat_span name; // parts
+    struct heredoc *doc;
+};
 
-        if (!prefix_len) {
-            prefix = strdup(".");
-        } else {
-            prefix = slice(path, prefix_len);
-        }
+struct flat_cmd {
+    struct cmd_base base;
+    int background;
+    struct flat_span args; // words
+    struct flat_span vars;
+    struct flat_span redirs;
+};
 
-        if (!prefix)
-            return NULL;
+struct flat_andor {
+    struct cmd_base base;
+    int negated, and;
+    uint32_t next, command;
+};
 
-        name = malloc(strlen(prefix) + strlen(cmd) + 2);
-        if (!name)
-            abort();
-        *name = 0;
-        strcat(name, prefix);
-        strcat(name, "/");
-        strcat(name, cmd);
+struct flat_pipeline {
+    struct cmd_base base;
+    int background;
+    uint32_t next, command;
+};
 
-        free(prefix);
+struct flat_compound {
+    struct cmd_base base;
+    uint32_t next, command;
+};
 
-        if (name && exists(name))
-            return name;
+struct flat_subshell {
+    struct cmd_base base;
+    int background;
+    uint32_t commands;
+};
 
-        free(name);
-        path = end ? end + 1 : NULL;
-    }
-    return NULL;
-}
+struct flat_loop {
+    struct cmd_base base;
+    int until;
+    uint32_t cond, commands;
+};
 
-const char *strop(enum tok tok)
-{
-    const struct tok_def *def;
-    for (def = ops; def; def++)
-        if (def->type == tok)
-            return def->tok;
-    return "?";
-}
+struct flat_cond {
+    struct cmd_base base;
+    uint32_t cond, commands, otherwise;
+};
 
-void show_redirs(struct redirect *redirs) {
-    struct redirect *r;
-    for (r = redirs; r; r = r->next) {
-        if (r->fd >= 0)
-            printf("%d", r->fd);
-        printf("%s", strop(r->op));
-        if (r->doc) {
-            printf("HEREDOC ");
+struct flat_redirs {
+    struct cmd_base base;
+    struct flat_span redirs;
+    uint32_t command;
+};
+
+struct flat_for {
+    struct cmd_base base;
+    int use_args;
+    const struct symbol *name;
+    struct flat_span items; // words
+    uint32_t command;
+};
+
+struct flat_function {
+    struct cmd_base base;
+    struct function *def;
+};
+
+union flat_node {
+    enum cmd_type type;
+    struct cmd_base base;
+    struct flat_cmd simp;
+    struct flat_andor andor;
+    struct flat_pipeline pipe;
+    struct flat_compound comp;
+    struct flat_subshell sub;
+    struct flat_loop loop;
+    struct flat_cond cond;
+    struct flat_redirs redirs;
+    struct flat_for for_loop;
+    struct flat_function func;
+};
+
+struct flat {
+    union flat_node *nodes;
+    struct flat_span *words; // parts
+    struct flat_part *parts;
+    struct flat_var *vars;
+    struct flat_redir *redirs;
+    uint32_t nnodes, nwords, nparts, nvars, nredirs;
+};
+
+static void flat_add(uint32_t *count, size_t n)
+{
+    if (n > UINT32_MAX - *count)
+        abort();
+    *count += n;
+}
+
+static void flat_count(struct flat *f, const node_t *node);
+
+// Counts the parts of word, along with everything in the commands that are
+// substituted into it
+static void count_word(struct flat *f, const word_t *word)
+{
+    for (; word; word = word->next) {
+        flat_add(&f->nparts, 1);
+        count_word(f, word->arg);
+        if (word->body)
+            flat_count(f, word->body);
+    }
+}
+
+static void count_redirs(struct flat *f, const struct redirect *r)
+{
+    for (; r; r = r->next) {
+        flat_add(&f->nredirs, 1);
+        count_word(f, r->name);
+    }
+}
+
+// First pass: works out how big each of the arrays has to be
+static void flat_count(struct flat *f, const node_t *node)
+{
+    const struct arg *arg;
+    const struct var *var;
+    const struct item *item;
+    const struct andor *andor;
+    const struct pipeline *pipe;
+    const struct compound *comp;
+
+    while (node) {
+        flat_add(&f->nnodes, 1);
+        switch (node->type) {
+        case CMD_SIMPLE: case CMD_ASSIGNMENT:
+            for (arg = node->simp.args; arg; arg = arg->next) {
+                flat_add(&f->nwords, 1);
+                count_word(f, arg->val);
+            }
+            for (var = node->simp.vars; var; var = var->next) {
+                flat_add(&f->nvars, 1);
+                count_word(f, var->val);
+            }
+            count_redirs(f, node->simp.redirs);
+            return;
+        case CMD_ANDOR:
+            flat_count(f, node->andor.command);
+            for (andor = node->andor.next; andor; andor = andor->next) {
+                flat_add(&f->nnodes, 1);
+                flat_count(f, andor->command);
+            }
+            return;
+        case CMD_PIPELINE:
+            flat_count(f, node->pipe.command);
+            for (pipe = node->pipe.next; pipe; pipe = pipe->next) {
+                flat_add(&f->nnodes, 1);
+                flat_count(f, pipe->command);
+            }
+            return;
+        case CMD_COMPOUND:
+            flat_count(f, node->comp.command);
+            for (comp = node->comp.next; comp; comp = comp->next) {
+                flat_add(&f->nnodes, 1);
+                flat_count(f, comp->command);
+            }
+            return;
+        case CMD_SUBSHELL:
+            node = node->sub.commands;
+            break;
+        case CMD_LOOP:
+            flat_count(f, node->loop.cond);
+            node = node->loop.commands;
+            break;
+        case CMD_COND:
+            flat_count(f, node->cond.cond);
+            flat_count(f, node->cond.commands);
+            node = node->cond.otherwise;
+            break;
+        case CMD_REDIRS:
+            count_redirs(f, node->redirs.redirs);
+            node = node->redirs.command;
+            break;
+        case CMD_FOR_LOOP:
+            for (item = node->for_loop.items; item; item = item->next) {
+                flat_add(&f->nwords, 1);
+                count_word(f, item->val);
+            }
+            node = node->for_loop.command;
+            break;
+        case CMD_FUNCTION: case CMD_CASES:
+            return;
+        }
+    }
+}
+
+static uint32_t flat_node(struct flat *f, const node_t *node);
+
+// The parts of a word are laid out next to each other, and the words inside
+// them, as in ${name:-word}, after that. So are the words of a node, and
+// the other spans, which keeps them contiguous when a substituted command
+// is laid out in the middle of them.
+static struct flat_span flat_word(struct flat *f, const word_t *word)
+{
+    struct flat_span span = {f->nparts, 0};
+    struct flat_part *part;
+    const word_t *w;
+    for (w = word; w; w = w->next)
+        span.count++;
+    f->nparts += span.count;
+    for (part = &f->parts[span.start]; word; word = word->next, part++) {
+        part->start = word->tok->start;
+        part->len = flat_len(word->tok);
+        part->type = word->type;
+        part->quoted = word->quoted;
+        part->op = word->op;
+        part->colon = word->colon;
+        part->sym = word->sym;
+        part->arg = flat_word(f, word->arg);
+        part->arith = word->arith;
+        // the root is node 0, so 0 is free to mean $()
+        part->body = flat_node(f, word->body);
+    }
+    return span;
+}
+
+static struct flat_span flat_redirs(struct flat *f, const struct redirect *r)
+{
+    struct flat_span span = {f->nredirs, 0};
+    struct flat_redir *re;
+    const struct redirect *it;
+    for (it = r; it; it = it->next)
+        span.count++;
+    f->nredirs += span.count;
+    for (re = &f->redirs[span.start]; r; r = r->next, re++) {
+        re->fd = r->fd;
+        re->op = r->op;
+        re->doc = r->doc;
+        re->name = flat_word(f, r->name);
+    }
+    return span;
+}
+
+// Second pass: lays node out in preorder and returns its index
+static uint32_t flat_node(struct flat *f, const node_t *node)
+{
+    const struct arg *arg;
+    const struct var *var;
+    const struct item *item;
+    const struct andor *andor;
+    const struct pipeline *pipe;
+    const struct compound *comp;
+    union flat_node *n;
+    uint32_t idx, i, *link;
+
+    if (!node)
+        return 0;
+    idx = f->nnodes++;
+    n = &f->nodes[idx];
+    n->type = node->type;
+    switch (node->type) {
+    case CMD_SIMPLE: case CMD_ASSIGNMENT:
+        n->simp.background = node->simp.background;
+        n->simp.args.start = f->nwords;
+        n->simp.args.count = 0;
+        for (arg = node->simp.args; arg; arg = arg->next)
+            n->simp.args.count++;
+        f->nwords += n->simp.args.count;
+        i = n->simp.args.start;
+        for (arg = node->simp.args; arg; arg = arg->next)
+            f->words[i++] = flat_word(f, arg->val);
+        n->simp.vars.start = f->nvars;
+        n->simp.vars.count = 0;
+        for (var = node->simp.vars; var; var = var->next)
+            n->simp.vars.count++;
+        f->nvars += n->simp.vars.count;
+        i = n->simp.vars.start;
+        for (var = node->simp.vars; var; var = var->next, i++) {
+            f->vars[i].name = var->name;
+            f->vars[i].val = flat_word(f, var->val);
+        }
+        n->simp.redirs = flat_redirs(f, node->simp.redirs);
+        break;
+    case CMD_ANDOR:
+        for (andor = &node->andor, link = NULL; andor; andor = andor->next) {
+            if (link) {
+                *link = f->nnodes++;
+                n = &f->nodes[*link];
+                n->type = CMD_ANDOR;
+            }
+            n->andor.negated = andor->negated;
+            n->andor.and = andor->and;
+            n->andor.next = 0;
+            n->andor.command = flat_node(f, andor->command);
+            link = &n->andor.next;
+        }
+        break;
+    case CMD_PIPELINE:
+        for (pipe = &node->pipe, link = NULL; pipe; pipe = pipe->next) {
+            if (link) {
+                *link = f->nnodes++;
+                n = &f->nodes[*link];
+                n->type = CMD_PIPELINE;
+            }
+            n->pipe.background = pipe->background;
+            n->pipe.next = 0;
+            n->pipe.command = flat_node(f, pipe->command);
+            link = &n->pipe.next;
+        }
+        break;
+    case CMD_COMPOUND:
+        for (comp = &node->comp, link = NULL; comp; comp = comp->next) {
+            if (link) {
+                *link = f->nnodes++;
+                n = &f->nodes[*link];
+                n->type = CMD_COMPOUND;
+            }
+            n->comp.next = 0;
+            n->comp.command = flat_node(f, comp->command);
+            link = &n->comp.next;
+        }
+        break;
+    case CMD_SUBSHELL:
+        n->sub.background = node->sub.background;
+        n->sub.commands = flat_node(f, node->sub.commands);
+        break;
+    case CMD_LOOP:
+        n->loop.until = node->loop.until;
+        n->loop.cond = flat_node(f, node->loop.cond);
+        n->loop.commands = flat_node(f, node->loop.commands);
+        break;
+    case CMD_COND:
+        n->cond.cond = flat_node(f, node->cond.cond);
+        n->cond.commands = flat_node(f, node->cond.commands);
+        n->cond.otherwise = flat_node(f, node->cond.otherwise);
+        break;
+    case CMD_REDIRS:
+        n->redirs.redirs = flat_redirs(f, node->redirs.redirs);
+        n->redirs.command = flat_node(f, node->redirs.command);
+        break;
+    case CMD_FOR_LOOP:
+        n->for_loop.use_args = node->for_loop.use_args;
+        n->for_loop.name = node->for_loop.name;
+        n->for_loop.items.start = f->nwords;
+        n->for_loop.items.count = 0;
+        for (item = node->for_loop.items; item; item = item->next)
+            n->for_loop.items.count++;
+        f->nwords += n->for_loop.items.count;
+        i = n->for_loop.items.start;
+        for (item = node->for_loop.items; item; item = item->next)
+            f->words[i++] = flat_word(f, item->val);
+        n->for_loop.command = flat_node(f, node->for_loop.command);
+        break;
+    case CMD_FUNCTION:
+        n->func.def = (struct function *)&node->func;
+        break;
+    case CMD_CASES:
+        break;
+    }
+    return idx;
+}
+
+// Flattens root into a, where it lives as long as the tree it came from
+static struct flat *flatten(struct arena *a, const node_t *root)
+{
+    struct flat *f = arena_alloc(a, sizeof(*f));
+    memset(f, 0, sizeof(*f));
+    flat_count(f, root);
+    f->nodes = arena_alloc(a, f->nnodes * sizeof(*f->nodes));
+    f->words = arena_alloc(a, f->nwords * sizeof(*f->words));
+    f->parts = arena_alloc(a, f->nparts * sizeof(*f->parts));
+    f->vars = arena_alloc(a, f->nvars * sizeof(*f->vars));
+    f->redirs = arena_alloc(a, f->nredirs * sizeof(*f->redirs));
+    f->nnodes = f->nwords = f->nparts = f->nvars = f->nredirs = 0;
+    flat_node(f, root);
+    return f;
+}
+
+/*
+ * AST cache
+ *
+ * With PSHELL_CACHE_DIR set, a script's parse tree is serialized into that
+ * directory the first time it runs and mapped back in on later runs instead
+ * of being parsed. Entries are named after a hash of the script's real path
+ * and are only used if the path, size, mtime and a hash of the contents all
+ * still match. Strings in the loaded tree are views into the mapping, which
+ * has to stay mapped for as long as the tree is alive.
+ */
+
+#define AST_CACHE_MAGIC 0x43485350 // "PSHC"
+#define AST_CACHE_VERSION 4
+#define AST_CACHE_NULL 0xff
+
+struct ast_cache_header {
+    uint32_t magic, version;
+    uint64_t size, hash;
+    int64_t mtime_sec, mtime_nsec;
+    uint32_t path_len, reserved;
+};
+
+struct ast_cache {
+    char *path, *real_path;
+    struct ast_cache_header header;
+    void *map;
+    size_t map_size;
+};
+
+static void cache_put_u8(str_t *out, unsigned val)
+{
+    str_putc(out, val);
+}
+
+static void cache_put_u32(str_t *out, uint32_t val)
+{
+    str_put(out, &val, sizeof(val));
+}
+
+static void cache_put_bytes(str_t *out, const void *data, size_t len)
+{
+    if (len > UINT32_MAX)
+        abort();
+    cache_put_u32(out, len);
+    if (len)
+        str_put(out, data, len);
+    str_putc(out, 0);
+}
+
+static void cache_put_str(str_t *out, const str_t *str)
+{
+    cache_put_bytes(out, str ? str->start : NULL, str_len(str));
+}
+
+static int cache_put_node(str_t *out, node_t *node);
+
+static int cache_put_word(str_t *out, const word_t *word)
+{
+    const word_t *part;
+    uint32_t count = 0;
+    for (part = word; part; part = part->next)
+        count++;
+    cache_put_u32(out, count);
+    for (part = word; part; part = part->next) {
+        cache_put_u8(out, part->type);
+        cache_put_u8(out, part->quoted);
+        cache_put_u8(out, part->was_quoted);
+        cache_put_str(out, part->tok);
+        cache_put_u8(out, part->op);
+        cache_put_u8(out, part->colon);
+        if (cache_put_word(out, part->arg) < 0)
+            return -1;
+        if ((part->type == WORD_COMMAND || part->type == WORD_BACKTICK) &&
+                cache_put_node(out, part->body) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int cache_put_doc(str_t *out, struct heredoc *doc)
+{
+    char buf[16 * 1024];
+    size_t len_at, len = 0;
+    off_t off = 0;
+    ssize_t ret;
+    cache_put_u8(out, doc->strip_tabs);
+    cache_put_str(out, doc->end);
+    if (doc->fd < 0) {
+        cache_put_str(out, doc->doc);
+        return 0;
+    }
+    len_at = str_len(out);
+    cache_put_u32(out, 0);
+    while ((ret = pread(doc->fd, buf, sizeof(buf), off)) != 0) {
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 || len + ret > UINT32_MAX)
+            return -1;
+        str_put(out, buf, ret);
+        off += ret;
+        len += ret;
+    }
+    memcpy(out->start + len_at, &(uint32_t){len}, sizeof(uint32_t));
+    str_putc(out, 0);
+    return 0;
+}
+
+static int cache_put_redirs(str_t *out, struct redirect *redirs)
+{
+    struct redirect *r;
+    uint32_t count = 0;
+    for (r = redirs; r; r = r->next)
+        count++;
+    cache_put_u32(out, count);
+    for (r = redirs; r; r = r->next) {
+        cache_put_u32(out, r->fd);
+        cache_put_u8(out, r->op);
+        cache_put_u8(out, !!r->doc);
+        if (r->doc) {
+            if (cache_put_doc(out, r->doc) < 0)
+                return -1;
+        } else if (cache_put_word(out, r->name) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int cache_put_node(str_t *out, node_t *node)
+{
+    struct arg *a;
+    struct var *v;
+    struct item *i;
+    node_t *n;
+    uint32_t count = 0;
+
+    if (!node) {
+        cache_put_u8(out, AST_CACHE_NULL);
+        return 0;
+    }
+
+    cache_put_u8(out, node->type);
+    switch (node->type) {
+    case CMD_SIMPLE: case CMD_ASSIGNMENT:
+        cache_put_u8(out, node->simp.background);
+        for (a = node->simp.args; a; a = a->next)
+            count++;
+        cache_put_u32(out, count);
+        for (a = node->simp.args; a; a = a->next)
+            if (cache_put_word(out, a->val) < 0)
+                return -1;
+        count = 0;
+        for (v = node->simp.vars; v; v = v->next)
+            count++;
+        cache_put_u32(out, count);
+        for (v = node->simp.vars; v; v = v->next) {
+            cache_put_str(out, v->name->name);
+            if (cache_put_word(out, v->val) < 0)
+                return -1;
+        }
+        return cache_put_redirs(out, node->simp.redirs);
+    case CMD_ANDOR:
+        for (n = node; n; n = (node_t *)n->andor.next)
+            count++;
+        cache_put_u32(out, count);
+        for (n = node; n; n = (node_t *)n->andor.next) {
+            cache_put_u8(out, n->andor.negated);
+            cache_put_u8(out, n->andor.and);
+            if (cache_put_node(out, n->andor.command) < 0)
+                return -1;
+        }
+        return 0;
+    case CMD_PIPELINE:
+        for (n = node; n; n = (node_t *)n->pipe.next)
+            count++;
+        cache_put_u32(out, count);
+        for (n = node; n; n = (node_t *)n->pipe.next) {
+            cache_put_u8(out, n->pipe.background);
+            if (cache_put_node(out, n->pipe.command) < 0)
+                return -1;
+        }
+        return 0;
+    case CMD_COMPOUND:
+        for (n = node; n; n = (node_t *)n->comp.next)
+            count++;
+        cache_put_u32(out, count);
+        for (n = node; n; n = (node_t *)n->comp.next)
+            if (cache_put_node(out, n->comp.command) < 0)
+                return -1;
+        return 0;
+    case CMD_SUBSHELL:
+        cache_put_u8(out, node->sub.background);
+        return cache_put_node(out, node->sub.commands);
+    case CMD_LOOP:
+        cache_put_u8(out, node->loop.until);
+        if (cache_put_node(out, node->loop.cond) < 0)
+            return -1;
+        return cache_put_node(out, node->loop.commands);
+    case CMD_COND:
+        if (cache_put_node(out, node->cond.cond) < 0 ||
+                cache_put_node(out, node->cond.commands) < 0)
+            return -1;
+        return cache_put_node(out, node->cond.otherwise);
+    case CMD_REDIRS:
+        if (cache_put_redirs(out, node->redirs.redirs) < 0)
+            return -1;
+        return cache_put_node(out, node->redirs.command);
+    case CMD_FOR_LOOP:
+        cache_put_str(out, node->for_loop.name->name);
+        cache_put_u8(out, node->for_loop.use_args);
+        for (i = node->for_loop.items; i; i = i->next)
+            count++;
+        cache_put_u32(out, count);
+        for (i = node->for_loop.items; i; i = i->next)
+            if (cache_put_word(out, i->val) < 0)
+                return -1;
+        return cache_put_node(out, node->for_loop.command);
+    case CMD_FUNCTION:
+        cache_put_str(out, node->func.name->name);
+        return cache_put_node(out, node->func.command);
+    case CMD_CASES:
+        return 0;
+    }
+    return -1;
+}
+
+struct cache_reader {
+    unsigned char *pos, *end;
+    struct arena *arena;
+    int bad;
+};
+
+static int cache_get(struct cache_reader *r, void *data, size_t len)
+{
+    if (r->bad || (size_t)(r->end - r->pos) < len) {
+        r->bad = 1;
+        memset(data, 0, len);
+        return -1;
+    }
+    memcpy(data, r->pos, len);
+    r->pos += len;
+    return 0;
+}
+
+static unsigned cache_get_u8(struct cache_reader *r)
+{
+    unsigned char val;
+    cache_get(r, &val, sizeof(val));
+    return val;
+}
+
+static uint32_t cache_get_u32(struct cache_reader *r)
+{
+    uint32_t val;
+    cache_get(r, &val, sizeof(val));
+    return val;
+}
+
+// Returns a view of the string, which is followed by a NUL in the mapping
+static str_t *cache_get_str(struct cache_reader *r)
+{
+    uint32_t len = cache_get_u32(r);
+    str_t *str;
+    if (r->bad || (size_t)(r->end - r->pos) <= len || r->pos[len]) {
+        r->bad = 1;
+        return arena_view(r->arena, NULL, 0);
+    }
+    str = arena_view(r->arena, r->pos, len);
+    r->pos += len + 1;
+    return str;
+}
+
+static const struct symbol *cache_get_symbol(struct cache_reader *r)
+{
+    return intern_str(cache_get_str(r));
+}
+
+static node_t *cache_get_node(struct cache_reader *r);
+
+static word_t *cache_get_word(struct cache_reader *r)
+{
+    word_t *word = NULL, **link = &word, *part;
+    const char *err;
+    uint32_t count = cache_get_u32(r);
+    while (count-- && !r->bad) {
+        part = arena_alloc(r->arena, sizeof(*part));
+        part->next = NULL;
+        part->type = cache_get_u8(r);
+        part->quoted = cache_get_u8(r);
+        part->was_quoted = cache_get_u8(r);
+        part->tok = cache_get_str(r);
+        part->sym = part->type == WORD_PARAMETER ? intern_str(part->tok) : NULL;
+        part->op = cache_get_u8(r);
+        part->colon = cache_get_u8(r);
+        part->arg = cache_get_word(r);
+        part->arith = NULL;
+        part->body = NULL;
+        if (part->type == WORD_COMMAND || part->type == WORD_BACKTICK)
+            part->body = cache_get_node(r);
+        if (part->type > WORD_BACKTICK || part->op > PARAM_LONG_PREFIX)
+            r->bad = 1;
+        else if (part->type == WORD_ARITHMETIC && !r->bad && !part->arg &&
+                !(part->arith = arith_compile(r->arena, part->tok, &err)))
+            r->bad = 1;
+        *link = part;
+        link = &part->next;
+    }
+    return word;
+}
+
+static struct redirect *cache_get_redirs(struct cache_reader *r)
+{
+    struct redirect *redirs = NULL, **link = &redirs, *re;
+    struct heredoc *doc;
+    uint32_t count = cache_get_u32(r);
+    while (count-- && !r->bad) {
+        re = arena_alloc(r->arena, sizeof(*re));
+        re->next = NULL;
+        re->fd = cache_get_u32(r);
+        re->op = cache_get_u8(r);
+        re->name = NULL;
+        re->doc = NULL;
+        if (cache_get_u8(r)) {
+            doc = arena_alloc(r->arena, sizeof(*doc));
+            doc->next = NULL;
+            doc->fd = -1;
+            doc->strip_tabs = cache_get_u8(r);
+            doc->end = cache_get_str(r);
+            doc->doc = cache_get_str(r);
+            arena_defer(r->arena, heredoc_cleanup, doc);
+            re->doc = doc;
+        } else {
+            re->name = cache_get_word(r);
+        }
+        *link = re;
+        link = &re->next;
+    }
+    return redirs;
+}
+
+static node_t *cache_get_node(struct cache_reader *r)
+{
+    struct arg **aptr;
+    struct var **vptr, *v;
+    struct item **iptr;
+    struct andor *alist = NULL, **andptr = &alist;
+    struct pipeline *plist = NULL, **pptr = &plist;
+    struct compound *clist = NULL, **cptr = &clist;
+    node_t *node;
+    unsigned type, flag, flag2;
+    uint32_t count;
+
+    type = cache_get_u8(r);
+    if (r->bad || type == AST_CACHE_NULL)
+        return NULL;
+
+    switch (type) {
+    case CMD_SIMPLE: case CMD_ASSIGNMENT:
+        node = alloc_node(r->arena, type);
+        node->simp.background = cache_get_u8(r);
+        aptr = &node->simp.args;
+        for (count = cache_get_u32(r); count && !r->bad; count--)
+            link_arg(r->arena, &aptr, cache_get_word(r));
+        vptr = &node->simp.vars;
+        for (count = cache_get_u32(r); count && !r->bad; count--) {
+            v = arena_alloc(r->arena, sizeof(*v));
+            v->next = NULL;
+            v->name = cache_get_symbol(r);
+            v->val = cache_get_word(r);
+            *vptr = v;
+            vptr = &v->next;
+        }
+        node->simp.redirs = cache_get_redirs(r);
+        return node;
+    case CMD_ANDOR:
+        for (count = cache_get_u32(r); count && !r->bad; count--) {
+            flag = cache_get_u8(r);
+            flag2 = cache_get_u8(r);
+            andor_link(r->arena, &andptr, cache_get_node(r), flag, flag2);
+        }
+        return (node_t *)alist;
+    case CMD_PIPELINE:
+        for (count = cache_get_u32(r); count && !r->bad; count--) {
+            node = alloc_node(r->arena, CMD_PIPELINE);
+            node->pipe.background = cache_get_u8(r);
+            node->pipe.command = cache_get_node(r);
+            *pptr = &node->pipe;
+            pptr = &node->pipe.next;
+        }
+        return (node_t *)plist;
+    case CMD_COMPOUND:
+        for (count = cache_get_u32(r); count && !r->bad; count--)
+            compound_link(r->arena, &cptr, cache_get_node(r));
+        return (node_t *)clist;
+    case CMD_SUBSHELL:
+        node = alloc_node(r->arena, type);
+        node->sub.background = cache_get_u8(r);
+        node->sub.commands = cache_get_node(r);
+        return node;
+    case CMD_LOOP:
+        node = alloc_node(r->arena, type);
+        node->loop.until = cache_get_u8(r);
+        node->loop.cond = cache_get_node(r);
+        node->loop.commands = cache_get_node(r);
+        return node;
+    case CMD_COND:
+        node = alloc_node(r->arena, type);
+        node->cond.cond = cache_get_node(r);
+        node->cond.commands = cache_get_node(r);
+        node->cond.otherwise = cache_get_node(r);
+        return node;
+    case CMD_REDIRS:
+        node = alloc_node(r->arena, type);
+        node->redirs.redirs = cache_get_redirs(r);
+        node->redirs.command = cache_get_node(r);
+        return node;
+    case CMD_FOR_LOOP:
+        node = alloc_node(r->arena, type);
+        node->for_loop.name = cache_get_symbol(r);
+        node->for_loop.use_args = cache_get_u8(r);
+        iptr = &node->for_loop.items;
+        for (count = cache_get_u32(r); count && !r->bad; count--)
+            link_item(r->arena, &iptr, cache_get_word(r));
+        node->for_loop.command = cache_get_node(r);
+        return node;
+    case CMD_FUNCTION:
+        node = alloc_node(r->arena, type);
+        node->func.name = cache_get_symbol(r);
+        node->func.command = cache_get_node(r);
+        return node;
+    case CMD_CASES:
+        return alloc_node(r->arena, type);
+    default:
+        r->bad = 1;
+        return NULL;
+    }
+}
+
+// Works out where the cache entry for the script lives and what it has to
+// match. Returns -1 if caching is off or the script can't be cached.
+static int init_ast_cache(struct ast_cache *cache, const char *script,
+        struct input *in)
+{
+    const char *dir = getenv("PSHELL_CACHE_DIR");
+    struct stat sb;
+    size_t len;
+
+    memset(cache, 0, sizeof(*cache));
+    if (!dir || !*dir || !in->map)
+        return -1;
+    if (!(cache->real_path = realpath(script, NULL)))
+        return -1;
+    if (stat(cache->real_path, &sb) < 0 || (size_t)sb.st_size != in->map_size) {
+        free(cache->real_path);
+        return -1;
+    }
+    len = strlen(cache->real_path);
+    cache->header.magic = AST_CACHE_MAGIC;
+    cache->header.version = AST_CACHE_VERSION;
+    cache->header.size = sb.st_size;
+    cache->header.hash = hash_bytes(in->map, in->map_size);
+    cache->header.mtime_sec = sb.st_mtim.tv_sec;
+    cache->header.mtime_nsec = sb.st_mtim.tv_nsec;
+    cache->header.path_len = len;
+    cache->path = malloc(strlen(dir) + 32);
+    if (!cache->path)
+        abort();
+    sprintf(cache->path, "%s/%016llx.psc", dir,
+            (unsigned long long)hash_bytes(cache->real_path, len));
+    return 0;
+}
+
+static void destroy_ast_cache(struct ast_cache *cache)
+{
+    if (cache->map)
+        munmap(cache->map, cache->map_size);
+    free(cache->path);
+    free(cache->real_path);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// The tree is loaded into arena, which should be empty: it is dropped again
+// if the entry turns out to be bad.
+static node_t *load_ast_cache(struct ast_cache *cache, struct arena *arena)
+{
+    struct ast_cache_header header;
+    struct cache_reader r;
+    struct stat sb;
+    node_t *root;
+    void *map;
+    int fd = open(cache->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    // the tree gets run, so only one nobody else could have written is
+    // trusted, in case the directory is shared
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+            sb.st_uid != geteuid() || (sb.st_mode & (S_IWGRP | S_IWOTH)) ||
+            (size_t)sb.st_size < sizeof(header)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    r.pos = map;
+    r.end = r.pos + sb.st_size;
+    r.arena = arena;
+    r.bad = 0;
+    cache_get(&r, &header, sizeof(header));
+    if (memcmp(&header, &cache->header, sizeof(header)) ||
+            (size_t)(r.end - r.pos) < header.path_len ||
+            memcmp(r.pos, cache->real_path, header.path_len)) {
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+    r.pos += header.path_len;
+    root = cache_get_node(&r);
+    if (r.bad || r.pos != r.end) {
+        arena_drop(arena);
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+    cache->map = map;
+    cache->map_size = sb.st_size;
+    return root;
+}
+
+// Best effort: written to a temporary file and renamed into place
+static void store_ast_cache(struct ast_cache *cache, node_t *root)
+{
+    str_t *out = new_str();
+    char *tmp;
+    int fd;
+
+    str_put(out, &cache->header, sizeof(cache->header));
+    str_put(out, cache->real_path, cache->header.path_len);
+    if (cache_put_node(out, root) < 0)
+        goto done;
+
+    tmp = malloc(strlen(cache->path) + 32);
+    if (!tmp)
+        abort();
+    sprintf(tmp, "%s.%ld", cache->path, (long)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+            0644);
+    if (fd >= 0) {
+        if (write_all(fd, out->start, str_len(out)) < 0 || close(fd) < 0 ||
+                rename(tmp, cache->path) < 0)
+            unlink(tmp);
+    }
+    free(tmp);
+done:
+    free_str(out);
+}
+
+// A variable with a NULL val is a name known not to be set
+struct shell_var {
+    int exported, read_only;
+    const struct symbol *name;
+    str_t *val;
+};
+
+// Variables sit in an array in the order they were first set, which is also
+// the order they are exported in. index is an open addressing table, probed
+// linearly from the symbol's hash, of positions in that array plus one; 0
+// marks an empty slot. It is kept at most half full.
+struct var_table {
+    struct shell_var *vars;
+    uint32_t *index;
+    size_t count, size, mask;
+};
+
+enum eval_exit {
+    EXIT_NEXT,
+    EXIT_LOOP_CONTINUE,
+    EXIT_LOOP_BREAK,
+    EXIT_RETURN,
+    EXIT_SHELL,         // exit has run
+};
+
+enum stack_type {
+    STACK_LOOP,
+};
+
+struct stack_frame {
+    struct stack_frame *prev;
+    node_t *next_node, *loop_node;
+    int argc;
+    char **argv;
+};
+#define FUNC_CHUNK_SIZE 1024
+
+// Function bodies are copied out of the parse arena into one of their own,
+// flattened and compiled there once. A function that is redefined or unset
+// while it runs is only freed once calls is back to 0.
+struct shell_func {
+    struct shell_func *next;
+    struct arena arena;
+    node_t *def;
+    struct flat *flat;
+    struct code *code;
+    int calls, retired;
+};
+
+struct args_frame {
+    struct args_frame *prev;
+    int argc, shift;
+    char **argv;
+    char **owned; // argv, once set has replaced it
+};
+
+// IFS as two bitmaps over byte values: every separator, and the ones that
+// are also IFS white space
+struct ifs_map {
+    uint64_t sep[4], white[4];
+    int first; // the character "$*" is joined with, or -1 if IFS is empty
+    unsigned long gen;
+};
+
+// Fields expanded for an argv, NUL terminated and back to back in buf, with
+// the offset each one starts at in offs
+struct fields {
+    str_t *buf;
+    size_t *offs;
+    size_t count, size;
+};
+
+// A PATH entry: fd is an O_PATH handle on it if it is absolute and could be
+// opened, else -1
+struct path_dir {
+    int fd;
+    const char *name;
+};
+
+struct hashed_cmd {
+    const struct symbol *name;
+    char *path; // NULL if it was not found
+    size_t dir;
+    unsigned hits;
+    int applet; // path is the coreutils binary, see find_in_shell()
+};
+
+// Commands looked up on PATH as of gen, in an open addressed table kept at
+// most half full
+struct path_cache {
+    struct hashed_cmd *cmds;
+    size_t mask, count;
+    struct path_dir *dirs;
+    size_t ndirs;
+    char *path; // PATH split in place, for dirs[].name
+    unsigned long gen;
+    int relative; // whether cd has to start it over
+};
+
+struct shell {
+    struct lexer lex;
+    struct lexer *script; // the innermost script being read, out to lex
+    struct var_table vars;
+    char **envp; // exported variables as of env_gen, see export_env()
+    unsigned long env_gen, envp_gen;
+    int env_imported;
+    struct ifs_map ifs; // IFS as of ifs_gen, see get_ifs()
+    unsigned long ifs_gen;
+    struct path_cache path; // PATH as of path_gen, see hash_command()
+    unsigned long path_gen;
+    struct fields fields;
+    str_t *out, *outbuf; // see run_builtin()
+    unsigned long substs; // command substitutions run so far
+    struct shell_func *funcs;
+    struct args_frame *args;
+    int exit_status;
+    int in_func, break_depth, loop_depth;
+    enum eval_exit jump; // what a builtin left to break, continue, return or exit
+    int keep_redirs; // exec without a command ran, see try_builtin()
+    int tree_eval;
+    int fork_only; // PSHELL_SPAWN=fork, see spawn_args()
+    pid_t pid;
+};
+
+struct code;
+static struct code *compile(struct arena *a, const struct flat *f,
+        uint32_t idx);
+enum eval_exit do_eval(struct shell *sh, const struct flat *f, uint32_t idx);
+enum eval_exit vm_run(struct shell *sh, const struct code *c);
+
+static void free_func(struct shell_func *func)
+{
+    if (func->calls) {
+        func->retired = 1;
+        return;
+    }
+    destroy_arena(&func->arena);
+    free(func);
+}
+
+void defun(struct shell *sh, struct function *def)
+{
+    struct shell_func **link, *func, *old = NULL;
+    func = malloc(sizeof(*func));
+    if (!func)
+        abort();
+    init_arena(&func->arena, FUNC_CHUNK_SIZE);
+    func->def = copy_node(&func->arena, (node_t *)def);
+    func->flat = flatten(&func->arena, func->def->func.command);
+    func->code = compile(&func->arena, func->flat, 0);
+    func->calls = func->retired = 0;
+    for (link = &sh->funcs; (old = *link); link = &old->next)
+        if (old->def->func.name == def->name)
+            break;
+    func->next = old ? old->next : NULL;
+    *link = func;
+    if (old)
+        free_func(old);
+}
+
+static struct shell_func **find_func(struct shell *sh,
+        const struct symbol *name)
+{
+    struct shell_func **link, *func;
+    for (link = &sh->funcs; (func = *link); link = &func->next)
+        if (func->def->func.name == name)
+            return link;
+    return NULL;
+}
+
+extern char **environ;
+
+static const struct symbol *ifs_name, *path_name;
+
+static uint32_t *var_slot(const struct var_table *t, const struct symbol *name)
+{
+    size_t i = name->hash & t->mask;
+    uint32_t *slot;
+    while (*(slot = &t->index[i]) && t->vars[*slot - 1].name != name)
+        i = (i + 1) & t->mask;
+    return slot;
+}
+
+// Makes room for one more variable
+static void grow_vars(struct var_table *t)
+{
+    size_t size, i;
+    if (t->count == t->size) {
+        if (t->count >= UINT32_MAX - 1 || t->size > SIZE_MAX / 2 / sizeof(*t->vars))
+            abort();
+        t->size = t->size ? t->size * 2 : 32;
+        t->vars = realloc(t->vars, t->size * sizeof(*t->vars));
+        if (!t->vars)
+            abort();
+    }
+    if (t->index && t->count < (t->mask + 1) / 2)
+        return;
+    size = t->index ? (t->mask + 1) * 2 : 64;
+    if (size > SIZE_MAX / sizeof(*t->index))
+        abort();
+    free(t->index);
+    if (!(t->index = calloc(size, sizeof(*t->index))))
+        abort();
+    t->mask = size - 1;
+    for (i = 0; i < t->count; i++)
+        *var_slot(t, t->vars[i].name) = i + 1;
+}
+
+static struct shell_var *find_var(struct shell *sh, const struct symbol *name)
+{
+    uint32_t pos;
+    if (!sh->vars.index || !(pos = *var_slot(&sh->vars, name)))
+        return NULL;
+    return &sh->vars.vars[pos - 1];
+}
+
+static struct shell_var *add_var(struct shell *sh, const struct symbol *name)
+{
+    struct var_table *t = &sh->vars;
+    struct shell_var *var;
+    grow_vars(t);
+    var = &t->vars[t->count++];
+    memset(var, 0, sizeof(*var));
+    var->name = name;
+    *var_slot(t, name) = t->count;
+    return var;
+}
+
+/*
+ * Variables inherited through environ are not copied in at startup. Each is
+ * added the first time its name is looked up, with a value that is a view of
+ * its environ entry, and a name that environ does not have is added without
+ * a value so it is only searched for once. Until an exported variable
+ * changes, export_env() passes environ on as it is.
+ */
+static struct shell_var *import_var(struct shell *sh, const struct symbol *name)
+{
+    struct shell_var *var = add_var(sh, name);
+    size_t len = str_len(name->name);
+    char **env;
+    for (env = environ; *env; env++) {
+        if (!strncmp(*env, (char *)name->name->start, len) &&
+                (*env)[len] == '=') {
+            var->exported = 1;
+            var->val = str_view(*env + len + 1, strlen(*env + len + 1));
+            break;
+        }
+    }
+    return var;
+}
+
+// Adds everything from environ that has not been looked up yet
+static void import_env(struct shell *sh)
+{
+    const struct symbol *name;
+    struct shell_var *var;
+    char **env, *eq;
+    if (sh->env_imported)
+        return;
+    for (env = environ; *env; env++) {
+        if (!(eq = strchr(*env, '=')))
+            continue;
+        name = intern(*env, eq - *env);
+        if (find_var(sh, name))
+            continue;
+        var = add_var(sh, name);
+        var->exported = 1;
+        var->val = str_view(eq + 1, strlen(eq + 1));
+    }
+    sh->env_imported = 1;
+}
+
+static struct shell_var *lookup_var(struct shell *sh, const struct symbol *name)
+{
+    struct shell_var *var = find_var(sh, name);
+    if (!var && !sh->env_imported)
+        var = import_var(sh, name);
+    return var;
+}
+
+// Moves on the generations of whatever is cached from the variable name
+static void var_changed(struct shell *sh, const struct symbol *name)
+{
+    if (name == ifs_name)
+        sh->ifs_gen++;
+    if (name == path_name)
+        sh->path_gen++;
+}
+
+// Complains and returns -1 if var is read-only
+static int var_read_only(const struct shell_var *var)
+{
+    if (!var || !var->read_only)
+        return 0;
+    fprintf(stderr, "%.*s: is read only\n", STR_FMT(var->name->name));
+    return -1;
+}
+
+// Returns -1 if name is read-only, and leaves it as it was
+static int setvar(struct shell *sh, const struct symbol *name,
+        const str_t *val, int exported)
+{
+    struct shell_var *var = lookup_var(sh, name);
+    if (var_read_only(var))
+        return -1;
+    if (!var)
+        var = add_var(sh, name);
+    if (var->exported || exported > 0)
+        sh->env_gen++;
+    var_changed(sh, name);
+    free_str(var->val);
+    if (exported >= 0)
+        var->exported = exported;
+    var->val = dup_str(val);
+    return 0;
+}
+
+static const str_t *getvar(struct shell *sh, const struct symbol *name)
+{
+    struct shell_var *var = lookup_var(sh, name);
+    return var ? var->val : NULL;
+}
+
+static int unsetvar(struct shell *sh, const struct symbol *name)
+{
+    struct shell_var *var = lookup_var(sh, name);
+    if (!var)
+        return 0;
+    if (var_read_only(var))
+        return -1;
+    if (var->val) {
+        if (var->exported)
+            sh->env_gen++;
+        var_changed(sh, name);
+        free_str(var->val);
+        var->val = NULL;
+    }
+    var->exported = 0;
+    return 0;
+}
+
+// Marks name for export, whether or not it has a value yet
+static void export_var(struct shell *sh, const struct symbol *name)
+{
+    struct shell_var *var = lookup_var(sh, name);
+    if (!var)
+        var = add_var(sh, name);
+    if (!var->exported && var->val)
+        sh->env_gen++;
+    var->exported = 1;
+}
+
+/*
+ * Where commands were found on PATH, for as long as PATH stays the same:
+ * path_gen moves on whenever it is assigned, and the cache starts over.
+ * Commands that are not found are remembered too, until then or hash -r,
+ * so a script does not search all of PATH every time it tries one.
+ * Each PATH directory is opened once and searched with faccessat(), and
+ * the command is then run with execveat() on the same fd.
+ */
+static void clear_path_cache(struct path_cache *pc)
+{
+    size_t i;
+    for (i = 0; pc->cmds && i <= pc->mask; i++)
+        free(pc->cmds[i].path);
+    free(pc->cmds);
+    for (i = 0; i < pc->ndirs; i++)
+        if (pc->dirs[i].fd >= 0)
+            close(pc->dirs[i].fd);
+    free(pc->dirs);
+    free(pc->path);
+    memset(pc, 0, sizeof(*pc));
+}
+
+// Splits PATH into directories and opens the absolute ones. An empty entry
+// is the current directory; relative ones are searched by name, since the
+// current directory can change under them.
+static void load_path(struct shell *sh)
+{
+    struct path_cache *pc = &sh->path;
+    const str_t *var = getvar(sh, path_name);
+    struct path_dir *dir;
+    char *p, *end;
+    size_t n = 1;
+
+    clear_path_cache(pc);
+    pc->gen = sh->path_gen;
+    if (!var)
+        return;
+    if (!(pc->path = malloc(str_len(var) + 1)))
+        abort();
+    memcpy(pc->path, var->start, str_len(var));
+    pc->path[str_len(var)] = '\0';
+    for (p = pc->path; (p = strchr(p, ':')); p++)
+        n++;
+    if (!(pc->dirs = malloc(n * sizeof(*pc->dirs))))
+        abort();
+    for (p = pc->path; p; p = end) {
+        if ((end = strchr(p, ':')))
+            *end++ = '\0';
+        dir = &pc->dirs[pc->ndirs++];
+        dir->name = *p ? p : ".";
+        dir->fd = -1;
+        if (*p != '/')
+            pc->relative = 1;
+        if (*p == '/')
+            dir->fd = fd_above_user(open(p, O_PATH | O_DIRECTORY | O_CLOEXEC));
+    }
+}
+
+static int in_dir(const struct path_dir *dir, const char *cmd)
+{
+    struct stat sb;
+    char *name;
+    int found;
+    if (dir->fd >= 0)
+        return !faccessat(dir->fd, cmd, X_OK, AT_EACCESS) &&
+            !fstatat(dir->fd, cmd, &sb, 0) && !S_ISDIR(sb.st_mode);
+    if (dir->name[0] == '/')
+        return 0; // it could not be opened
+    if (asprintf(&name, "%s/%s", dir->name, cmd) < 0)
+        abort();
+    found = !access(name, X_OK) && !stat(name, &sb) && !S_ISDIR(sb.st_mode);
+    free(name);
+    return found;
+}
+
+static void grow_path_cache(struct path_cache *pc)
+{
+    struct hashed_cmd *old = pc->cmds, *cmd;
+    size_t old_size = old ? pc->mask + 1 : 0, size = old ? old_size * 2 : 32, i;
+    if (!(pc->cmds = calloc(size, sizeof(*pc->cmds))))
+        abort();
+    pc->mask = size - 1;
+    for (i = 0; i < old_size; i++) {
+        if (!old[i].name)
+            continue;
+        for (cmd = &pc->cmds[old[i].name->hash & pc->mask]; cmd->name;
+                cmd = &pc->cmds[(cmd - pc->cmds + 1) & pc->mask]);
+        *cmd = old[i];
+    }
+    free(old);
+}
+
+// Whether path is the coreutils binary or a link to it
+static int is_coreutils(const char *path)
+{
+    char *real = realpath(path, NULL);
+    const char *base;
+    int ret;
+    if (!real)
+        return 0;
+    base = strrchr(real, '/');
+    ret = !strcmp(base ? base + 1 : real, "coreutils");
+    free(real);
+    return ret;
+}
+
+/*
+ * Finds cmd, which has no slash in it, on PATH. Returns NULL if it is not
+ * there.
+ */
+static struct hashed_cmd *hash_command(struct shell *sh, const char *cmd)
+{
+    struct path_cache *pc = &sh->path;
+    const struct symbol *name;
+    struct hashed_cmd *hc;
+    size_t len = strlen(cmd), i;
+
+    if (pc->gen != sh->path_gen)
+        load_path(sh);
+    if (pc->count >= (pc->mask + 1) / 2)
+        grow_path_cache(pc);
+    // a name without a symbol has never been hashed
+    if ((name = find_symbol(cmd, len))) {
+        for (hc = &pc->cmds[name->hash & pc->mask]; hc->name;
+                hc = &pc->cmds[(hc - pc->cmds + 1) & pc->mask])
+            if (hc->name == name)
+                return hc->path ? hc : NULL;
+    }
+
+    for (i = 0; i < pc->ndirs; i++) {
+        if (in_dir(&pc->dirs[i], cmd))
+            break;
+    }
+    name = intern(cmd, len);
+    for (hc = &pc->cmds[name->hash & pc->mask]; hc->name;
+            hc = &pc->cmds[(hc - pc->cmds + 1) & pc->mask]);
+    hc->name = name;
+    pc->count++;
+    if (i == pc->ndirs)
+        return NULL;
+    hc->dir = i;
+    if (asprintf(&hc->path, "%s/%s", pc->dirs[i].name, cmd) < 0)
+        abort();
+    hc->applet = find_applet(cmd) && is_coreutils(hc->path);
+    return hc;
+}
+
+// Execs args like execve(), looking args[0] up on PATH unless it has a
+// slash in it. Only returns on failure.
+static void exec_command(struct shell *sh, char **args, char **env)
+{
+    const struct hashed_cmd *hc;
+    int fd;
+    if (strchr(args[0], '/') || !getvar(sh, path_name)) {
+        execve(args[0], args, env);
+        return;
+    }
+    if (!(hc = hash_command(sh, args[0]))) {
+        errno = ENOENT;
+        return;
+    }
+    // A #! script run through a close-on-exec fd fails with ENOENT, since
+    // the interpreter could not open it by /dev/fd; those go by name
+    fd = sh->path.dirs[hc->dir].fd;
+    if (fd < 0 || (execveat(fd, args[0], args, env, 0) < 0 && errno == ENOENT))
+        execve(hc->path, args, env);
+}
+
+// Looks a command up before starting it, so a forked child inherits what
+// was found and the next one does not have to look again. Returns what to
+// exec, or NULL if it is not on PATH.
+static const char *hash_args(struct shell *sh, char **args)
+{
+    struct hashed_cmd *hc;
+    if (!args[0] || strchr(args[0], '/') || !getvar(sh, path_name))
+        return args[0];
+    if (!(hc = hash_command(sh, args[0])))
+        return NULL;
+    hc->hits++;
+    return hc->path;
+}
+
+static void shell_init(struct shell *sh, struct args_frame *args)
+{
+    memset(sh, 0, sizeof(*sh));
+    sh->args = args;
+    sh->script = &sh->lex;
+    sh->pid = getpid();
+    sh->ifs_gen = sh->path_gen = 1;
+    sh->fields.buf = new_str();
+    sh->out = sh->outbuf = new_str();
+    if (!ifs_name)
+        ifs_name = intern("IFS", 3);
+    if (!path_name)
+        path_name = intern("PATH", 4);
+}
+
+static void destroy_shell(struct shell *sh)
+{
+    struct shell_func *f, *nf;
+    size_t i;
+    for (i = 0; i < sh->vars.count; i++)
+        free_str(sh->vars.vars[i].val);
+    free(sh->vars.vars);
+    free(sh->vars.index);
+    free(sh->envp);
+    free_str(sh->fields.buf);
+    free(sh->fields.offs);
+    free_str(sh->outbuf);
+    free(sh->args->owned);
+    clear_path_cache(&sh->path);
+    for (f = sh->funcs; f; f = nf) {
+        nf = f->next;
+        destroy_arena(&f->arena);
+        free(f);
+    }
+    destroy_lex(&sh->lex);
+}
+
+const char *strop(enum tok tok)
+{
+    const struct tok_def *def;
+    for (def = ops; def->tok; def++)
+        if (def->type == tok)
+            return def->tok;
+    return "?";
+}
+
+void show_redirs(struct redirect *redirs) {
+    struct redirect *r;
+    for (r = redirs; r; r = r->next) {
+        if (r->fd >= 0)
+            printf("%d", r->fd);
+        printf("%s", strop(r->op));
+        if (r->doc) {
+            printf("HEREDOC ");
+        } else {
+            printf("%.*s ", STR_FMT(r->name->tok));
+        }
+    }
+}
+
+void debug_show_node(node_t *node)
+{
+    struct var *v;
+    struct arg *a;
+    struct item *i;
+
+    if (!node) {
+        printf("(null)\n");
+        return;
+    }
+
+    switch (node->type) {
+    case CMD_SIMPLE: case CMD_ASSIGNMENT:
+        for (v = node->simp.vars; v; v = v->next)
+            printf("%.*s='%.*s' ", STR_FMT(v->name->name), STR_FMT(v->val->tok));
+        for (a = node->simp.args; a; a = a->next)
+            printf("%.*s ", STR_FMT(a->val->tok));
+        show_redirs(node->simp.redirs);
+        break;
+    case CMD_SUBSHELL:
+        printf("( ");
+        debug_show_node(node->sub.commands);
+        printf(node->sub.background ? ")&" : ")");
+        break;
+    case CMD_COMPOUND:
+        printf("{ ");
+        for (; node; node = (void *)node->comp.next) {
+            debug_show_node(node->comp.command);
+            printf(";");
+        }
+        printf(" }");
+        break;
+    case CMD_PIPELINE:
+        for (; node; node = (void *)node->pipe.next) {
+            debug_show_node(node->pipe.command);
+            printf("|");
+        }
+        break;
+    case CMD_LOOP:
+        printf(node->loop.until ? "until " : "while ");
+        debug_show_node(node->loop.cond);
+        printf("; do ");
+        debug_show_node(node->loop.commands);
+        printf("; done");
+        break;
+    case CMD_ANDOR:
+        for (; node; node = (void *)node->andor.next) {
+            if (node->andor.negated)
+                printf("! ");
+            debug_show_node(node->andor.command);
+            if (node->andor.next)
+                printf(node->andor.and ? " && " : " || ");
+        }
+        break;
+    case CMD_COND:
+        while (1) {
+            printf("if ");
+            debug_show_node(node->cond.cond);
+            printf("; then ");
+            debug_show_node(node->cond.commands);
+            if (!node->cond.otherwise)
+                break;
+            if (node->cond.otherwise->type != CMD_COND) {
+                printf("; else ");
+                debug_show_node(node->cond.otherwise);
+                break;
+            }
+            node = node->cond.otherwise;
+            printf("; el");
+        }
+        printf("; endif");
+        break;
+    case CMD_REDIRS:
+        debug_show_node(node->redirs.command);
+        show_redirs(node->redirs.redirs);
+        break;
+    case CMD_FUNCTION:
+        printf("%.*s ( ) { ", STR_FMT(node->func.name->name));
+        debug_show_node(node->func.command);
+        printf("; }");
+        break;
+    case CMD_FOR_LOOP:
+        printf("for %.*s ", STR_FMT(node->for_loop.name->name));
+        if (!node->for_loop.use_args) {
+            printf("in ");
+            for (i = node->for_loop.items; i; i = i->next)
+                printf("%.*s ", STR_FMT(i->val->tok));
+        }
+        printf("; do ");
+        debug_show_node(node->for_loop.command);
+        printf("; done");
+        break;
+    case CMD_CASES:
+        //TODO
+        break;
+    }
+}
+
+#define IFS_TEST(map, c) ((map)[(unsigned char)(c) >> 6] >> ((c) & 63) & 1)
+#define IFS_SET(map, c) ((map)[(unsigned char)(c) >> 6] |= (uint64_t)1 << ((c) & 63))
+
+// The bitmaps for the current IFS, rebuilt only after setvar() has changed it
+static const struct ifs_map *get_ifs(struct shell *sh)
+{
+    struct ifs_map *map = &sh->ifs;
+    const str_t *val;
+    const unsigned char *ptr, *end;
+    if (map->gen == sh->ifs_gen)
+        return map;
+    memset(map, 0, sizeof(*map));
+    map->gen = sh->ifs_gen;
+    if (!(val = getvar(sh, ifs_name))) {
+        ptr = (const unsigned char *)" \t\n";
+        end = ptr + 3;
+    } else {
+        ptr = val->start;
+        end = val->end;
+    }
+    map->first = ptr < end ? *ptr : -1;
+    for (; ptr < end; ptr++) {
+        IFS_SET(map->sep, *ptr);
+        if (*ptr == ' ' || *ptr == '\t' || *ptr == '\n')
+            IFS_SET(map->white, *ptr);
+    }
+    return map;
+}
+
+static void clear_fields(struct fields *fl)
+{
+    str_clear(fl->buf);
+    fl->count = 0;
+}
+
+// Ends the field that started at start and terminates it at the write
+// position w
+static size_t end_field(struct fields *fl, size_t start, size_t w)
+{
+    if (fl->count == fl->size) {
+        if (fl->size > SIZE_MAX / 2 / sizeof(*fl->offs))
+            abort();
+        fl->size = fl->size ? fl->size * 2 : 16;
+        fl->offs = realloc(fl->offs, fl->size * sizeof(*fl->offs));
+        if (!fl->offs)
+            abort();
+    }
+    fl->offs[fl->count++] = start;
+    fl->buf->start[w] = 0;
+    return w + 1;
+}
+
+// Where field splitting is within one word
+struct split {
+    size_t start; // of the field being built
+    int open;     // it has a character or a quoted part in it
+    int white;    // the last field was ended by IFS white space
+};
+
+/*
+ * Splits the bytes from `from` to the end of fl->buf in place, turning
+ * separators into the NULs that end fields. IFS white space is dropped at
+ * either end and runs of it separate fields once; every other separator,
+ * with any white space around it, ends exactly one field.
+ */
+static void split_fields(struct fields *fl, struct split *sp,
+        const struct ifs_map *map, size_t from)
+{
+    unsigned char *buf = fl->buf->start, c;
+    size_t r = from, w = from, len = str_len(fl->buf);
+    while (r < len) {
+        // the common case: a run with no separators needs no moving
+        if (r == w) {
+            while (r < len && !IFS_TEST(map->sep, buf[r]))
+                r++;
+            if (r > w)
+                sp->open = 1;
+            w = r;
+            if (r == len)
+                break;
+        }
+        c = buf[r++];
+        if (!IFS_TEST(map->sep, c)) {
+            buf[w++] = c;
+            sp->open = 1;
+        } else if (IFS_TEST(map->white, c)) {
+            if (sp->open) {
+                sp->start = w = end_field(fl, sp->start, w);
+                sp->open = 0;
+                sp->white = 1;
+            }
+        } else if (sp->open || !sp->white) {
+            sp->start = w = end_field(fl, sp->start, w);
+            sp->open = sp->white = 0;
+        } else {
+            sp->white = 0;
+        }
+    }
+    fl->buf->end = buf + w;
+}
+
+static void put_number(str_t *buf, int64_t num)
+{
+    char tmp[32];
+    int len = snprintf(tmp, sizeof(tmp), "%" PRId64, num);
+    str_put(buf, tmp, len);
+}
+
+// The positional parameters, $#, $@, $*, $? and $$. Returns -1 when name is
+// none of them, otherwise whether it is set. $* is joined with the first
+// character of IFS, and $@, where it is not split, with a space.
+static int expand_special(str_t *buf, struct shell *sh, const str_t *name)
+{
+    struct args_frame *args = sh->args;
+    int ch, i, sep, argc = args ? args->argc - args->shift : 0;
+    const unsigned char *p;
+    size_t n = 0;
+    ch = *name->start;
+    if (ch >= '0' && ch <= '9') {
+        for (p = name->start; p < name->end; p++) {
+            if (n < INT_MAX / 10)
+                n = n * 10 + (*p - '0');
+        }
+        if (n && args)
+            n += args->shift;
+        if (!args || n >= (size_t)args->argc)
+            return 0;
+        str_put(buf, args->argv[n], strlen(args->argv[n]));
+        return 1;
+    }
+    if (str_len(name) != 1)
+        return -1;
+    switch (ch) {
+    case '#':
+        put_number(buf, argc > 0 ? argc - 1 : 0);
+        return 1;
+    case '@': case '*':
+        sep = ch == '*' ? get_ifs(sh)->first : ' ';
+        for (i = 1; i < argc; i++) {
+            if (i > 1 && sep >= 0)
+                str_putc(buf, sep);
+            str_put(buf, args->argv[args->shift + i],
+                    strlen(args->argv[args->shift + i]));
+        }
+        return argc > 1;
+    case '?':
+        put_number(buf, sh->exit_status);
+        return 1;
+    case '$':
+        put_number(buf, sh->pid);
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+// Appends the value of a parameter to buf, returning 0 if it is unset
+static int param_value(str_t *buf, struct shell *sh, const struct symbol *sym)
+{
+    const str_t *val;
+    int set = expand_special(buf, sh, sym->name);
+    if (set >= 0)
+        return set;
+    val = getvar(sh, sym);
+    if (!val)
+        return 0;
+    str_put(buf, val->start, str_len(val));
+    return 1;
+}
+
+static void expand_into(str_t *buf, struct shell *sh, const struct flat *f,
+        const struct flat_part *part);
+static void command_subst(str_t *buf, struct shell *sh, const struct flat *f,
+        uint32_t body);
+
+static void arith_error(const char *msg)
+{
+    fprintf(stderr, "arithmetic expression: %s\n", msg);
+    exit(2);
+}
+
+// Evaluated in 64 bits, with overflow wrapping around
+static int64_t arith_binop(int op, int64_t x, int64_t y)
+{
+    uint64_t ux = x, uy = y;
+    switch (op) {
+    case ARITH_MUL: return (int64_t)(ux * uy);
+    case ARITH_DIV: case ARITH_MOD:
+        if (!y)
+            arith_error("division by zero");
+        if (x == INT64_MIN && y == -1)
+            return op == ARITH_DIV ? x : 0;
+        return op == ARITH_DIV ? x / y : x % y;
+    case ARITH_ADD: return (int64_t)(ux + uy);
+    case ARITH_SUB: return (int64_t)(ux - uy);
+    case ARITH_SHL: return (int64_t)(ux << (uy & 63));
+    case ARITH_SHR: return x >> (uy & 63);
+    case ARITH_LT: return x < y;
+    case ARITH_LE: return x <= y;
+    case ARITH_GT: return x > y;
+    case ARITH_GE: return x >= y;
+    case ARITH_EQ: return x == y;
+    case ARITH_NE: return x != y;
+    case ARITH_BITAND: return x & y;
+    case ARITH_XOR: return x ^ y;
+    case ARITH_BITOR: return x | y;
+    default: abort();
+    }
+}
+
+static int64_t arith_eval(struct shell *sh, const struct arith *n, int depth);
+
+/*
+ * The value of a variable used in an expression. An unset or empty one is
+ * 0, and one that is not just a number is itself evaluated as an expression,
+ * the way bash and dash do it.
+ */
+static int64_t arith_value(struct shell *sh, const struct symbol *sym,
+        int depth)
+{
+    struct arith_parser ap;
+    const str_t *val;
+    const unsigned char *s, *end;
+    int64_t num = 0;
+    size_t len;
+    str_t tmp;
+    str_init(&tmp);
+    if (expand_special(&tmp, sh, sym->name) >= 0)
+        val = &tmp;
+    else if (!(val = getvar(sh, sym)))
+        return 0;
+    s = val->start;
+    end = val->end;
+    while (s < end && (*s == ' ' || *s == '\t' || *s == '\n'))
+        s++;
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n'))
+        end--;
+    len = arith_scan_number(s, end, &num);
+    if (s < end && s + len != end) {
+        if (depth >= 64)
+            arith_error("expression recursion level exceeded");
+        if (!arith_parse(&ap, s, end - s)) {
+            fprintf(stderr, "%.*s: %s\n", STR_FMT(val), ap.err);
+            exit(2);
+        }
+        num = arith_eval(sh, &ap.nodes[ap.count - 1], depth + 1);
+        free(ap.nodes);
+    }
+    str_free_buf(&tmp);
+    return num;
+}
+
+static int64_t arith_eval(struct shell *sh, const struct arith *n, int depth)
+{
+    int64_t x;
+    char tmp[32];
+    str_t val;
+    int len;
+    switch (n->op) {
+    case ARITH_NUM:
+        return n->num;
+    case ARITH_NAME: case ARITH_PARAM:
+        return arith_value(sh, n->sym, depth);
+    case ARITH_NEG:
+        return (int64_t)(0 - (uint64_t)arith_eval(sh, ARITH_ARG(n, a), depth));
+    case ARITH_NOT:
+        return !arith_eval(sh, ARITH_ARG(n, a), depth);
+    case ARITH_BITNOT:
+        return ~arith_eval(sh, ARITH_ARG(n, a), depth);
+    case ARITH_AND:
+        return arith_eval(sh, ARITH_ARG(n, a), depth) &&
+            arith_eval(sh, ARITH_ARG(n, b), depth);
+    case ARITH_OR:
+        return arith_eval(sh, ARITH_ARG(n, a), depth) ||
+            arith_eval(sh, ARITH_ARG(n, b), depth);
+    case ARITH_COND:
+        return arith_eval(sh, ARITH_ARG(n, a), depth) ?
+            arith_eval(sh, ARITH_ARG(n, b), depth) :
+            arith_eval(sh, ARITH_ARG(n, c), depth);
+    case ARITH_ASSIGN:
+        x = arith_eval(sh, ARITH_ARG(n, a), depth);
+        if (n->assign != ARITH_NUM)
+            x = arith_binop(n->assign, arith_value(sh, n->sym, depth), x);
+        len = snprintf(tmp, sizeof(tmp), "%" PRId64, x);
+        val = (str_t){(unsigned char *)tmp, (unsigned char *)tmp + len,
+            NULL, NULL, {0}};
+        // an error in an expansion, which ends the shell
+        if (setvar(sh, n->sym, &val, -1) < 0)
+            exit(2);
+        return x;
+    default:
+        x = arith_eval(sh, ARITH_ARG(n, a), depth);
+        return arith_binop(n->op, x, arith_eval(sh, ARITH_ARG(n, b), depth));
+    }
+}
+
+
+static void expand_word(str_t *buf, struct shell *sh, const struct flat *f,
+        struct flat_span word)
+{
+    const struct flat_part *part = f->parts + word.start;
+    const struct flat_part *end = part + word.count;
+    for (; part < end; part++)
+        expand_into(buf, sh, f, part);
+}
+
+// Expands word as a pattern for fnmatch(), where whatever was quoted only
+// matches itself
+static void expand_pattern(str_t *buf, struct shell *sh, const struct flat *f,
+        struct flat_span word)
+{
+    const struct flat_part *part = f->parts + word.start;
+    const struct flat_part *end = part + word.count;
+    str_t *tmp = new_str();
+    unsigned char *p;
+    for (; part < end; part++) {
+        if (!part->quoted) {
+            expand_into(buf, sh, f, part);
+            continue;
+        }
+        str_clear(tmp);
+        expand_into(tmp, sh, f, part);
+        for (p = tmp->start; p < tmp->end; p++) {
+            if (strchr("\\*?[", *p))
+                str_putc(buf, '\\');
+            str_putc(buf, *p);
+        }
+    }
+    str_putc(buf, '\0');
+    free_str(tmp);
+}
+
+/*
+ * ${name%word}, ${name%%word}, ${name#word} and ${name##word}: removes the
+ * shortest or longest suffix or prefix matching word from the value at the
+ * end of buf, starting at mark.
+ */
+static void trim_param(str_t *buf, size_t mark, struct shell *sh,
+        const struct flat *f, const struct flat_part *part)
+{
+    str_t *pat = new_str(), *val = new_str();
+    char *s, save;
+    size_t len = str_len(buf) - mark, i, n;
+    int suffix = part->op == PARAM_SUFFIX || part->op == PARAM_LONG_SUFFIX;
+    int longest = part->op == PARAM_LONG_SUFFIX || part->op == PARAM_LONG_PREFIX;
+
+    str_put(val, buf->start + mark, len);
+    str_putc(val, '\0');
+    s = (char *)val->start;
+    expand_pattern(pat, sh, f, part->arg);
+    for (i = 0; i <= len; i++) {
+        // n is the length of the piece that would be removed
+        n = longest ? len - i : i;
+        if (suffix) {
+            if (!fnmatch((char *)pat->start, s + len - n, 0)) {
+                buf->end = buf->start + mark + len - n;
+                break;
+            }
+        } else {
+            save = s[n];
+            s[n] = '\0';
+            if (!fnmatch((char *)pat->start, s, 0)) {
+                memmove(buf->start + mark, buf->start + mark + n, len - n);
+                buf->end = buf->start + mark + len - n;
+                break;
+            }
+            s[n] = save;
+        }
+    }
+    free_str(pat);
+    free_str(val);
+}
+
+static void param_error(struct shell *sh, const struct flat *f,
+        const struct flat_part *part)
+{
+    str_t *msg = new_str();
+    expand_word(msg, sh, f, part->arg);
+    if (str_empty(msg))
+        fprintf(stderr, "%.*s: %s\n", STR_FMT(part->sym->name),
+                part->colon ? "parameter not set or null"
+                    : "parameter not set");
+    else
+        fprintf(stderr, "%.*s: %.*s\n", STR_FMT(part->sym->name),
+                STR_FMT(msg));
+    exit(2);
+}
+
+/*
+ * Expands a parameter and whatever operator is applied to it onto the end of
+ * buf. For ${name-word} and ${name+word}, returns 1 instead when word should
+ * be expanded in its place, so that expand_fields() can split it the way it
+ * was quoted.
+ */
+static int expand_param(str_t *buf, struct shell *sh, const struct flat *f,
+        const struct flat_part *part)
+{
+    size_t mark = str_len(buf), len;
+    int set = param_value(buf, sh, part->sym);
+    // with a colon an empty value counts as unset
+    int missing = !set || (part->colon && str_len(buf) == mark);
+    str_t tmp;
+
+    switch (part->op) {
+    case PARAM_PLAIN:
+        return 0;
+    case PARAM_LENGTH:
+        len = str_len(buf) - mark;
+        buf->end = buf->start + mark;
+        put_number(buf, len);
+        return 0;
+    case PARAM_DEFAULT:
+        if (!missing)
+            return 0;
+        buf->end = buf->start + mark;
+        return 1;
+    case PARAM_ALTERNATE:
+        buf->end = buf->start + mark;
+        return !missing;
+    case PARAM_ASSIGN:
+        if (!missing)
+            return 0;
+        // positional and special parameters cannot be assigned
+        if (is_special_param(*part->sym->name->start)) {
+            fprintf(stderr, "%.*s: bad variable name\n",
+                    STR_FMT(part->sym->name));
+            exit(2);
+        }
+        buf->end = buf->start + mark;
+        expand_word(buf, sh, f, part->arg);
+        tmp = (str_t){buf->start + mark, buf->end, NULL, NULL, {0}};
+        if (setvar(sh, part->sym, &tmp, -1) < 0)
+            exit(2);
+        return 0;
+    case PARAM_ERROR:
+        if (missing)
+            param_error(sh, f, part);
+        return 0;
+    default:
+        trim_param(buf, mark, sh, f, part);
+        return 0;
+    }
+}
+
+// A $((...)) that lex_arith_word() made a word of: the word is expanded,
+// and what it expands to parsed and evaluated
+static int64_t arith_expand(struct shell *sh, const struct flat *f,
+        struct flat_span word)
+{
+    struct arith_parser ap;
+    str_t *text = new_str();
+    int64_t num;
+    expand_word(text, sh, f, word);
+    if (!arith_parse(&ap, text->start, str_len(text))) {
+        fprintf(stderr, "%.*s: %s\n", STR_FMT(text), ap.err);
+        exit(2);
+    }
+    num = arith_eval(sh, &ap.nodes[ap.count - 1], 0);
+    free(ap.nodes);
+    free_str(text);
+    return num;
+}
+
+static void expand_into(str_t *buf, struct shell *sh, const struct flat *f,
+        const struct flat_part *part)
+{
+    switch (part->type) {
+    case WORD_PARAMETER:
+        if (expand_param(buf, sh, f, part))
+            expand_word(buf, sh, f, part->arg);
+        break;
+    case WORD_STRING:
+        str_put(buf, part->start, part->len);
+        break;
+    case WORD_ARITHMETIC:
+        if (part->arith)
+            put_number(buf, arith_eval(sh, part->arith, 0));
+        else
+            put_number(buf, arith_expand(sh, f, part->arg));
+        break;
+    case WORD_COMMAND: case WORD_BACKTICK:
+        command_subst(buf, sh, f, part->body);
+        break;
+    default:
+        abort();
+    }
+}
+
+// "$@" is a field for each positional parameter, and none when there are
+// none; the first and the last join up with what is next to them in the word
+static void split_at(struct fields *fl, struct split *sp, struct shell *sh)
+{
+    struct args_frame *args = sh->args;
+    int i, argc = args ? args->argc - args->shift : 0;
+    const char *arg;
+    for (i = 1; i < argc; i++) {
+        if (i > 1) {
+            str_reserve(fl->buf, 1);
+            sp->start = end_field(fl, sp->start, str_len(fl->buf));
+            fl->buf->end++;
+        }
+        arg = args->argv[args->shift + i];
+        str_put(fl->buf, arg, strlen(arg));
+        sp->open = 1;
+    }
+}
+
+// Unquoted $@ and $*: each positional parameter is split on its own, and
+// what it ends with does not run into the next one
+static void split_args(struct fields *fl, struct split *sp, struct shell *sh)
+{
+    struct args_frame *args = sh->args;
+    const struct ifs_map *ifs = get_ifs(sh);
+    int i, argc = args ? args->argc - args->shift : 0;
+    const char *arg;
+    size_t from;
+    for (i = 1; i < argc; i++) {
+        if (i > 1 && sp->open) {
+            str_reserve(fl->buf, 1);
+            sp->start = end_field(fl, sp->start, str_len(fl->buf));
+            fl->buf->end++;
+            sp->open = sp->white = 0;
+        }
+        arg = args->argv[args->shift + i];
+        from = str_len(fl->buf);
+        str_put(fl->buf, arg, strlen(arg));
+        split_fields(fl, sp, ifs, from);
+    }
+}
+
+// Appends word to fl, splitting the results of the unquoted expansions in it.
+// The word in ${name-word} is one itself, so all of it that is unquoted is.
+static void split_parts(struct fields *fl, struct split *sp,
+        struct shell *sh, const struct flat *f, struct flat_span word,
+        int expanded)
+{
+    const struct flat_part *part = f->parts + word.start;
+    const struct flat_part *end = part + word.count;
+    size_t from;
+    for (; part < end; part++) {
+        from = str_len(fl->buf);
+        if (part->type == WORD_PARAMETER && part->quoted &&
+                part->op == PARAM_PLAIN && str_len(part->sym->name) == 1 &&
+                *part->sym->name->start == '@') {
+            split_at(fl, sp, sh);
+            continue;
+        }
+        if (part->type == WORD_PARAMETER && !part->quoted &&
+                part->op == PARAM_PLAIN && str_len(part->sym->name) == 1 &&
+                strchr("@*", *part->sym->name->start)) {
+            split_args(fl, sp, sh);
+            continue;
+        }
+        if (part->type == WORD_PARAMETER) {
+            if (expand_param(fl->buf, sh, f, part)) {
+                // "${u-}" is still one field, even with an empty word
+                if (part->quoted)
+                    sp->open = 1;
+                split_parts(fl, sp, sh, f, part->arg, 1);
+                continue;
+            }
+        } else {
+            expand_into(fl->buf, sh, f, part);
+        }
+        if (part->quoted || (part->type == WORD_STRING && !expanded))
+            sp->open = 1;
+        else
+            split_fields(fl, sp, get_ifs(sh), from);
+    }
+}
+
+// Expands word onto the end of fl, split into fields
+static void expand_fields(struct fields *fl, struct shell *sh,
+        const struct flat *f, struct flat_span word)
+{
+    struct split sp;
+    sp.start = str_len(fl->buf);
+    sp.open = sp.white = 0;
+    split_parts(fl, &sp, sh, f, word, 0);
+    // an unquoted word that expands to nothing produces no field
+    if (sp.open) {
+        str_reserve(fl->buf, 1);
+        end_field(fl, sp.start, str_len(fl->buf));
+        fl->buf->end++;
+    }
+}
+
+// Copies the fields into an argv that is a single allocation
+static char **fields_argv(const struct fields *fl)
+{
+    size_t len = str_len(fl->buf), i;
+    char **argv, *strs;
+    if (fl->count > (SIZE_MAX - len) / sizeof(char *) - 1)
+        abort();
+    argv = malloc((fl->count + 1) * sizeof(char *) + len);
+    if (!argv)
+        abort();
+    strs = (char *)(argv + fl->count + 1);
+    if (len)
+        memcpy(strs, fl->buf->start, len);
+    for (i = 0; i < fl->count; i++)
+        argv[i] = strs + fl->offs[i];
+    argv[i] = NULL;
+    return argv;
+}
+
+char **expand_join(struct shell *sh, const struct flat *f, struct flat_span word)
+{
+    clear_fields(&sh->fields);
+    expand_fields(&sh->fields, sh, f, word);
+    return fields_argv(&sh->fields);
+}
+
+char **make_args(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd)
+{
+    uint32_t i;
+    clear_fields(&sh->fields);
+    for (i = 0; i < cmd->args.count; i++)
+        expand_fields(&sh->fields, sh, f, f->words[cmd->args.start + i]);
+    return fields_argv(&sh->fields);
+}
+
+static void expand_value(str_t *buf, struct shell *sh, const struct flat *f,
+        const struct flat_var *var)
+{
+    const struct flat_part *part = f->parts + var->val.start;
+    const struct flat_part *end = part + var->val.count;
+    str_clear(buf);
+    for (; part < end; part++)
+        expand_into(buf, sh, f, part);
+}
+
+static void do_assign(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd)
+{
+    const struct flat_var *v = f->vars + cmd->vars.start;
+    const struct flat_var *vend = v + cmd->vars.count;
+    str_t *buf = new_str();
+    unsigned long substs = sh->substs;
+    for (; v < vend; v++) {
+        expand_value(buf, sh, f, v);
+        // a non-interactive shell exits on an assignment error
+        if (setvar(sh, v->name, buf, -1) < 0)
+            exit(2);
+    }
+    free_str(buf);
+    // the status is that of the last command substitution, if there was one
+    if (sh->substs == substs)
+        sh->exit_status = 0;
+}
+
+// The exported variables as an envp block: environ itself until setvar()
+// first changes an exported variable, then a block of our own, rebuilt only
+// once env_gen has moved on since the last time. fork_shell() brings it up
+// to date before forking, so children find it ready instead of each
+// building it.
+static char **export_env(struct shell *sh)
+{
+    struct shell_var *svar, *svar_end;
+    size_t count = 0, size = sizeof(char *), len;
+    char **vend, *end;
+    if (!sh->env_gen)
+        return environ;
+    if (sh->envp && sh->envp_gen == sh->env_gen)
+        return sh->envp;
+    import_env(sh);
+    svar_end = sh->vars.vars + sh->vars.count;
+    for (svar = sh->vars.vars; svar < svar_end; svar++) {
+        if (!svar->exported || !svar->val)
+            continue;
+        len = str_len(svar->name->name) + str_len(svar->val) + 2 +
+            sizeof(char *);
+        if (size > SIZE_MAX - len)
+            abort();
+        size += len;
+        count++;
+    }
+    free(sh->envp);
+    if (!(sh->envp = malloc(size)))
+        abort();
+    vend = sh->envp;
+    end = (char *)(vend + count + 1);
+    for (svar = sh->vars.vars; svar < svar_end; svar++) {
+        if (!svar->exported || !svar->val)
+            continue;
+        *vend++ = end;
+        len = str_len(svar->name->name);
+        memcpy(end, svar->name->name->start, len);
+        end += len;
+        *end++ = '=';
+        len = str_len(svar->val);
+        if (len)
+            memcpy(end, svar->val->start, len);
+        end += len;
+        *end++ = 0;
+    }
+    *vend = NULL;
+    sh->envp_gen = sh->env_gen;
+    return sh->envp;
+}
+
+// The environment for cmd. Without prefix assignments that is the shared
+// export_env() block; with them it is that block with the assignments laid
+// over it. Either way it is only good until the next setvar().
+char **make_env(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd)
+{
+    const struct flat_var *var = f->vars + cmd->vars.start;
+    const struct flat_var *var_end = var + cmd->vars.count, *v;
+    char **base = export_env(sh), **env, **e, **vend;
+    str_t *buf;
+    size_t len;
+    if (!cmd->vars.count)
+        return base;
+    for (e = base; *e; e++);
+    if ((size_t)(e - base) > SIZE_MAX / sizeof(char *) - cmd->vars.count - 1)
+        abort();
+    env = malloc((e - base + cmd->vars.count + 1) * sizeof(char *));
+    if (!env)
+        abort();
+    vend = env;
+    for (e = base; *e; e++) {
+        for (v = var; v < var_end; v++) {
+            len = str_len(v->name->name);
+            if (!strncmp(*e, (char *)v->name->name->start, len) &&
+                    (*e)[len] == '=')
+                break;
+        }
+        if (v == var_end)
+            *vend++ = *e;
+    }
+    buf = new_str();
+    for (; var < var_end; var++) {
+        // a later assignment to the same name wins
+        for (v = var + 1; v < var_end && v->name != var->name; v++);
+        if (v < var_end)
+            continue;
+        if (var_read_only(lookup_var(sh, var->name)))
+            exit(2);
+        expand_value(buf, sh, f, var);
+        len = str_len(var->name->name);
+        if (!(*vend = malloc(len + str_len(buf) + 2)))
+            abort();
+        memcpy(*vend, var->name->name->start, len);
+        (*vend)[len] = '=';
+        memcpy(*vend + len + 1, buf->start, str_len(buf) + 1);
+        vend++;
+    }
+    free_str(buf);
+    *vend = NULL;
+    return env;
+}
+
+// Frees what make_env() made for cmd, for an env that was not exec'd
+static void free_env(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd, char **env)
+{
+    const struct flat_var *var = f->vars + cmd->vars.start;
+    const struct flat_var *var_end = var + cmd->vars.count, *v;
+    char **e;
+    (void)sh;
+    if (!cmd->vars.count)
+        return;
+    for (e = env; *e; e++);
+    // the assignments are at the end, one for each name
+    for (; var < var_end; var++) {
+        for (v = var + 1; v < var_end && v->name != var->name; v++);
+        if (v == var_end)
+            free(*--e);
+    }
+    free(env);
+}
+
+void enter_subshell(struct shell *sh)
+{
+    sh->loop_depth = 0;
+    sh->in_func = 0;
+    // a child's builtins write to its own stdout, even under $(...)
+    sh->out = sh->outbuf;
+}
+
+// Heredocs in a memfd get a fresh open file description so every reader
+// starts at offset 0. Small ones are written into a pipe, which can hold them
+// without anybody reading yet.
+static int open_heredoc(struct heredoc *doc)
+{
+    char path[64];
+    int fd[2];
+    size_t len = str_len(doc->doc);
+    if (doc->fd < 0 && len > PIPE_BUF) {
+        // Documents loaded from the AST cache only exist in memory
+        doc->fd = fd_above_user(memfd_create("heredoc", MFD_CLOEXEC));
+        if (doc->fd < 0)
+            return -1;
+        if (write_all(doc->fd, doc->doc->start, len) < 0) {
+            close(doc->fd);
+            doc->fd = -1;
+            return -1;
+        }
+    }
+    if (doc->fd >= 0) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", doc->fd);
+        fd[0] = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd[0] < 0) {
+            fd[0] = fcntl(doc->fd, F_DUPFD_CLOEXEC, 0);
+            if (fd[0] >= 0)
+                lseek(fd[0], 0, SEEK_SET);
+        }
+        return fd[0];
+    }
+    if (len > PIPE_BUF) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (pipe2(fd, O_CLOEXEC) < 0)
+        return -1;
+    if (write_all(fd[1], doc->doc->start, len) < 0) {
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    }
+    close(fd[1]);
+    return fd[0];
+}
+
+/*
+ * Redirections are carried out in two steps. plan_redirs() expands the
+ * targets and opens the files, all close-on-exec, and leaves a list of
+ * dup2()s and close()s with nothing left to fail but those. A child that is
+ * going to exec applies the plan as it is, or posix_spawn() does it from
+ * file actions. The shell itself applies it with apply_redirs(), saving
+ * each fd it replaces to put back afterwards with revert_redirs().
+ */
+
+// fd becomes a copy of src, or is closed if src is -1
+struct redir_step {
+    int fd, src;
+};
+
+struct redir_plan {
+    struct redir_step *steps;
+    int *opened; // the fds the shell opened for steps
+    size_t count, nopened;
+};
+
+// The fds a redirection in the shell replaced: saved is a close-on-exec copy
+// of what fd was, or -1 if it was not open
+struct savedfd {
+    size_t count;
+    struct {
+        int fd, saved;
+    } fds[];
+};
+
+// Expands the target of a redirection into sh->fields, which has to come
+// out as exactly one field
+static const char *redir_name(struct shell *sh, const struct flat *f,
+        struct flat_span word)
+{
+    clear_fields(&sh->fields);
+    expand_fields(&sh->fields, sh, f, word);
+    if (sh->fields.count != 1)
+        return NULL;
+    return (const char *)sh->fields.buf->start;
+}
+
+// Whether fd is what another redirection in span is for
+static int redir_target(const struct flat *f, struct flat_span span,
+        const struct flat_redir *self, int fd)
+{
+    const struct flat_redir *r = f->redirs + span.start;
+    const struct flat_redir *end = r + span.count;
+    for (; r < end; r++)
+        if (r != self && r->fd == fd)
+            return 1;
+    return 0;
+}
+
+// Whether a file was opened right on the fd it is for, which happens when
+// that fd was not open
+static int opened_on(const struct redir_plan *plan, int fd)
+{
+    size_t i;
+    for (i = 0; i < plan->nopened; i++)
+        if (plan->opened[i] == fd)
+            return 1;
+    return 0;
+}
+
+// Closes the fds opened for plan, except, if keep, the ones that were opened
+// right on the fd they are for
+static void close_plan(struct redir_plan *plan, int keep)
+{
+    size_t i, j;
+    for (i = 0; i < plan->nopened; i++) {
+        for (j = 0; keep && j < plan->count; j++)
+            if (plan->steps[j].fd == plan->opened[i])
+                break;
+        if (!keep || j == plan->count)
+            close(plan->opened[i]);
+    }
+    free(plan->steps);
+}
+
+// Moves *fd to the lowest free fd from low up
+static int move_fd(int *fd, int low)
+{
+    int moved = fcntl(*fd, F_DUPFD_CLOEXEC, low);
+    if (moved < 0)
+        return -1;
+    close(*fd);
+    *fd = moved;
+    return 0;
+}
+
+// The fds the shell keeps for itself are above 9, but a script may redirect
+// those as well. Any that a redirection in span is for is first moved above
+// all of them, as bash does.
+static int move_shell_fds(struct shell *sh, const struct flat *f,
+        struct flat_span span)
+{
+    const struct flat_redir *r, *end = f->redirs + span.start + span.count;
+    struct path_cache *pc = &sh->path;
+    struct lexer *lex;
+    size_t i;
+    int low = 10;
+    for (r = f->redirs + span.start; r < end; r++)
+        if (r->fd >= low)
+            low = r->fd + 1;
+    if (low == 10)
+        return 0;
+    for (r = f->redirs + span.start; r < end; r++) {
+        if (r->fd < 10)
+            continue;
+        for (lex = sh->script; lex; lex = lex->outer)
+            if (lex->in.fd == r->fd && move_fd(&lex->in.fd, low) < 0)
+                return -1;
+        for (i = 0; i < pc->ndirs; i++)
+            if (pc->dirs[i].fd == r->fd && move_fd(&pc->dirs[i].fd, low) < 0)
+                return -1;
+    }
+    return 0;
+}
+
+static int plan_redirs(struct shell *sh, const struct flat *f,
+        struct flat_span span, struct redir_plan *plan)
+{
+    const struct flat_redir *r = f->redirs + span.start;
+    const struct flat_redir *end = r + span.count;
+    struct redir_step *step;
+    const char *name;
+    char *num_end;
+    long src;
+    int fd, moved, flags;
+
+    plan->count = plan->nopened = 0;
+    plan->steps = malloc(span.count * (sizeof(*plan->steps) + sizeof(int)));
+    if (!plan->steps)
+        abort();
+    plan->opened = (int *)(plan->steps + span.count);
+    if (move_shell_fds(sh, f, span) < 0) {
+        perror("redirect");
+        goto fail;
+    }
+    for (; r < end; r++) {
+        step = &plan->steps[plan->count++];
+        step->fd = r->fd;
+        if (r->doc) {
+            if ((fd = open_heredoc(r->doc)) < 0) {
+                perror("failed to open heredoc");
+                goto fail;
+            }
+            goto opened;
+        }
+        if (!(name = redir_name(sh, f, r->name))) {
+            fprintf(stderr, "ambiguous redirect\n");
+            goto fail;
+        }
+        switch (r->op) {
+        case TOK_LESSAND:
+        case TOK_GREATAND:
+            if (!strcmp(name, "-")) {
+                step->src = -1;
+                continue;
+            }
+            errno = 0;
+            src = strtol(name, &num_end, 10);
+            if (errno || !*name || *num_end || src < 0 || src > INT_MAX) {
+                fprintf(stderr, "%s: bad file descriptor\n", name);
+                goto fail;
+            }
+            step->src = src;
+            continue;
+        case TOK_LESS:
+            flags = O_RDONLY;
+            break;
+        case TOK_LESSGREAT:
+            flags = O_RDWR | O_CREAT;
+            break;
+        case TOK_DGREAT:
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            break;
+        default:
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+            break;
+        }
+        if ((fd = open(name, flags | O_CLOEXEC, 0666)) < 0) {
+            fprintf(stderr, "%s: %s\n", name, strerror(errno));
+            goto fail;
+        }
+opened:
+        // another step would clobber it before it got used
+        while (redir_target(f, span, r, fd)) {
+            moved = fcntl(fd, F_DUPFD_CLOEXEC, fd + 1);
+            close(fd);
+            if ((fd = moved) < 0) {
+                perror("fcntl");
+                goto fail;
+            }
+        }
+        plan->opened[plan->nopened++] = step->src = fd;
+    }
+    return 0;
+
+fail:
+    close_plan(plan, 0);
+    return -1;
+}
+
+// A file opened right on the fd it is for only has to stay open over exec
+static int apply_step(const struct redir_step *step)
+{
+    int ret;
+    if (step->src < 0)
+        return close(step->fd) < 0 && errno != EBADF ? -1 : 0;
+    if (step->src == step->fd)
+        ret = fcntl(step->fd, F_SETFD, 0);
+    else
+        ret = dup2(step->src, step->fd);
+    if (ret < 0) {
+        fprintf(stderr, "%d: %s\n", step->src, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Carries out a plan in a child that is going to exec or exit, so there is
+// nothing to save or close
+static int exec_plan(const struct redir_plan *plan)
+{
+    size_t i;
+    for (i = 0; i < plan->count; i++)
+        if (apply_step(&plan->steps[i]) < 0)
+            return -1;
+    return 0;
+}
+
+static void add_file_actions(posix_spawn_file_actions_t *actions,
+        const struct redir_plan *plan)
+{
+    const struct redir_step *step = plan->steps, *end = step + plan->count;
+    for (; step < end; step++) {
+        if (step->src < 0)
+            posix_spawn_file_actions_addclose(actions, step->fd);
+        else
+            posix_spawn_file_actions_adddup2(actions, step->src, step->fd);
+    }
+}
+
+void revert_redirs(struct shell *sh, struct savedfd *save)
+{
+    size_t i;
+    (void) sh;
+    if (!save)
+        return;
+    for (i = save->count; i-- > 0;) {
+        if (save->fds[i].saved < 0) {
+            close(save->fds[i].fd);
+        } else {
+            dup2(save->fds[i].saved, save->fds[i].fd);
+            close(save->fds[i].saved);
+        }
+    }
+    free(save);
+}
+
+// Makes redirections in the shell permanent, as exec without a command does
+static void keep_redirs(struct savedfd *save)
+{
+    size_t i;
+    if (!save)
+        return;
+    for (i = 0; i < save->count; i++) {
+        if (save->fds[i].saved >= 0)
+            close(save->fds[i].saved);
+    }
+    free(save);
+}
+
+// Redirects in the shell itself. Only the first change to each fd is saved,
+// since putting that back undoes the rest.
+struct savedfd *apply_redirs(struct shell *sh, const struct flat *f,
+        struct flat_span span)
+{
+    struct redir_plan plan;
+    struct savedfd *save;
+    const struct redir_step *step;
+    size_t i, j;
+    int fd, low = 10;
+    if (plan_redirs(sh, f, span, &plan) < 0)
+        return NULL;
+    save = malloc(sizeof(*save) + plan.count * sizeof(*save->fds));
+    if (!save)
+        abort();
+    save->count = 0;
+    // copies are kept above every fd the plan touches
+    for (i = 0; i < plan.count; i++)
+        if (plan.steps[i].fd >= low)
+            low = plan.steps[i].fd + 1;
+    for (i = 0; i < plan.count; i++) {
+        step = &plan.steps[i];
+        fd = step->fd;
+        for (j = 0; j < save->count && save->fds[j].fd != fd; j++);
+        if (j == save->count) {
+            save->fds[j].fd = fd;
+            save->fds[j].saved = -1;
+            if (!opened_on(&plan, fd)) {
+                save->fds[j].saved = fcntl(fd, F_DUPFD_CLOEXEC, low);
+                if (save->fds[j].saved < 0 && errno != EBADF) {
+                    perror("redirect");
+                    goto fail;
+                }
+            }
+            save->count++;
+        }
+        if (apply_step(step) < 0)
+            goto fail;
+    }
+    close_plan(&plan, 1);
+    return save;
+
+fail:
+    close_plan(&plan, 0);
+    revert_redirs(sh, save);
+    return NULL;
+}
+
+/*
+ * Builtins
+ *
+ * A builtin writes its output into sh->out. Normally that is sh->outbuf,
+ * which run_builtin() flushes to fd 1 when the builtin returns; while a
+ * command substitution runs in the shell it is the buffer the output is
+ * being captured into, and nothing is written anywhere.
+ */
+typedef int (*builtin_t)(struct shell *sh, int argc, char **argv);
+
+enum {
+    BUILTIN_SPECIAL = 1, // found before functions, and assignments stay
+    BUILTIN_PURE = 2,    // changes nothing in the shell, see subst_in_shell()
+};
+
+struct builtin {
+    const char *name;
+    builtin_t func;
+    int flags;
+};
+
+/*
+ * Puts the character escaped by the backslash before *s and moves *s past
+ * the escape. Returns 0 for \c, which ends the output. Octal escapes are
+ * \0nnn in echo and %b and \nnn in a printf format.
+ */
+static int put_escape(str_t *out, const char **s, int zero_octal)
+{
+    const char *p = *s;
+    int ch = *p++, val, n;
+    switch (ch) {
+    case 'a': ch = '\a'; break;
+    case 'b': ch = '\b'; break;
+    case 'e': ch = 033; break;
+    case 'f': ch = '\f'; break;
+    case 'n': ch = '\n'; break;
+    case 'r': ch = '\r'; break;
+    case 't': ch = '\t'; break;
+    case 'v': ch = '\v'; break;
+    case '\\': break;
+    case 'c':
+        *s = p;
+        return 0;
+    case 'x':
+        for (val = n = 0; n < 2 && isxdigit((unsigned char)*p); n++, p++)
+            val = val * 16 + (isdigit((unsigned char)*p) ? *p - '0' :
+                    (*p | 040) - 'a' + 10);
+        if (!n) {
+            str_putc(out, '\\');
+            break;
+        }
+        ch = val;
+        break;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7':
+        if (zero_octal && ch != '0')
+            goto other;
+        if (!zero_octal)
+            p--;
+        for (val = n = 0; n < 3 && *p >= '0' && *p <= '7'; n++, p++)
+            val = val * 8 + *p - '0';
+        ch = val & 0xff;
+        break;
+    case '\0':
+        // a backslash at the very end
+        p--;
+        ch = '\\';
+        break;
+    default:
+    other:
+        str_putc(out, '\\');
+        break;
+    }
+    str_putc(out, ch);
+    *s = p;
+    return 1;
+}
+
+static int builtin_true(struct shell *sh, int argc, char **argv)
+{
+    (void)sh;
+    (void)argc;
+    (void)argv;
+    return 0;
+}
+
+static int builtin_false(struct shell *sh, int argc, char **argv)
+{
+    (void)sh;
+    (void)argc;
+    (void)argv;
+    return 1;
+}
+
+static void put_clock(str_t *out, clock_t ticks, long hz, int ch)
+{
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%ldm%.3fs%c", (long)ticks / hz / 60,
+            (double)(ticks % (hz * 60)) / hz, ch);
+    str_put(out, buf, len);
+}
+
+// times: the user and system time of the shell, then of its children
+static int builtin_times(struct shell *sh, int argc, char **argv)
+{
+    struct tms t;
+    long hz = sysconf(_SC_CLK_TCK);
+    (void)argc;
+    (void)argv;
+    if (times(&t) == (clock_t)-1 || hz <= 0) {
+        perror("times");
+        return 1;
+    }
+    put_clock(sh->out, t.tms_utime, hz, ' ');
+    put_clock(sh->out, t.tms_stime, hz, '\n');
+    put_clock(sh->out, t.tms_cutime, hz, ' ');
+    put_clock(sh->out, t.tms_cstime, hz, '\n');
+    return 0;
+}
+
+// echo [-neE] [arg...], as bash and coreutils have it: escapes are only
+// interpreted with -e
+static int builtin_echo(struct shell *sh, int argc, char **argv)
+{
+    int i, newline = 1, escapes = 0;
+    const char *p;
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (argv[i][strspn(argv[i] + 1, "neE") + 1])
+            break;
+        for (p = argv[i] + 1; *p; p++) {
+            if (*p == 'n')
+                newline = 0;
+            else
+                escapes = *p == 'e';
+        }
+    }
+    for (; i < argc; i++) {
+        for (p = argv[i]; escapes && *p; p++) {
+            if (*p != '\\')
+                str_putc(sh->out, *p);
+            else if (p++, !put_escape(sh->out, &p, 1))
+                return 0;
+            else
+                p--;
+        }
+        if (!escapes)
+            str_put(sh->out, argv[i], strlen(argv[i]));
+        if (i + 1 < argc)
+            str_putc(sh->out, ' ');
+    }
+    if (newline)
+        str_putc(sh->out, '\n');
+    return 0;
+}
+
+static void put_formatted(str_t *out, const char *spec, ...)
+{
+    va_list args, copy;
+    int len;
+    va_start(args, spec);
+    va_copy(copy, args);
+    len = vsnprintf(NULL, 0, spec, copy);
+    va_end(copy);
+    if (len > 0) {
+        str_reserve(out, len + 1);
+        vsnprintf((char *)out->end, len + 1, spec, args);
+        out->end += len;
+    }
+    va_end(args);
+}
+
+// Appends len bytes of s the way spec, a %s conversion without the s, would
+// have them, but without stopping at a NUL
+static void put_padded(str_t *out, const char *spec, const void *s, size_t len)
+{
+    const char *p = spec + 1;
+    char *num_end;
+    long width, prec;
+    int left = 0;
+    for (; *p && strchr("-+ #0", *p); p++)
+        if (*p == '-')
+            left = 1;
+    width = strtol(p, &num_end, 10);
+    p = num_end;
+    if (width < 0) {
+        left = 1;
+        width = -width;
+    }
+    if (*p == '.' && (prec = strtol(p + 1, NULL, 10)) >= 0 &&
+            (size_t)prec < len)
+        len = prec;
+    for (; !left && width > 0 && (size_t)width > len; width--)
+        str_putc(out, ' ');
+    str_put(out, s, len);
+    for (; left && width > 0 && (size_t)width > len; width--)
+        str_putc(out, ' ');
+}
+
+// A numeric argument to printf: an integer constant in C syntax, or a quote
+// followed by the character whose value is wanted
+static uint64_t printf_number(const char *arg, int is_unsigned, int *status)
+{
+    uint64_t val;
+    char *end;
+    if (*arg == '\'' || *arg == '"')
+        return (unsigned char)arg[1];
+    if (!*arg)
+        return 0;
+    errno = 0;
+    val = is_unsigned ? strtoull(arg, &end, 0) : (uint64_t)strtoll(arg, &end, 0);
+    if (end == arg || *end || errno) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return val;
+}
+
+/*
+ * Formats one pass over fmt, taking arguments from *args until end. Returns
+ * 0 once \c or an error says to stop.
+ */
+static int printf_format(str_t *out, const char *fmt, char ***args,
+        char **end, int *status)
+{
+    char spec[64], *sp, conv;
+    const char *p, *arg;
+    str_t *tmp;
+    int stop;
+    for (p = fmt; *p; p++) {
+        if (*p == '\\') {
+            p++;
+            if (!put_escape(out, &p, 0))
+                return 0;
+            p--;
+            continue;
+        }
+        if (*p != '%') {
+            str_putc(out, *p);
+            continue;
+        }
+        if (*++p == '%') {
+            str_putc(out, '%');
+            continue;
+        }
+        // rebuild the conversion for snprintf, with * widths filled in
+        sp = spec;
+        *sp++ = '%';
+        while (*p && strchr("-+ #0", *p) && sp < spec + 8)
+            *sp++ = *p++;
+        if (*p == '*') {
+            p++;
+            sp += sprintf(sp, "%d", *args < end ?
+                    (int)printf_number(*(*args)++, 0, status) : 0);
+        }
+        while (isdigit((unsigned char)*p) && sp < spec + 16)
+            *sp++ = *p++;
+        if (*p == '.') {
+            *sp++ = *p++;
+            if (*p == '*') {
+                p++;
+                sp += sprintf(sp, "%d", *args < end ?
+                        (int)printf_number(*(*args)++, 0, status) : 0);
+            }
+            while (isdigit((unsigned char)*p) && sp < spec + 26)
+                *sp++ = *p++;
+        }
+        while (*p && strchr("hlLqjzt", *p))
+            p++;
+        conv = *p;
+        arg = *args < end ? *(*args)++ : NULL;
+        switch (conv) {
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            strcpy(sp, "ll");
+            sp[2] = conv;
+            sp[3] = '\0';
+            put_formatted(out, spec, (long long)(arg ?
+                        printf_number(arg, conv != 'd' && conv != 'i', status) : 0));
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+        case 'a': case 'A':
+            sp[0] = conv;
+            sp[1] = '\0';
+            put_formatted(out, spec, arg ? strtod(arg, NULL) : 0.0);
+            break;
+        case 'c':
+            if (arg && *arg) {
+                strcpy(sp, "c");
+                put_formatted(out, spec, *arg);
+            }
+            break;
+        case 's':
+            strcpy(sp, "s");
+            put_formatted(out, spec, arg ? arg : "");
+            break;
+        case 'b':
+            tmp = new_str();
+            stop = 0;
+            for (; arg && *arg && !stop; arg++) {
+                if (*arg != '\\')
+                    str_putc(tmp, *arg);
+                else if (arg++, !put_escape(tmp, &arg, 1))
+                    stop = 1;
+                else
+                    arg--;
+            }
+            *sp = '\0';
+            put_padded(out, spec, tmp->start, str_len(tmp));
+            free_str(tmp);
+            if (stop)
+                return 0;
+            break;
+        default:
+            fprintf(stderr, "printf: %%%c: invalid conversion\n", conv);
+            *status = 1;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// printf format [arg...]. The format is used again for as long as it takes
+// arguments and there are some left.
+static int builtin_printf(struct shell *sh, int argc, char **argv)
+{
+    char **args = argv + 2, **end = argv + argc, **before;
+    int status = 0;
+    if (argc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arg...]\n");
+        return 2;
+    }
+    do {
+        before = args;
+        if (!printf_format(sh->out, argv[1], &args, end, &status))
+            break;
+    } while (args < end && args != before);
+    return status;
+}
+
+// hash [-r] [utility...]: -r forgets everything; utilities are looked up
+// and remembered; with neither, what is remembered is listed
+static int builtin_hash(struct shell *sh, int argc, char **argv)
+{
+    struct path_cache *pc = &sh->path;
+    struct hashed_cmd *hc;
+    int i = 1, status = 0, listed = 0, len;
+    char hits[16];
+    size_t j;
+    if (i < argc && !strcmp(argv[i], "-r")) {
+        clear_path_cache(pc);
+        i++;
+    }
+    if (argc == 1) {
+        for (j = 0; pc->gen == sh->path_gen && pc->cmds && j <= pc->mask; j++) {
+            hc = &pc->cmds[j];
+            if (!hc->path)
+                continue;
+            if (!listed++)
+                str_put(sh->out, "hits\tcommand\n", 13);
+            len = snprintf(hits, sizeof(hits), "%4u\t", hc->hits);
+            str_put(sh->out, hits, len);
+            str_put(sh->out, hc->path, strlen(hc->path));
+            str_putc(sh->out, '\n');
+        }
+        if (!listed)
+            str_put(sh->out, "hash: hash table empty\n", 23);
+        return 0;
+    }
+    for (; i < argc; i++) {
+        if (strchr(argv[i], '/'))
+            continue;
+        if (!hash_command(sh, argv[i])) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Reads a count for break, continue, exit, return or shift into *n
+static int builtin_number(const char *name, const char *arg, long *n)
+{
+    char *end;
+    errno = 0;
+    *n = strtol(arg, &end, 10);
+    if (errno || !*arg || *end || *n < 0) {
+        fprintf(stderr, "%s: %s: numeric argument required\n", name, arg);
+        return -1;
+    }
+    return 0;
+}
+
+static int loop_jump(struct shell *sh, int argc, char **argv,
+        enum eval_exit jump)
+{
+    long n = 1;
+    if (argc > 1 && (builtin_number(argv[0], argv[1], &n) < 0 || !n))
+        return 1;
+    if (!sh->loop_depth)
+        return 0;
+    sh->break_depth = n < sh->loop_depth ? n : sh->loop_depth;
+    sh->jump = jump;
+    return 0;
+}
+
+static int builtin_break(struct shell *sh, int argc, char **argv)
+{
+    return loop_jump(sh, argc, argv, EXIT_LOOP_BREAK);
+}
+
+static int builtin_continue(struct shell *sh, int argc, char **argv)
+{
+    return loop_jump(sh, argc, argv, EXIT_LOOP_CONTINUE);
+}
+
+static int builtin_return(struct shell *sh, int argc, char **argv)
+{
+    long n = sh->exit_status;
+    if (!sh->in_func) {
+        fprintf(stderr, "return: not in a function\n");
+        return 1;
+    }
+    if (argc > 1 && builtin_number(argv[0], argv[1], &n) < 0)
+        return 2;
+    sh->jump = EXIT_RETURN;
+    return n & 0xff;
+}
+
+static int builtin_exit(struct shell *sh, int argc, char **argv)
+{
+    long n = sh->exit_status;
+    if (argc > 1 && builtin_number(argv[0], argv[1], &n) < 0)
+        n = 2;
+    sh->jump = EXIT_SHELL;
+    return n & 0xff;
+}
+
+static int builtin_shift(struct shell *sh, int argc, char **argv)
+{
+    struct args_frame *args = sh->args;
+    long n = 1;
+    if (argc > 1 && builtin_number(argv[0], argv[1], &n) < 0)
+        return 1;
+    if (!args || n > args->argc - args->shift - 1) {
+        fprintf(stderr, "shift: can't shift that many\n");
+        return 1;
+    }
+    args->shift += n;
+    return 0;
+}
+
+static void setvar_cstr(struct shell *sh, const char *name, const char *val)
+{
+    str_t view = {(void *)val, (void *)(val + strlen(val)), NULL, NULL, {0}};
+    setvar(sh, intern(name, strlen(name)), &view, -1);
+}
+
+// cd [-L|-P] [dir|-]: PWD is always the physical path
+static int builtin_cd(struct shell *sh, int argc, char **argv)
+{
+    const str_t *val;
+    const char *dir;
+    char *cwd;
+    int i = 1, back = 0;
+    while (i < argc && (!strcmp(argv[i], "-L") || !strcmp(argv[i], "-P")))
+        i++;
+    if (i < argc && !strcmp(argv[i], "--"))
+        i++;
+    if (i < argc) {
+        dir = argv[i];
+        if (!strcmp(dir, "-")) {
+            back = 1;
+            if (str_empty(val = getvar(sh, intern("OLDPWD", 6)))) {
+                fprintf(stderr, "cd: OLDPWD not set\n");
+                return 1;
+            }
+            dir = (const char *)val->start;
+        }
+    } else if (str_empty(val = getvar(sh, intern("HOME", 4)))) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    } else {
+        dir = (const char *)val->start;
+    }
+    if (chdir(dir) < 0) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if ((val = getvar(sh, intern("PWD", 3))))
+        setvar(sh, intern("OLDPWD", 6), val, -1);
+    if ((cwd = getcwd(NULL, 0))) {
+        setvar_cstr(sh, "PWD", cwd);
+        if (back) {
+            str_put(sh->out, cwd, strlen(cwd));
+            str_putc(sh->out, '\n');
+        }
+        free(cwd);
+    }
+    // relative PATH entries now point somewhere else
+    if (sh->path.relative)
+        sh->path_gen++;
+    return 0;
+}
+
+// Quotes s so that the shell would read it back as it is
+static void put_quoted(str_t *out, const unsigned char *s, size_t len)
+{
+    const unsigned char *end = s + len;
+    str_putc(out, '\'');
+    for (; s < end; s++) {
+        if (*s == '\'')
+            str_put(out, "'\\''", 4);
+        else
+            str_putc(out, *s);
+    }
+    str_putc(out, '\'');
+}
+
+// export [-p] [name[=value]...]
+static int builtin_export(struct shell *sh, int argc, char **argv)
+{
+    const struct shell_var *var, *end;
+    const char *eq;
+    str_t name, val;
+    int i = 1, status = 0;
+    if (i < argc && !strcmp(argv[i], "-p"))
+        i++;
+    if (i == argc) {
+        import_env(sh);
+        end = sh->vars.vars + sh->vars.count;
+        for (var = sh->vars.vars; var < end; var++) {
+            if (!var->exported)
+                continue;
+            str_put(sh->out, "export ", 7);
+            str_put(sh->out, var->name->name->start, str_len(var->name->name));
+            if (var->val) {
+                str_putc(sh->out, '=');
+                put_quoted(sh->out, var->val->start, str_len(var->val));
+            }
+            str_putc(sh->out, '\n');
+        }
+        return 0;
+    }
+    for (; i < argc; i++) {
+        if (!(eq = strchr(argv[i], '=')))
+            eq = argv[i] + strlen(argv[i]);
+        name = (str_t){(void *)argv[i], (void *)eq, NULL, NULL, {0}};
+        if (!is_name(&name)) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", argv[i]);
+            status = 1;
+        } else if (*eq) {
+            val = (str_t){(void *)(eq + 1), (void *)(eq + 1 + strlen(eq + 1)),
+                NULL, NULL, {0}};
+            if (setvar(sh, intern_str(&name), &val, 1) < 0)
+                status = 1;
         } else {
-            printf("%s ", r->name->tok->start);
+            export_var(sh, intern_str(&name));
+        }
+    }
+    return status;
+}
+
+// readonly [-p] [name[=value]...]
+static int builtin_readonly(struct shell *sh, int argc, char **argv)
+{
+    const struct shell_var *end;
+    struct shell_var *var;
+    const char *eq;
+    str_t name, val;
+    int i = 1, status = 0;
+    if (i < argc && !strcmp(argv[i], "-p"))
+        i++;
+    if (i == argc) {
+        end = sh->vars.vars + sh->vars.count;
+        for (var = sh->vars.vars; var < end; var++) {
+            if (!var->read_only)
+                continue;
+            str_put(sh->out, "readonly ", 9);
+            str_put(sh->out, var->name->name->start, str_len(var->name->name));
+            if (var->val) {
+                str_putc(sh->out, '=');
+                put_quoted(sh->out, var->val->start, str_len(var->val));
+            }
+            str_putc(sh->out, '\n');
+        }
+        return 0;
+    }
+    for (; i < argc; i++) {
+        if (!(eq = strchr(argv[i], '=')))
+            eq = argv[i] + strlen(argv[i]);
+        name = (str_t){(void *)argv[i], (void *)eq, NULL, NULL, {0}};
+        if (!is_name(&name)) {
+            fprintf(stderr, "readonly: %s: not a valid identifier\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        if (*eq) {
+            val = (str_t){(void *)(eq + 1), (void *)(eq + 1 + strlen(eq + 1)),
+                NULL, NULL, {0}};
+            if (setvar(sh, intern_str(&name), &val, -1) < 0) {
+                status = 1;
+                continue;
+            }
+        }
+        if (!(var = lookup_var(sh, intern_str(&name))))
+            var = add_var(sh, intern_str(&name));
+        var->read_only = 1;
+    }
+    return status;
+}
+
+// unset [-f|-v] name...
+static int builtin_unset(struct shell *sh, int argc, char **argv)
+{
+    struct shell_func **link, *func;
+    const struct symbol *name;
+    int i = 1, funcs = 0, status = 0;
+    if (i < argc && (!strcmp(argv[i], "-f") || !strcmp(argv[i], "-v")))
+        funcs = argv[i++][1] == 'f';
+    for (; i < argc; i++) {
+        // nothing to do for a name never seen, unless it is still only in
+        // environ
+        if (!(name = find_symbol(argv[i], strlen(argv[i])))) {
+            if (funcs || sh->env_imported || !getenv(argv[i]))
+                continue;
+            name = intern(argv[i], strlen(argv[i]));
+        }
+        if (!funcs) {
+            if (unsetvar(sh, name) < 0)
+                status = 1;
+        } else if ((link = find_func(sh, name))) {
+            func = *link;
+            *link = func->next;
+            free_func(func);
         }
     }
+    return status;
+}
+
+/*
+ * test and [
+ *
+ * Up to four arguments are told apart by how many there are, the way POSIX
+ * lays it out, so that something like test ! = x compares; more than that
+ * are parsed as an expression with ! ( ) -a and -o, -a binding tighter.
+ */
+struct test {
+    char **arg, **end;
+    int err;
+};
+
+// Returns -1 if op is not a unary operator
+static int test_unary(const char *op, const char *arg)
+{
+    struct stat sb;
+    if (op[0] != '-' || !op[1] || op[2])
+        return -1;
+    switch (op[1]) {
+    case 'n': return *arg != '\0';
+    case 'z': return *arg == '\0';
+    case 't': return isatty(atoi(arg));
+    case 'r': return !faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS);
+    case 'w': return !faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS);
+    case 'x': return !faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS);
+    case 'h': case 'L': return !lstat(arg, &sb) && S_ISLNK(sb.st_mode);
+    case 'b': case 'c': case 'd': case 'e': case 'f': case 'g': case 'p':
+    case 's': case 'u': case 'S':
+        break;
+    default:
+        return -1;
+    }
+    if (stat(arg, &sb) < 0)
+        return 0;
+    switch (op[1]) {
+    case 'b': return S_ISBLK(sb.st_mode);
+    case 'c': return S_ISCHR(sb.st_mode);
+    case 'd': return S_ISDIR(sb.st_mode);
+    case 'f': return S_ISREG(sb.st_mode);
+    case 'g': return !!(sb.st_mode & S_ISGID);
+    case 'p': return S_ISFIFO(sb.st_mode);
+    case 's': return sb.st_size > 0;
+    case 'u': return !!(sb.st_mode & S_ISUID);
+    case 'S': return S_ISSOCK(sb.st_mode);
+    default: return 1;
+    }
 }
 
-void debug_show_node(node_t *node)
+static int test_integer(const char *s, long long *n, struct test *t)
 {
-    struct var *v;
-    struct arg *a;
-    struct item *i;
+    char *end;
+    errno = 0;
+    *n = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t')
+        end++;
+    if (errno || end == s || *end) {
+        fprintf(stderr, "test: %s: integer expected\n", s);
+        t->err = 1;
+        return -1;
+    }
+    return 0;
+}
 
-    if (!node) {
-        printf("(null)\n");
-        return;
+// Returns -1 if op is not a binary operator
+static int test_binary(const char *a, const char *op, const char *b,
+        struct test *t)
+{
+    struct stat sa, sb;
+    long long x, y;
+    int cmp;
+    if (!strcmp(op, "="))
+        return !strcmp(a, b);
+    if (!strcmp(op, "!="))
+        return !!strcmp(a, b);
+    if (!strcmp(op, "<"))
+        return strcmp(a, b) < 0;
+    if (!strcmp(op, ">"))
+        return strcmp(a, b) > 0;
+    if (op[0] != '-' || !op[1] || !op[2] || op[3])
+        return -1;
+    if (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef")) {
+        if (stat(a, &sa) < 0 || stat(b, &sb) < 0)
+            return 0;
+        if (op[1] == 'e')
+            return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        cmp = sa.st_mtim.tv_sec != sb.st_mtim.tv_sec ?
+            (sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ? 1 : -1) :
+            (sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec) -
+            (sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec);
+        return op[1] == 'n' ? cmp > 0 : cmp < 0;
+    }
+    if (strcmp(op, "-eq") && strcmp(op, "-ne") && strcmp(op, "-lt") &&
+            strcmp(op, "-le") && strcmp(op, "-gt") && strcmp(op, "-ge"))
+        return -1;
+    if (test_integer(a, &x, t) < 0 || test_integer(b, &y, t) < 0)
+        return 0;
+    switch (op[1]) {
+    case 'e': return x == y;
+    case 'n': return x != y;
+    case 'l': return op[2] == 't' ? x < y : x <= y;
+    default: return op[2] == 't' ? x > y : x >= y;
     }
+}
 
-    switch (node->type) {
-    case CMD_SIMPLE: case CMD_ASSIGNMENT:
-        for (v = node->simp.vars; v; v = v->next)
-            printf("%s='%s' ", v->name->start, v->val->tok->start);
-        for (a = node->simp.args; a; a = a->next)
-            printf("%s ", a->val->tok->start);
-        show_redirs(node->simp.redirs);
-        break;
-    case CMD_SUBSHELL:
-        printf("( ");
-        debug_show_node(node->sub.commands);
-        printf(node->sub.background ? ")&" : ")");
-        break;
-    case CMD_COMPOUND:
-        printf("{ ");
-        for (; node; node = (void *)node->comp.next) {
-            debug_show_node(node->comp.command);
-            printf(";");
+static int test_or(struct test *t);
+
+static int test_primary(struct test *t)
+{
+    char **a = t->arg;
+    long n = t->end - a;
+    int r;
+    if (n <= 0) {
+        t->err = 1;
+        return 0;
+    }
+    if (!strcmp(a[0], "!")) {
+        t->arg++;
+        return !test_primary(t);
+    }
+    if (n >= 3 && (r = test_binary(a[0], a[1], a[2], t)) >= 0) {
+        t->arg += 3;
+        return r;
+    }
+    if (!strcmp(a[0], "(")) {
+        t->arg++;
+        r = test_or(t);
+        if (t->arg == t->end || strcmp(*t->arg, ")"))
+            t->err = 1;
+        else
+            t->arg++;
+        return r;
+    }
+    if (n >= 2 && (r = test_unary(a[0], a[1])) >= 0) {
+        t->arg += 2;
+        return r;
+    }
+    t->arg++;
+    return *a[0] != '\0';
+}
+
+static int test_and(struct test *t)
+{
+    int r = test_primary(t);
+    while (t->arg < t->end && !strcmp(*t->arg, "-a")) {
+        t->arg++;
+        r = test_primary(t) && r;
+    }
+    return r;
+}
+
+static int test_or(struct test *t)
+{
+    int r = test_and(t);
+    while (t->arg < t->end && !strcmp(*t->arg, "-o")) {
+        t->arg++;
+        r = test_and(t) || r;
+    }
+    return r;
+}
+
+static int test_count(struct test *t)
+{
+    char **a = t->arg;
+    long n = t->end - a;
+    int r;
+    switch (n) {
+    case 0:
+        return 0;
+    case 1:
+        t->arg++;
+        return *a[0] != '\0';
+    case 2:
+        if (!strcmp(a[0], "!")) {
+            t->arg += 2;
+            return *a[1] == '\0';
         }
-        printf(" }");
         break;
-    case CMD_PIPELINE:
-        for (; node; node = (void *)node->pipe.next) {
-            debug_show_node(node->pipe.command);
-            printf("|");
+    case 3:
+        if ((r = test_binary(a[0], a[1], a[2], t)) >= 0) {
+            t->arg += 3;
+            return r;
         }
-        break;
-    case CMD_LOOP:
-        printf(node->loop.until ? "until " : "while ");
-        debug_show_node(node->loop.cond);
-        printf("; do ");
-        debug_show_node(node->loop.commands);
-        printf("; done");
-        break;
-    case CMD_ANDOR:
-        for (; node; node = (void *)node->andor.next) {
-            if (node->andor.negated)
-                printf("! ");
-            debug_show_node(node->andor.command);
-            if (node->andor.next)
-                printf(node->andor.and ? " && " : " || ");
+        if (!strcmp(a[0], "!")) {
+            t->arg++;
+            return !test_count(t);
         }
-        break;
-    case CMD_COND:
-        while (1) {
-            printf("if ");
-            debug_show_node(node->cond.cond);
-            printf("; then ");
-            debug_show_node(node->cond.commands);
-            if (!node->cond.otherwise)
-                break;
-            if (node->cond.otherwise->type != CMD_COND) {
-                printf("; else ");
-                debug_show_node(node->cond.otherwise);
-                break;
-            }
-            node = node->cond.otherwise;
-            printf("; el");
+        if (!strcmp(a[0], "(") && !strcmp(a[2], ")")) {
+            t->arg += 3;
+            return *a[1] != '\0';
         }
-        printf("; endif");
-        break;
-    case CMD_REDIRS:
-        debug_show_node(node->redirs.command);
-        show_redirs(node->redirs.redirs);
-        break;
-    case CMD_FUNCTION:
-        printf("%s ( ) { ", node->func.name->start);
-        debug_show_node(node->func.command);
-        printf("; }");
         break;
-    case CMD_FOR_LOOP:
-        printf("for %s ", node->for_loop.name->start);
-        if (!node->for_loop.use_args) {
-            printf("in ");
-            for (i = node->for_loop.items; i; i = i->next)
-                printf("%s ", i->val->tok->start);
+    case 4:
+        if (!strcmp(a[0], "!")) {
+            t->arg++;
+            return !test_count(t);
+        }
+        if (!strcmp(a[0], "(") && !strcmp(a[3], ")")) {
+            t->arg++;
+            t->end--;
+            r = test_count(t);
+            t->end++;
+            t->arg++;
+            return r;
         }
-        printf("; do ");
-        debug_show_node(node->for_loop.command);
-        printf("; done");
-        break;
-    case CMD_CASES:
-        //TODO
         break;
     }
+    return test_or(t);
 }
 
-char **make_env(struct shell *sh, struct cmd *cmd)
+static int builtin_test(struct shell *sh, int argc, char **argv)
 {
-    struct shell_var *svar;
-    struct var *var;
-    struct {str_t *name; str_t *val;} *real_vars;
-    size_t count = 0, size = 0, i = 0, len;
-    char **vars, **vend, *end;
-    for (svar = sh->vars; svar; svar = svar->next)
-        count++;
-    for (var = cmd->vars; var; var = var->next)
-        count++;
-    if (count == SIZE_MAX)
-        abort();
-    real_vars = calloc(count, sizeof(*real_vars));
-    if (!real_vars)
-        abort();
-    count = 0;
-    for (svar = sh->vars; svar; svar = svar->next) {
-        if (!svar->exported)
-            continue;
-        for (i = 0; i < count; i++) {
-            if (str_eq(real_vars[i].name, svar->name)) {
-                real_vars[i].val = svar->val;
-                break;
-            }
-        }
-        if (i == count) {
-            real_vars[i].name = svar->name;
-            real_vars[i].val = svar->val;
-            count++;
+    struct test t = {argv + 1, argv + argc, 0};
+    int r;
+    (void)sh;
+    if (argv[0][0] == '[') {
+        if (argc < 2 || strcmp(argv[argc - 1], "]")) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
         }
+        t.end--;
     }
-    for (var = cmd->vars; var; var = var->next) {
-        for (i = 0; i < count; i++) {
-            if (str_eq(real_vars[i].name, var->name)) {
-                real_vars[i].val = var->val->tok;
-                break;
+    r = test_count(&t);
+    if (t.err || t.arg != t.end) {
+        if (!t.err)
+            fprintf(stderr, "%s: %s: unexpected argument\n", argv[0], *t.arg);
+        return 2;
+    }
+    return !r;
+}
+
+/*
+ * read [-r] [name...]: a line split into fields by IFS, the last name taking
+ * whatever is left. Without -r a backslash quotes the character after it and
+ * one before the newline continues the line. A pipe has to be read a byte at
+ * a time so the next reader starts right after the line; anything seekable
+ * is read in blocks and the fd put back after the newline.
+ */
+#define READ_BLOCK_SIZE 4096
+
+// Reads a line into line, with the bytes that were escaped marked in quoted.
+// Returns 1 if it ended in a newline, 0 at end of file.
+static int read_line(str_t *line, str_t *quoted, int raw)
+{
+    char buf[READ_BLOCK_SIZE];
+    int escaped = 0, seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0, q;
+    ssize_t n, i;
+    while (1) {
+        n = read(STDIN_FILENO, buf, seekable ? sizeof(buf) : 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        for (i = 0; i < n; i++) {
+            if (!buf[i])
+                continue;
+            q = 0;
+            if (escaped) {
+                escaped = 0;
+                q = 1;
+                if (buf[i] == '\n')
+                    continue;
+            } else if (buf[i] == '\\' && !raw) {
+                escaped = 1;
+                continue;
+            } else if (buf[i] == '\n') {
+                if (i + 1 < n)
+                    lseek(STDIN_FILENO, i + 1 - n, SEEK_CUR);
+                return 1;
             }
+            str_putc(line, buf[i]);
+            str_putc(quoted, q);
         }
-        if (i == count) {
-            real_vars[i].name = var->name;
-            real_vars[i].val = var->val->tok;
-            count++;
-        }
-    }
-    size = sizeof(char *);
-    for (i = 0; i < count; i++) {
-        len = str_len(real_vars[i].name);
-        if (size > SIZE_MAX - len)
-            abort();
-        size += len;
-        len = str_len(real_vars[i].val);
-        if (size > SIZE_MAX - len)
-            abort();
-        size += len;
-        if (size > SIZE_MAX - 2)
-            abort();
-        size += 2;
-        if (size > SIZE_MAX - sizeof(char *))
-            abort();
-        size += sizeof(char *);
-    }
-    vars = malloc(size);
-    if (!vars)
-        abort();
-    vend = vars;
-    end = (char *)(vars + count + 1);
-    for (i = 0; i < count; i++) {
-        *vend++ = end;
-        len = str_len(real_vars[i].name);
-        memcpy(end, real_vars[i].name->start, len);
-        end += len;
-        *end++ = '=';
-        len = str_len(real_vars[i].val);
-        memcpy(end, real_vars[i].val->start, len);
-        end += len;
-        *end++ = 0;
     }
-    *vend++ = 0;
-    free(real_vars);
-    return vars;
 }
 
-struct split {
-    struct split *next;
-    char *str;
-};
-
-void put_split(struct split ***splits, char *str)
+static int builtin_read(struct shell *sh, int argc, char **argv)
 {
-    struct split *split = malloc(sizeof(*split));
-    if (!split)
-        abort();
-    split->str = str;
-    split->next = NULL;
-    **splits = split;
-    *splits = &split->next;
+    const struct ifs_map *ifs;
+    const unsigned char *s, *q;
+    str_t *line, *quoted, val;
+    size_t p = 0, end, field;
+    int i = 1, raw = 0, status;
+    if (i < argc && !strcmp(argv[i], "-r")) {
+        raw = 1;
+        i++;
+    }
+    // the script might come in on the same fd
+    input_sync(&sh->lex.in);
+    line = new_str();
+    quoted = new_str();
+    status = !read_line(line, quoted, raw);
+    if (i == argc) {
+        if (setvar(sh, intern("REPLY", 5), line, -1) < 0)
+            status = 2;
+        goto done;
+    }
+    ifs = get_ifs(sh);
+    s = line->start;
+    q = quoted->start;
+    end = str_len(line);
+#define READ_WHITE(i) (!q[i] && IFS_TEST(ifs->white, s[i]))
+#define READ_SEP(i) (!q[i] && IFS_TEST(ifs->sep, s[i]))
+    while (p < end && READ_WHITE(p))
+        p++;
+    for (; i < argc; i++) {
+        field = p;
+        if (i == argc - 1) {
+            // the last name takes the rest, less trailing IFS white space
+            while (end > p && READ_WHITE(end - 1))
+                end--;
+            p = end;
+        } else {
+            while (p < end && !READ_SEP(p))
+                p++;
+        }
+        val = (str_t){(void *)(s + field), (void *)(s + p), NULL, NULL, {0}};
+        if (setvar(sh, intern(argv[i], strlen(argv[i])), &val, -1) < 0)
+            status = 2;
+        // one separator, with any IFS white space around it
+        while (p < end && READ_WHITE(p))
+            p++;
+        if (p < end && READ_SEP(p))
+            p++;
+        while (p < end && READ_WHITE(p))
+            p++;
+    }
+#undef READ_WHITE
+#undef READ_SEP
+done:
+    free_str(line);
+    free_str(quoted);
+    return status;
 }
 
-char **join_splits(struct split *slist)
+// Parses and runs the commands from lex one at a time, as the shell does a
+// script, until they run out or one of them jumps out
+static enum eval_exit run_lexer(struct shell *sh, struct lexer *lex)
 {
-    char **splits, **vend, *end;
-    struct split *s, *sn;
-    size_t count = 1, size = sizeof(char *), len;
-
-    for (s = slist; s; s = s->next) {
-        len = strlen(s->str) + 1;
-        if (len > SIZE_MAX - size)
-            abort();
-        size += len;
-        len = sizeof(char *);
-        if (len > SIZE_MAX - size)
-            abort();
-        size += len;
-        count++;
+    enum eval_exit ret = EXIT_NEXT;
+    struct flat *f;
+    node_t *root;
+    sh->exit_status = 0;
+    while (ret == EXIT_NEXT && !lex->errored && (root = parse(lex))) {
+        f = flatten(&lex->arena, root);
+        if (sh->tree_eval)
+            ret = do_eval(sh, f, 0);
+        else
+            ret = vm_run(sh, compile(&lex->arena, f, 0));
+        lex_release(lex);
     }
+    if (lex->errored)
+        sh->exit_status = 2;
+    return ret;
+}
 
-    splits = malloc(size);
-    if (!splits)
-        abort();
-    vend = splits;
-    end = (void*)(vend + count);
-
-    for (s = slist; s; s = sn) {
-        len = strlen(s->str);
-        strcpy(end, s->str);
-        *vend++ = end;
-        end += len + 1;
-        sn = s->next;
-        free(s->str);
-        free(s);
+// eval [arg...]: runs the arguments, joined by spaces, as commands
+static int builtin_eval(struct shell *sh, int argc, char **argv)
+{
+    struct lexer lex;
+    str_t *text = new_str();
+    enum eval_exit ret;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (i > 1)
+            str_putc(text, ' ');
+        str_put(text, argv[i], strlen(argv[i]));
     }
-
-    *vend++ = 0;
-
-    return splits;
+    init_lex(&lex, text, -1);
+    ret = run_lexer(sh, &lex);
+    destroy_lex(&lex);
+    if (ret != EXIT_NEXT)
+        sh->jump = ret;
+    return sh->exit_status;
 }
 
-size_t split_ifs(struct split ***sptr, str_t *buf, const char *ifs, size_t start)
+// A file for . is looked for on PATH if its name has no slash, and needs to
+// be readable but not executable
+static char *find_dot_file(struct shell *sh, const char *name)
 {
-    char *str;
-    size_t len = str_len(buf);
-    if (!ifs)
-        return len;
-    while (start < len) {
-        if (strchr(ifs, buf->start[start])) {
-            str = malloc(start + 1);
-            if (!str)
+    const str_t *path = getvar(sh, path_name);
+    const unsigned char *p, *end, *colon;
+    struct stat sb;
+    char *file;
+    if (strchr(name, '/'))
+        return strdup(name);
+    if (!path)
+        return NULL;
+    for (p = path->start, end = path->end; p <= end; p = colon + 1) {
+        if (!(colon = memchr(p, ':', end - p)))
+            colon = end;
+        if (colon == p) {
+            if (asprintf(&file, "%s", name) < 0)
                 abort();
-            memcpy(str, buf->start, start);
-            str[start] = 0;
-            buf->start += start + 1;
-            len -= start + 1;
-            start = 0;
-            put_split(sptr, str);
-        } else {
-            start++;
+        } else if (asprintf(&file, "%.*s/%s", (int)(colon - p), p, name) < 0) {
+            abort();
         }
+        if (!access(file, R_OK) && !stat(file, &sb) && S_ISREG(sb.st_mode))
+            return file;
+        free(file);
     }
-    return start;
+    return NULL;
 }
 
-void expand_into(str_t *buf, struct shell *sh, word_t *word)
+// . file: runs the commands in file in this shell. return leaves the file.
+static int builtin_dot(struct shell *sh, int argc, char **argv)
 {
-    const str_t *tmp;
-    switch (word->type) {
-    case WORD_PARAMETER:
-        tmp = getvar(sh, word->tok);
-        if (tmp)
-            str_put(buf, tmp->start, str_len(tmp));
-        break;
-    case WORD_STRING:
-        str_put(buf, word->tok->start, str_len(word->tok));
-        break;
-    default:
-        abort();
+    struct lexer lex;
+    enum eval_exit ret;
+    char *file;
+    if (argc < 2) {
+        fprintf(stderr, ".: filename argument required\n");
+        return 2;
+    }
+    if (!(file = find_dot_file(sh, argv[1]))) {
+        fprintf(stderr, ".: %s: not found\n", argv[1]);
+        return 1;
+    }
+    if (init_lex_file(&lex, file) < 0) {
+        fprintf(stderr, ".: %s: %s\n", argv[1], strerror(errno));
+        free(file);
+        return 1;
     }
+    free(file);
+    lex.outer = sh->script;
+    sh->script = &lex;
+    sh->in_func++;
+    ret = run_lexer(sh, &lex);
+    sh->in_func--;
+    sh->script = lex.outer;
+    destroy_lex(&lex);
+    if (ret != EXIT_NEXT && ret != EXIT_RETURN)
+        sh->jump = ret;
+    return sh->exit_status;
 }
 
-void expand(struct split ***sptr, struct shell *sh, word_t *word)
+// exec [command [arg...]]: replaces the shell with command, or without one
+// leaves the redirections in effect
+static int builtin_exec(struct shell *sh, int argc, char **argv)
 {
-    char name_s[3] = "IFS";
-    str_t name = {(void *)name_s, (void *)(name_s + sizeof(name_s)), name_s, name_s + sizeof(name_s)};
-    const str_t *tmp = getvar(sh, &name);
-    char *ifs = tmp ? strdup((void *)tmp->start) : strdup(" \t");
-    char *rest;
-    str_t *buf = new_str();
-    size_t next_split = 0;
-    for (; word; word = word->next) {
-        expand_into(buf, sh, word);
-        if (word->quoted) {
-            next_split = str_len(buf);
-        } else {
-            next_split = split_ifs(sptr, buf, ifs, next_split);
+    int err;
+    if (argc < 2) {
+        sh->keep_redirs = 1;
+        return 0;
+    }
+    input_sync(&sh->lex.in);
+    exec_command(sh, argv + 1, export_env(sh));
+    err = errno;
+    fprintf(stderr, "exec: %s: %s\n", argv[1], strerror(err));
+    sh->jump = EXIT_SHELL;
+    return err == ENOENT ? 127 : 126;
+}
+
+// set [--] [arg...]: the arguments replace the positional parameters, and
+// without any the variables are listed. No options are supported.
+static int builtin_set(struct shell *sh, int argc, char **argv)
+{
+    struct args_frame *args = sh->args;
+    const struct shell_var *var, *end;
+    size_t len, size = 0;
+    char **new, *strs;
+    int i = 1, n;
+    if (argc == 1) {
+        import_env(sh);
+        end = sh->vars.vars + sh->vars.count;
+        for (var = sh->vars.vars; var < end; var++) {
+            if (!var->val)
+                continue;
+            str_put(sh->out, var->name->name->start, str_len(var->name->name));
+            str_putc(sh->out, '=');
+            put_quoted(sh->out, var->val->start, str_len(var->val));
+            str_putc(sh->out, '\n');
         }
+        return 0;
+    }
+    if (!strcmp(argv[1], "--")) {
+        i++;
+    } else if (argv[1][0] == '-' || argv[1][0] == '+') {
+        fprintf(stderr, "set: %s: unsupported option\n", argv[1]);
+        return 2;
     }
-    rest = strdup((void *)buf->start);
-    if (!rest)
+    // $0 stays; it and the new arguments go in one block
+    n = argc - i + 1;
+    size = strlen(args->argv[0]) + 1;
+    for (; i < argc; i++)
+        size += strlen(argv[i]) + 1;
+    new = malloc((n + 1) * sizeof(*new) + size);
+    if (!new)
         abort();
-    put_split(sptr, rest);
-    free(ifs);
-    free_str(buf);
+    strs = (char *)(new + n + 1);
+    for (i = 0; i < n; i++) {
+        new[i] = strs;
+        len = strlen(i ? argv[argc - n + i] : args->argv[0]) + 1;
+        memcpy(strs, i ? argv[argc - n + i] : args->argv[0], len);
+        strs += len;
+    }
+    new[n] = NULL;
+    free(args->owned);
+    args->owned = args->argv = new;
+    args->argc = n;
+    args->shift = 0;
+    return 0;
 }
 
-char **expand_join(struct shell *sh, word_t *word)
+// Runs one of the coreutils from applet.c. They read and write through stdio
+// rather than sh->out, so the EOF left on stdin by the last one is cleared
+// first and stdout is flushed before the redirections are undone. Like a
+// child, an applet may read the rest of a script that comes in on stdin.
+static int builtin_applet(struct shell *sh, int argc, char **argv)
 {
-    struct split *slist = NULL, **sptr = &slist;
-    expand(&sptr, sh, word);
-    return join_splits(slist);
+    const struct applet *applet = find_applet(argv[0]);
+    int status;
+    input_sync(&sh->lex.in);
+    clearerr(stdin);
+    clearerr(stdout);
+    status = applet->main(argc, argv);
+    if (fflush(stdout) == EOF && !status)
+        status = 1;
+    return status;
 }
 
-char **make_args(struct shell *sh, struct cmd *cmd)
+static const struct builtin applet_builtin = {"", builtin_applet, 0};
+
+// Sorted by name
+static const struct builtin builtins[] = {
+    {".", builtin_dot, BUILTIN_SPECIAL},
+    {":", builtin_true, BUILTIN_SPECIAL | BUILTIN_PURE},
+    {"[", builtin_test, BUILTIN_PURE},
+    {"break", builtin_break, BUILTIN_SPECIAL},
+    {"cd", builtin_cd, 0},
+    {"continue", builtin_continue, BUILTIN_SPECIAL},
+    {"echo", builtin_echo, BUILTIN_PURE},
+    {"eval", builtin_eval, BUILTIN_SPECIAL},
+    {"exec", builtin_exec, BUILTIN_SPECIAL},
+    {"exit", builtin_exit, BUILTIN_SPECIAL},
+    {"export", builtin_export, BUILTIN_SPECIAL},
+    {"false", builtin_false, BUILTIN_PURE},
+    {"hash", builtin_hash, 0},
+    {"printf", builtin_printf, BUILTIN_PURE},
+    {"read", builtin_read, 0},
+    {"readonly", builtin_readonly, BUILTIN_SPECIAL},
+    {"return", builtin_return, BUILTIN_SPECIAL},
+    {"set", builtin_set, BUILTIN_SPECIAL},
+    {"shift", builtin_shift, BUILTIN_SPECIAL},
+    {"test", builtin_test, BUILTIN_PURE},
+    {"times", builtin_times, BUILTIN_SPECIAL},
+    {"true", builtin_true, BUILTIN_PURE},
+    {"unset", builtin_unset, BUILTIN_SPECIAL},
+};
+
+static const struct builtin *find_builtin(const void *name, size_t len)
 {
-    struct split *slist = NULL, **sptr = &slist;
-    struct arg *arg;
-    for (arg = cmd->args; arg; arg = arg->next)
-        expand(&sptr, sh, arg->val);
-    return join_splits(slist);
+    size_t lo = 0, hi = sizeof(builtins) / sizeof(*builtins), mid;
+    int cmp;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        cmp = strncmp(builtins[mid].name, name, len);
+        if (!cmp && builtins[mid].name[len])
+            cmp = 1;
+        if (!cmp)
+            return &builtins[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
 }
 
-static void do_assign(struct shell *sh, struct cmd *cmd)
+static int run_builtin(struct shell *sh, const struct builtin *b, char **argv)
 {
-    word_t *w;
-    struct var *v;
-    str_t *buf = new_str();
-    for (v = cmd->vars; v; v = v->next) {
-        str_clear(buf);
-        for (w = v->val; w; w = w->next)
-            expand_into(buf, sh, w);
-        setvar(sh, v->name, buf, -1);
+    int argc = 0, status;
+    while (argv[argc])
+        argc++;
+    status = b->func(sh, argc, argv);
+    if (sh->out == sh->outbuf) {
+        if (write_all(STDOUT_FILENO, sh->out->start, str_len(sh->out)) < 0 &&
+                !status)
+            status = 1;
+        str_clear(sh->out);
     }
-    free_str(buf);
+    return status;
 }
 
-void enter_subshell(struct shell *sh)
+// A command name runs in the shell if it names a special builtin, a function,
+// a regular builtin or an applet, looked for in that order. An applet only
+// stands in for the coreutils binary it was built into, when that is what
+// PATH finds, so a system cat with options of its own still gets run.
+static int find_in_shell(struct shell *sh, const char *name,
+        const struct builtin **b, struct shell_func **func)
 {
-    sh->loop_depth = 0;
-    sh->in_func = 0;
+    const struct symbol *sym;
+    const struct hashed_cmd *hc;
+    struct shell_func **link;
+    size_t len = strlen(name);
+    *b = find_builtin(name, len);
+    *func = NULL;
+    if (*b && (*b)->flags & BUILTIN_SPECIAL)
+        return 1;
+    if (sh->funcs && (sym = find_symbol(name, len)) &&
+            (link = find_func(sh, sym))) {
+        *b = NULL;
+        *func = *link;
+    }
+    if (!*b && !*func && find_applet(name) && getvar(sh, path_name) &&
+            (hc = hash_command(sh, name)) && hc->applet)
+        *b = &applet_builtin;
+    return *b || *func;
 }
 
-struct savedfd {
-    struct savedfd *next;
-    int old_fd, new_fd;
+struct saved_var {
+    str_t *val;
+    int exported;
 };
 
-void revert_redirs(struct shell *sh, struct savedfd *save)
+// Assignments in front of a regular builtin or a function are exported to
+// it, and only last until pop_vars()
+static struct saved_var *push_vars(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd)
 {
-    struct savedfd *next;
-    (void) sh;
-    while (save) {
-        next = save->next;
-        if (save->old_fd >= 0)
-            dup2(save->new_fd, save->old_fd);
-        close(save->new_fd);
-        free(save);
-        save = next;
+    const struct flat_var *v = f->vars + cmd->vars.start;
+    struct saved_var *saved = malloc(cmd->vars.count * sizeof(*saved));
+    struct shell_var *var;
+    str_t *buf = new_str();
+    uint32_t i;
+    if (!saved)
+        abort();
+    for (i = 0; i < cmd->vars.count; i++, v++) {
+        expand_value(buf, sh, f, v);
+        if (!(var = lookup_var(sh, v->name)))
+            var = add_var(sh, v->name);
+        if (var_read_only(var))
+            exit(2);
+        saved[i].val = var->val;
+        saved[i].exported = var->exported;
+        var->val = NULL;
+        setvar(sh, v->name, buf, 1);
     }
+    free_str(buf);
+    return saved;
 }
 
-struct savedfd *apply_redirs(struct shell *sh, struct redirect *redirs)
-{
-    struct savedfd *save = NULL, **sptr = &save, *r;
-    struct redirect *next_redir;
-    char **names;
-    int err;
-    int fd, saved_fd;
-    long fd2;
-    for (next_redir = redirs; (redirs = next_redir); next_redir = redirs->next) {
-        if (!redirs->name)
-            continue;
-        names = expand_join(sh, redirs->name);
-        if (!names)
-            abort();
-        errno = 0;
-        err = 0;
-        fd2 = strtol(names[0], NULL, 10);
-        if (errno || fd2 < 0 || fd2 > INT_MAX)
-            err = 1;
-        switch (redirs->op) {
-        default:
-            errno = EINVAL;
-            fd = -1;
-            break;
-        case TOK_LESS:
-            fd = open(names[0], O_RDONLY);
-            break;
-        case TOK_LESSGREAT:
-            fd = open(names[0], O_RDWR | O_CREAT, 0777);
-            break;
-        case TOK_GREAT:
-        case TOK_CLOBBER:
-            fd = open(names[0], O_WRONLY | O_CREAT, 0777);
-            break;
-        case TOK_DGREAT:
-            fd = open(names[0], O_WRONLY | O_CREAT | O_APPEND, 0777);
-            break;
-        case TOK_LESSAND:
-        case TOK_GREATAND:
-            if (!err) {
-                fd = dup(fd2);
-            } else {
-                errno = EINVAL;
-                fd = -1;
-            }
-            if (strcmp(names[0], "-"))
-                fd = -2;
-            break;
-        }
-        free(names);
-        if (fd == -1) {
-            perror("failed to open file");
-            goto fail;
-        }
-
-        saved_fd = dup(redirs->fd);
-        if (saved_fd < 0) {
-            close(fd);
-            goto fail;
-        }
+static void pop_vars(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd, struct saved_var *saved)
+{
+    const struct flat_var *v = f->vars + cmd->vars.start;
+    struct shell_var *var;
+    uint32_t i;
+    if (!saved)
+        return;
+    // backwards, so a name assigned twice gets its first value back
+    for (i = cmd->vars.count; i-- > 0;) {
+        var = lookup_var(sh, v[i].name);
+        free_str(var->val);
+        var->val = saved[i].val;
+        var->exported = saved[i].exported;
+        sh->env_gen++;
+        var_changed(sh, v[i].name);
+    }
+    free(saved);
+}
 
-        close(redirs->fd);
-        if (fd >= 0) {
-            if (dup2(fd, redirs->fd) < 0) {
-                close(fd);
-                goto fail;
-            }
-        }
+// Runs func with args as the positional parameters, $0 aside
+static enum eval_exit call_func(struct shell *sh, struct shell_func *func,
+        char **args)
+{
+    struct args_frame frame = {sh->args, 0, 0, args, NULL};
+    int loop_depth = sh->loop_depth;
+    enum eval_exit ret;
+    while (args[frame.argc])
+        frame.argc++;
+    if (sh->args)
+        args[0] = sh->args->argv[0];
+    sh->args = &frame;
+    // break and continue do not reach loops outside the function
+    sh->loop_depth = 0;
+    sh->in_func++;
+    func->calls++;
+    if (sh->tree_eval)
+        ret = do_eval(sh, func->flat, 0);
+    else
+        ret = vm_run(sh, func->code);
+    if (!--func->calls && func->retired)
+        free_func(func);
+    sh->in_func--;
+    sh->loop_depth = loop_depth;
+    sh->args = frame.prev;
+    free(frame.owned);
+    return ret == EXIT_SHELL ? ret : EXIT_NEXT;
+}
 
-        r = malloc(sizeof(*r));
-        if (!r)
-            abort();
-        r->next = NULL;
-        r->old_fd = redirs->fd;
-        r->new_fd = saved_fd;
-        *sptr = r;
-        sptr = &r->next;
+// Runs cmd in the shell if it is a builtin or a function, around its
+// redirections and assignments, and returns 1 with what it left in *ret;
+// otherwise it is left to be forked
+static int try_builtin(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd, char **args, enum eval_exit *ret)
+{
+    const struct builtin *b;
+    struct shell_func *func;
+    struct savedfd *save = NULL;
+    struct saved_var *vars = NULL;
+    *ret = EXIT_NEXT;
+    if (cmd->background || !args[0] || !find_in_shell(sh, args[0], &b, &func))
+        return 0;
+    if (cmd->redirs.count && !(save = apply_redirs(sh, f, cmd->redirs))) {
+        sh->exit_status = 1;
+        free(args);
+        return 1;
+    }
+    if (cmd->vars.count && b && b->flags & BUILTIN_SPECIAL)
+        do_assign(sh, f, cmd);
+    else if (cmd->vars.count)
+        vars = push_vars(sh, f, cmd);
+    if (func) {
+        *ret = call_func(sh, func, args);
+    } else {
+        sh->exit_status = run_builtin(sh, b, args);
+        *ret = sh->jump;
+        sh->jump = EXIT_NEXT;
+    }
+    pop_vars(sh, f, cmd, vars);
+    if (sh->keep_redirs) {
+        keep_redirs(save);
+        save = NULL;
+        sh->keep_redirs = 0;
     }
-    return save;
-
-fail:
     revert_redirs(sh, save);
-    return NULL;
+    free(args);
+    return 1;
 }
 
-void exec_simple(struct shell *sh, struct cmd *cmd)
+// Execs args, which have already been expanded, in place of the shell
+void exec_args(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd, char **args)
 {
-    char *path = NULL, **args = NULL, **env = NULL;
-    apply_redirs(sh, cmd->redirs);
-    args = make_args(sh, cmd);
-    if (!args)
-        _exit(1);
-    path = find_on_path(sh, args[0]);
-    if (!path)
-        _exit(127);
-    env = make_env(sh, cmd);
+    const struct builtin *b;
+    struct shell_func *func;
+    struct redir_plan plan;
+    char **env = NULL;
+    if (cmd->redirs.count) {
+        if (plan_redirs(sh, f, cmd->redirs, &plan) < 0 || exec_plan(&plan) < 0)
+            _exit(1);
+    }
+    if (args[0] && find_in_shell(sh, args[0], &b, &func)) {
+        // nothing is put back in a child
+        if (cmd->vars.count)
+            free(push_vars(sh, f, cmd));
+        if (func)
+            call_func(sh, func, args);
+        else
+            sh->exit_status = run_builtin(sh, b, args);
+        _exit(sh->exit_status);
+    }
+    if (!args[0])
+        _exit(0);
+    env = make_env(sh, f, cmd);
     if (!env)
         _exit(1);
-    execve(path, args, env);
-    if (errno == ENOENT)
-        _exit(127);
+    exec_command(sh, args, env);
+    _exit(errno == ENOENT ? 127 : 126);
 }
 
-typedef int (*builtin_t)(struct shell *sh, int argc, char **argv);
-
-struct builtin {
-    const char *name;
-    builtin_t func;
-};
+void exec_simple(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd)
+{
+    char **args = make_args(sh, f, cmd);
+    if (!args)
+        _exit(1);
+    exec_args(sh, f, cmd, args);
+}
 
-enum eval_exit do_eval(struct shell *sh, node_t *node);
+enum eval_exit do_eval(struct shell *sh, const struct flat *f, uint32_t idx);
+static enum eval_exit run_node(struct shell *sh, const struct flat *f,
+        uint32_t idx);
+static enum eval_exit run_tail(struct shell *sh, const struct flat *f,
+        uint32_t idx);
 
 void wait_job(struct shell *sh, pid_t pgid, pid_t pid, int background)
 {
@@ -2630,15 +7570,95 @@ void wait_job(struct shell *sh, pid_t pgid, pid_t pid, int background)
     }
 }
 
-enum eval_exit eval_simple(struct shell *sh, struct cmd *cmd)
+static pid_t fork_shell(struct shell *sh)
+{
+    input_sync(&sh->lex.in);
+    export_env(sh);
+    return fork();
+}
+
+/*
+ * Starts cmd, a simple command with args expanded and nothing to do in the
+ * child but its redirections and the exec, with posix_spawn(). glibc spawns
+ * by clone(CLONE_VM | CLONE_VFORK), so unlike fork() it does not copy the
+ * page tables and costs the same however big the shell has grown. Returns
+ * the pid, or 0 if no process was left to wait for and the status is
+ * already set, or -1 if cmd has to be forked after all (PSHELL_SPAWN=fork).
+ */
+static pid_t spawn_args(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd, char **args)
+{
+    posix_spawn_file_actions_t actions, *use_actions = NULL;
+    posix_spawnattr_t attr;
+    struct redir_plan plan;
+    const char *path;
+    char **env;
+    pid_t pid;
+    int err;
+    if (sh->fork_only || !args[0])
+        return -1;
+    if (cmd->redirs.count) {
+        if (plan_redirs(sh, f, cmd->redirs, &plan) < 0) {
+            sh->exit_status = 1;
+            free(args);
+            return 0;
+        }
+        if (posix_spawn_file_actions_init(&actions))
+            abort();
+        add_file_actions(&actions, &plan);
+        use_actions = &actions;
+    }
+    if (!(path = hash_args(sh, args))) {
+        err = ENOENT;
+        goto done;
+    }
+    input_sync(&sh->lex.in);
+    env = make_env(sh, f, cmd);
+    if (posix_spawnattr_init(&attr))
+        abort();
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    // the exec's own error comes back here, with the child reaped
+    err = posix_spawn(&pid, path, use_actions, &attr, args, env);
+    posix_spawnattr_destroy(&attr);
+    free_env(sh, f, cmd, env);
+done:
+    if (use_actions) {
+        posix_spawn_file_actions_destroy(use_actions);
+        close_plan(&plan, 0);
+    }
+    free(args);
+    if (err) {
+        sh->exit_status = err == ENOENT ? 127 : 126;
+        return 0;
+    }
+    setpgid(pid, pid);
+    return pid;
+}
+
+enum eval_exit eval_simple(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd)
 {
-    pid_t pid = fork();
+    char **args = make_args(sh, f, cmd);
+    enum eval_exit ret;
+    pid_t pid;
+    if (try_builtin(sh, f, cmd, args, &ret))
+        return ret;
+    if ((pid = spawn_args(sh, f, cmd, args)) >= 0) {
+        if (pid)
+            wait_job(sh, pid, pid, cmd->background);
+        return EXIT_NEXT;
+    }
+    hash_args(sh, args);
+    pid = fork_shell(sh);
     if (pid == 0) {
         setpgid(0, 0);
         enter_subshell(sh);
-        exec_simple(sh, cmd);
+        exec_args(sh, f, cmd, args);
         _exit(1);
-    } else if (pid < 0) {
+    }
+    free(args);
+    if (pid < 0) {
         sh->exit_status = 1;
         return EXIT_NEXT;
     } else {
@@ -2648,13 +7668,14 @@ enum eval_exit eval_simple(struct shell *sh, struct cmd *cmd)
     }
 }
 
-enum eval_exit eval_subshell(struct shell *sh, struct subshell *sub)
+enum eval_exit eval_subshell(struct shell *sh, const struct flat *f,
+        const struct flat_subshell *sub)
 {
-    pid_t pid = fork();
+    pid_t pid = fork_shell(sh);
     if (pid == 0) {
         setpgid(0, 0);
         enter_subshell(sh);
-        do_eval(sh, sub->commands);
+        run_tail(sh, f, sub->commands);
         _exit(sh->exit_status);
     } else if (pid < 0) {
         sh->exit_status = 1;
@@ -2665,8 +7686,10 @@ enum eval_exit eval_subshell(struct shell *sh, struct subshell *sub)
     return EXIT_NEXT;
 }
 
-enum eval_exit eval_pipeline(struct shell *sh, struct pipeline *pipes)
+enum eval_exit eval_pipeline(struct shell *sh, const struct flat *f,
+        const struct flat_pipeline *pipes)
 {
+    const union flat_node *cmd;
     pid_t pgid = -1, pid = -1;
     int fd[2], input = STDIN_FILENO, output, next_input;
     int background = 0;
@@ -2685,7 +7708,7 @@ enum eval_exit eval_pipeline(struct shell *sh, struct pipeline *pipes)
             next_input = -1;
         }
 
-        pid = fork();
+        pid = fork_shell(sh);
         if (pid == 0) {
             if (next_input > 0)
                 close(next_input);
@@ -2705,9 +7728,14 @@ enum eval_exit eval_pipeline(struct shell *sh, struct pipeline *pipes)
             }
             setpgid(0, pgid < 0 ? 0 : pgid);
             enter_subshell(sh);
-            if (pipes->command->type == CMD_SIMPLE)
-                exec_simple(sh, &pipes->command->simp);
-            do_eval(sh, pipes->command);
+            // stages before the last are marked background so that nothing
+            // waits for them one by one; this child is their subshell
+            // already, so neither they nor a subshell around them fork again
+            cmd = &f->nodes[pipes->command];
+            if (cmd->type == CMD_SIMPLE)
+                exec_simple(sh, f, &cmd->simp);
+            run_tail(sh, f, cmd->type == CMD_SUBSHELL ?
+                    cmd->sub.commands : pipes->command);
             _exit(sh->exit_status);
         } else if(pid > 0) {
             if (pgid < 0)
@@ -2719,7 +7747,7 @@ enum eval_exit eval_pipeline(struct shell *sh, struct pipeline *pipes)
                 close(output);
             input = next_input;
             background = pipes->background;
-            pipes = pipes->next;
+            pipes = pipes->next ? &f->nodes[pipes->next].pipe : NULL;
         } else {
             goto error;
         }
@@ -2732,26 +7760,28 @@ error:
     return EXIT_NEXT;
 }
 
-enum eval_exit eval_redirs(struct shell *sh, struct redirs *redirs)
+enum eval_exit eval_redirs(struct shell *sh, const struct flat *f,
+        const struct flat_redirs *redirs)
 {
     enum eval_exit ret;
-    struct savedfd *save = apply_redirs(sh, redirs->redirs);
+    struct savedfd *save = apply_redirs(sh, f, redirs->redirs);
     if (!save) {
         sh->exit_status = 1;
         return EXIT_NEXT;
     }
-    ret = do_eval(sh, redirs->command);
+    ret = do_eval(sh, f, redirs->command);
     revert_redirs(sh, save);
     return ret;
 }
 
-enum eval_exit eval_andor(struct shell *sh, struct andor *andor)
+enum eval_exit eval_andor(struct shell *sh, const struct flat *f,
+        const struct flat_andor *andor)
 {
     enum eval_exit ret;
     int should_eval = 1;
     while (andor) {
         if (should_eval) {
-            ret = do_eval(sh, andor->command);
+            ret = do_eval(sh, f, andor->command);
             if (ret != EXIT_NEXT)
                 return ret;
             if (andor->negated)
@@ -2761,55 +7791,58 @@ enum eval_exit eval_andor(struct shell *sh, struct andor *andor)
             should_eval = !sh->exit_status;
         else
             should_eval = sh->exit_status;
-        andor = andor->next;
+        andor = andor->next ? &f->nodes[andor->next].andor : NULL;
     }
     return EXIT_NEXT;
 }
 
-enum eval_exit eval_compound(struct shell *sh, struct compound *comp)
+enum eval_exit eval_compound(struct shell *sh, const struct flat *f,
+        const struct flat_compound *comp)
 {
     enum eval_exit ret;
     while (comp) {
-        ret = do_eval(sh, comp->command);
+        ret = do_eval(sh, f, comp->command);
         if (ret != EXIT_NEXT)
             return ret;
-        comp = comp->next;
+        comp = comp->next ? &f->nodes[comp->next].comp : NULL;
     }
     return EXIT_NEXT;
 }
 
-enum eval_exit eval_cond(struct shell *sh, struct cond *cond)
+enum eval_exit eval_cond(struct shell *sh, const struct flat *f,
+        const struct flat_cond *cond)
 {
     enum eval_exit ret;
     while (1) {
-        ret = do_eval(sh, cond->cond);
+        ret = do_eval(sh, f, cond->cond);
         if (ret != EXIT_NEXT)
             return ret;
-        if (!sh->exit_status) {
-            return do_eval(sh, cond->commands);
-        } else {
-            if (cond->otherwise->type == CMD_COND) {
-                cond = (void *)cond->otherwise;
-                continue;
-            }
-            return do_eval(sh, cond->otherwise);
+        if (!sh->exit_status)
+            return do_eval(sh, f, cond->commands);
+        if (!cond->otherwise)
+            return EXIT_NEXT;
+        if (f->nodes[cond->otherwise].type == CMD_COND) {
+            cond = &f->nodes[cond->otherwise].cond;
+            continue;
         }
+        return do_eval(sh, f, cond->otherwise);
     }
 }
 
-enum eval_exit eval_loop(struct shell *sh, struct loop *loop)
+enum eval_exit eval_loop(struct shell *sh, const struct flat *f,
+        const struct flat_loop *loop)
 {
     enum eval_exit ret;
     sh->loop_depth++;
     while (1) {
-        ret = do_eval(sh, loop->cond);
+        ret = do_eval(sh, f, loop->cond);
         if (ret != EXIT_NEXT)
             goto loop_exit;
         if ((loop->until && !sh->exit_status) || (!loop->until && sh->exit_status)) {
             ret = EXIT_NEXT;
             goto loop_exit;
         }
-        ret = do_eval(sh, loop->commands);
+        ret = do_eval(sh, f, loop->commands);
         switch (ret) {
         case EXIT_LOOP_CONTINUE:
             if (!--sh->break_depth)
@@ -2820,6 +7853,7 @@ enum eval_exit eval_loop(struct shell *sh, struct loop *loop)
                 ret = EXIT_NEXT;
             goto loop_exit;
         case EXIT_RETURN:
+        case EXIT_SHELL:
             goto loop_exit;
         case EXIT_NEXT:
             break;
@@ -2830,33 +7864,34 @@ loop_exit:
     return ret;
 }
 
-enum eval_exit do_eval(struct shell *sh, node_t *node)
+enum eval_exit do_eval(struct shell *sh, const struct flat *f, uint32_t idx)
 {
+    const union flat_node *node = &f->nodes[idx];
     switch (node->type) {
     case CMD_ASSIGNMENT:
-        do_assign(sh, &node->simp);
+        do_assign(sh, f, &node->simp);
         return EXIT_NEXT;
     case CMD_SIMPLE:
-        return eval_simple(sh, &node->simp);
+        return eval_simple(sh, f, &node->simp);
     case CMD_ANDOR:
-        return eval_andor(sh, &node->andor);
+        return eval_andor(sh, f, &node->andor);
     case CMD_PIPELINE:
-        return eval_pipeline(sh, &node->pipe);
+        return eval_pipeline(sh, f, &node->pipe);
     case CMD_COMPOUND:
-        return eval_compound(sh, &node->comp);
+        return eval_compound(sh, f, &node->comp);
     case CMD_SUBSHELL:
-        return eval_subshell(sh, &node->sub);
+        return eval_subshell(sh, f, &node->sub);
     case CMD_LOOP:
-        return eval_loop(sh, &node->loop);
+        return eval_loop(sh, f, &node->loop);
     case CMD_COND:
-        return eval_cond(sh, &node->cond);
+        return eval_cond(sh, f, &node->cond);
     case CMD_REDIRS:
-        return eval_redirs(sh, &node->redirs);
+        return eval_redirs(sh, f, &node->redirs);
     case CMD_FOR_LOOP:
         //TODO
         return EXIT_NEXT;
     case CMD_FUNCTION:
-        defun(sh, &node->func);
+        defun(sh, node->func.def);
         return EXIT_NEXT;
     case CMD_CASES:
         //TODO
@@ -2865,33 +7900,644 @@ enum eval_exit do_eval(struct shell *sh, node_t *node)
     abort();
 }
 
-void run_shell(struct shell *sh, node_t *root)
+/*
+ * Bytecode
+ *
+ * compile() lowers a flat tree into a straight run of instructions for
+ * vm_run(). And-or lists, conditionals and loops turn into jumps, and simple
+ * commands into an expand, spawn and wait sequence. Anything that forks
+ * with a whole subtree (subshells, pipelines) is handed to do_eval() through
+ * OP_EVAL, and the child compiles its part of the tree again. do_eval() on
+ * its own is kept as the reference evaluator; PSHELL_EVAL=tree selects it.
+ */
+enum opcode {
+    OP_EVAL,            // do_eval(node)
+    OP_ASSIGN,          // assignments of node
+    OP_EXPAND,          // expands the words of node into argv
+    OP_SPAWN,           // forks and execs argv with node's redirections
+    OP_WAIT,            // waits for what OP_SPAWN started
+    OP_NOT,
+    OP_JUMP,
+    OP_JUMP_IF_TRUE,    // if the exit status is 0
+    OP_JUMP_IF_FALSE,
+    OP_LOOP,            // enters a loop; break goes to jump, continue to pc+1
+    OP_REDIR,           // applies node's redirections, or jumps if they fail
+    OP_POP,             // leaves the innermost loop or redirection
+    OP_HALT,
+};
+
+struct insn {
+    enum opcode op;
+    uint32_t node, jump;
+};
+
+struct code {
+    const struct flat *f;
+    struct insn *insns;
+    uint32_t len, depth, max_depth;
+};
+
+enum frame_type {
+    FRAME_LOOP,
+    FRAME_REDIR,
+};
+
+struct vm_frame {
+    enum frame_type type;
+    uint32_t brk, cont;
+    struct savedfd *save;
+};
+
+static uint32_t emit(struct code *c, enum opcode op, uint32_t node)
+{
+    struct insn *insn = &c->insns[c->len];
+    insn->op = op;
+    insn->node = node;
+    insn->jump = 0;
+    return c->len++;
+}
+
+static void compile_node(struct code *c, uint32_t idx)
+{
+    const union flat_node *node = &c->f->nodes[idx];
+    uint32_t test = 0, skip, start;
+
+    switch (node->type) {
+    case CMD_ASSIGNMENT:
+        emit(c, OP_ASSIGN, idx);
+        return;
+    case CMD_SIMPLE:
+        emit(c, OP_EXPAND, idx);
+        emit(c, OP_SPAWN, idx);
+        emit(c, OP_WAIT, idx);
+        return;
+    case CMD_ANDOR:
+        // A skipped command is skipped along with its negation, and the
+        // test after it runs again on the status that skipped it
+        for (skip = 0;; skip = 1) {
+            compile_node(c, node->andor.command);
+            if (node->andor.negated)
+                emit(c, OP_NOT, 0);
+            if (skip)
+                c->insns[test].jump = c->len;
+            if (!node->andor.next)
+                return;
+            test = emit(c, node->andor.and ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE, 0);
+            node = &c->f->nodes[node->andor.next];
+        }
+    case CMD_COMPOUND:
+        while (1) {
+            compile_node(c, node->comp.command);
+            if (!node->comp.next)
+                return;
+            node = &c->f->nodes[node->comp.next];
+        }
+    case CMD_COND:
+        compile_node(c, node->cond.cond);
+        test = emit(c, OP_JUMP_IF_FALSE, 0);
+        compile_node(c, node->cond.commands);
+        if (!node->cond.otherwise) {
+            c->insns[test].jump = c->len;
+            return;
+        }
+        skip = emit(c, OP_JUMP, 0);
+        c->insns[test].jump = c->len;
+        compile_node(c, node->cond.otherwise);
+        c->insns[skip].jump = c->len;
+        return;
+    case CMD_LOOP:
+        if (++c->depth > c->max_depth)
+            c->max_depth = c->depth;
+        skip = emit(c, OP_LOOP, idx);
+        start = c->len;
+        compile_node(c, node->loop.cond);
+        test = emit(c, node->loop.until ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE, 0);
+        compile_node(c, node->loop.commands);
+        c->insns[emit(c, OP_JUMP, 0)].jump = start;
+        c->insns[test].jump = c->len;
+        emit(c, OP_POP, 0);
+        c->insns[skip].jump = c->len;
+        c->depth--;
+        return;
+    case CMD_REDIRS:
+        if (++c->depth > c->max_depth)
+            c->max_depth = c->depth;
+        skip = emit(c, OP_REDIR, idx);
+        compile_node(c, node->redirs.command);
+        emit(c, OP_POP, 0);
+        c->insns[skip].jump = c->len;
+        c->depth--;
+        return;
+    case CMD_PIPELINE: case CMD_SUBSHELL: case CMD_FOR_LOOP:
+    case CMD_FUNCTION: case CMD_CASES:
+        emit(c, OP_EVAL, idx);
+        return;
+    }
+    abort();
+}
+
+// Compiles the subtree at idx into a. No node takes more than four
+// instructions, which bounds the size up front.
+static struct code *compile(struct arena *a, const struct flat *f, uint32_t idx)
+{
+    struct code *c = arena_alloc(a, sizeof(*c));
+    if (f->nnodes > (UINT32_MAX - 1) / 4)
+        abort();
+    c->f = f;
+    c->insns = arena_alloc(a, (f->nnodes * (size_t)4 + 1) * sizeof(*c->insns));
+    c->len = c->depth = c->max_depth = 0;
+    compile_node(c, idx);
+    emit(c, OP_HALT, 0);
+    return c;
+}
+
+static pid_t spawn_simple(struct shell *sh, const struct flat *f,
+        const struct flat_cmd *cmd, char **args)
+{
+    pid_t pid;
+    if ((pid = spawn_args(sh, f, cmd, args)) >= 0)
+        return pid;
+    hash_args(sh, args);
+    pid = fork_shell(sh);
+    if (pid == 0) {
+        setpgid(0, 0);
+        enter_subshell(sh);
+        exec_args(sh, f, cmd, args);
+        _exit(1);
+    }
+    if (pid > 0)
+        setpgid(pid, pid);
+    free(args);
+    return pid;
+}
+
+static void pop_frame(struct shell *sh, struct vm_frame *frame)
+{
+    if (frame->type == FRAME_REDIR)
+        revert_redirs(sh, frame->save);
+    else
+        sh->loop_depth--;
+}
+
+enum eval_exit vm_run(struct shell *sh, const struct code *c)
+{
+    const struct flat *f = c->f;
+    const union flat_node *node;
+    const struct insn *insn;
+    struct vm_frame frames[c->max_depth + 1], *frame;
+    struct savedfd *save;
+    uint32_t pc = 0, depth = 0;
+    enum eval_exit ret;
+    char **args = NULL;
+    pid_t pid = -1;
+
+    while (1) {
+        insn = &c->insns[pc++];
+        node = &f->nodes[insn->node];
+        switch (insn->op) {
+        case OP_EVAL:
+            ret = do_eval(sh, f, insn->node);
+            if (ret != EXIT_NEXT)
+                break;
+            continue;
+        case OP_ASSIGN:
+            do_assign(sh, f, &node->simp);
+            continue;
+        case OP_EXPAND:
+            args = make_args(sh, f, &node->simp);
+            continue;
+        case OP_SPAWN:
+            // pid 0 stands for a builtin or function that has already run,
+            // or a command that could not be started
+            if (try_builtin(sh, f, &node->simp, args, &ret))
+                pid = 0;
+            else
+                pid = spawn_simple(sh, f, &node->simp, args);
+            args = NULL;
+            if (pid || ret == EXIT_NEXT)
+                continue;
+            break;
+        case OP_WAIT:
+            if (!pid)
+                continue;
+            if (pid < 0)
+                sh->exit_status = 1;
+            else
+                wait_job(sh, pid, pid, node->simp.background);
+            continue;
+        case OP_NOT:
+            sh->exit_status = !sh->exit_status;
+            continue;
+        case OP_JUMP:
+            pc = insn->jump;
+            continue;
+        case OP_JUMP_IF_TRUE:
+            if (!sh->exit_status)
+                pc = insn->jump;
+            continue;
+        case OP_JUMP_IF_FALSE:
+            if (sh->exit_status)
+                pc = insn->jump;
+            continue;
+        case OP_LOOP:
+            frame = &frames[depth++];
+            frame->type = FRAME_LOOP;
+            frame->brk = insn->jump;
+            frame->cont = pc;
+            sh->loop_depth++;
+            continue;
+        case OP_REDIR:
+            if (!(save = apply_redirs(sh, f, node->redirs.redirs))) {
+                sh->exit_status = 1;
+                pc = insn->jump;
+                continue;
+            }
+            frame = &frames[depth++];
+            frame->type = FRAME_REDIR;
+            frame->save = save;
+            continue;
+        case OP_POP:
+            pop_frame(sh, &frames[--depth]);
+            continue;
+        case OP_HALT:
+            assert(!depth);
+            return EXIT_NEXT;
+        }
+
+        // break, continue, return or exit: unwind to the loop they are
+        // aimed at, or out to the caller if it is not in this code
+        while (depth) {
+            frame = &frames[depth - 1];
+            if (frame->type == FRAME_LOOP && (ret == EXIT_LOOP_BREAK ||
+                    ret == EXIT_LOOP_CONTINUE) && !--sh->break_depth) {
+                if (ret == EXIT_LOOP_CONTINUE) {
+                    pc = frame->cont;
+                } else {
+                    pc = frame->brk;
+                    pop_frame(sh, frame);
+                    depth--;
+                }
+                break;
+            }
+            pop_frame(sh, frame);
+            depth--;
+        }
+        if (!depth && (ret == EXIT_RETURN || ret == EXIT_SHELL ||
+                    sh->break_depth))
+            return ret;
+    }
+}
+
+// Runs the subtree at idx with whichever evaluator is selected
+static enum eval_exit run_node(struct shell *sh, const struct flat *f,
+        uint32_t idx)
+{
+    if (sh->tree_eval)
+        return do_eval(sh, f, idx);
+    return vm_run(sh, compile(&sh->lex.arena, f, idx));
+}
+
+/*
+ * Runs the subtree at idx when nothing is left to do after it but exit, as
+ * in a forked child. The simple command it ends on is exec'd in place of the
+ * shell instead of being forked and waited for, following the last command
+ * of lists, the branch an and-or list or a conditional takes, nested
+ * subshells and redirections. Anything else runs as usual and returns.
+ */
+static enum eval_exit run_tail(struct shell *sh, const struct flat *f,
+        uint32_t idx)
+{
+    const union flat_node *node;
+    const struct flat_compound *comp;
+    const struct flat_andor *andor;
+    const struct flat_cond *cond;
+    struct savedfd *save;
+    enum eval_exit ret;
+    int should_eval;
+    while (1) {
+        node = &f->nodes[idx];
+        switch (node->type) {
+        case CMD_SIMPLE:
+            if (node->simp.background)
+                break;
+            exec_simple(sh, f, &node->simp);
+            abort();
+        case CMD_SUBSHELL:
+            if (node->sub.background)
+                break;
+            idx = node->sub.commands;
+            continue;
+        case CMD_REDIRS:
+            if (!(save = apply_redirs(sh, f, node->redirs.redirs))) {
+                sh->exit_status = 1;
+                return EXIT_NEXT;
+            }
+            ret = run_tail(sh, f, node->redirs.command);
+            revert_redirs(sh, save);
+            return ret;
+        case CMD_COMPOUND:
+            for (comp = &node->comp; comp->next;
+                    comp = &f->nodes[comp->next].comp) {
+                if ((ret = run_node(sh, f, comp->command)) != EXIT_NEXT)
+                    return ret;
+            }
+            idx = comp->command;
+            continue;
+        case CMD_ANDOR:
+            should_eval = 1;
+            for (andor = &node->andor; andor->next;
+                    andor = &f->nodes[andor->next].andor) {
+                if (should_eval) {
+                    if ((ret = run_node(sh, f, andor->command)) != EXIT_NEXT)
+                        return ret;
+                    if (andor->negated)
+                        sh->exit_status = !sh->exit_status;
+                }
+                should_eval = andor->and ? !sh->exit_status : sh->exit_status;
+            }
+            if (!should_eval)
+                return EXIT_NEXT;
+            // the status still has to be inverted afterwards
+            if (andor->negated) {
+                if ((ret = run_node(sh, f, andor->command)) == EXIT_NEXT)
+                    sh->exit_status = !sh->exit_status;
+                return ret;
+            }
+            idx = andor->command;
+            continue;
+        case CMD_COND:
+            for (cond = &node->cond;; cond = &f->nodes[idx].cond) {
+                if ((ret = run_node(sh, f, cond->cond)) != EXIT_NEXT)
+                    return ret;
+                if (!sh->exit_status) {
+                    idx = cond->commands;
+                    break;
+                }
+                if (!cond->otherwise)
+                    return EXIT_NEXT;
+                idx = cond->otherwise;
+                if (f->nodes[idx].type != CMD_COND)
+                    break;
+            }
+            continue;
+        default:
+            break;
+        }
+        return run_node(sh, f, idx);
+    }
+}
+
+/*
+ * Command substitution
+ *
+ * The output goes straight onto the end of the buffer being expanded into,
+ * and the trailing newlines come off it there. Commands that are nothing
+ * but builtins run in the shell with sh->out pointed at that buffer, since
+ * nothing they can do would be seen outside a subshell anyway; everything
+ * else runs in a child and is read back through a pipe.
+ */
+#define SUBST_PIPE_SIZE (256 * 1024)
+#define SUBST_READ_SIZE (4 * 1024)
+
+static int word_in_shell(const struct flat *f, struct flat_span word)
+{
+    const struct flat_part *part = f->parts + word.start;
+    const struct flat_part *end = part + word.count;
+    for (; part < end; part++) {
+        // these assign, or exit on an error
+        if (part->type == WORD_ARITHMETIC || part->op == PARAM_ASSIGN ||
+                part->op == PARAM_ERROR)
+            return 0;
+        if (!word_in_shell(f, part->arg))
+            return 0;
+    }
+    return 1;
+}
+
+static int subst_in_shell(struct shell *sh, const struct flat *f,
+        uint32_t idx)
+{
+    const union flat_node *node = &f->nodes[idx];
+    const struct flat_cmd *cmd;
+    const struct flat_span *word;
+    const struct flat_part *part;
+    const struct symbol *sym;
+    const struct builtin *b;
+    uint32_t i;
+    switch (node->type) {
+    case CMD_SIMPLE:
+        cmd = &node->simp;
+        if (cmd->background || cmd->vars.count || cmd->redirs.count ||
+                !cmd->args.count)
+            return 0;
+        word = &f->words[cmd->args.start];
+        part = &f->parts[word->start];
+        if (word->count != 1 || part->type != WORD_STRING ||
+                !(b = find_builtin(part->start, part->len)) ||
+                !(b->flags & BUILTIN_PURE))
+            return 0;
+        // a function of the same name would run instead
+        if (!(b->flags & BUILTIN_SPECIAL) && sh->funcs &&
+                (sym = find_symbol(part->start, part->len)) &&
+                find_func(sh, sym))
+            return 0;
+        for (i = 1; i < cmd->args.count; i++)
+            if (!word_in_shell(f, word[i]))
+                return 0;
+        return 1;
+    case CMD_ANDOR:
+        for (;; node = &f->nodes[node->andor.next]) {
+            if (!subst_in_shell(sh, f, node->andor.command))
+                return 0;
+            if (!node->andor.next)
+                return 1;
+        }
+    case CMD_COMPOUND:
+        for (;; node = &f->nodes[node->comp.next]) {
+            if (!subst_in_shell(sh, f, node->comp.command))
+                return 0;
+            if (!node->comp.next)
+                return 1;
+        }
+    case CMD_COND:
+        return subst_in_shell(sh, f, node->cond.cond) &&
+            subst_in_shell(sh, f, node->cond.commands) &&
+            (!node->cond.otherwise || subst_in_shell(sh, f, node->cond.otherwise));
+    default:
+        return 0;
+    }
+}
+
+static void subst_capture(str_t *buf, struct shell *sh, const struct flat *f,
+        uint32_t body)
+{
+    struct fields fields = sh->fields;
+    str_t *out = sh->out;
+    // buf may well be sh->fields.buf, in the middle of being expanded into
+    sh->fields.buf = new_str();
+    sh->fields.offs = NULL;
+    sh->fields.count = sh->fields.size = 0;
+    sh->out = buf;
+    do_eval(sh, f, body);
+    sh->out = out;
+    free_str(sh->fields.buf);
+    free(sh->fields.offs);
+    sh->fields = fields;
+}
+
+static void subst_fork(str_t *buf, struct shell *sh, const struct flat *f,
+        uint32_t body)
+{
+    size_t want;
+    ssize_t ret;
+    int fd[2], status;
+    pid_t pid;
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        perror("pipe");
+        sh->exit_status = 1;
+        return;
+    }
+    // fewer trips through the pipe for big outputs; the default is fine too
+    fcntl(fd[0], F_SETPIPE_SZ, SUBST_PIPE_SIZE);
+    pid = fork_shell(sh);
+    if (pid == 0) {
+        close(fd[0]);
+        if (dup2(fd[1], STDOUT_FILENO) < 0)
+            _exit(1);
+        enter_subshell(sh);
+        run_tail(sh, f, body);
+        _exit(sh->exit_status);
+    }
+    close(fd[1]);
+    if (pid < 0) {
+        close(fd[0]);
+        sh->exit_status = 1;
+        return;
+    }
+    while (1) {
+        // read straight into buf, growing it by doubling
+        want = str_len(buf);
+        str_reserve(buf, want < SUBST_READ_SIZE ? SUBST_READ_SIZE : want);
+        ret = read(fd[0], buf->end,
+                (unsigned char *)buf->buf_end - buf->end - 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        buf->end += ret;
+    }
+    *buf->end = '\0';
+    close(fd[0]);
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            break;
+    sh->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) :
+        128 + WTERMSIG(status);
+}
+
+static void command_subst(str_t *buf, struct shell *sh, const struct flat *f,
+        uint32_t body)
+{
+    size_t mark = str_len(buf);
+    sh->substs++;
+    if (!body)
+        sh->exit_status = 0;
+    else if (subst_in_shell(sh, f, body))
+        subst_capture(buf, sh, f, body);
+    else
+        subst_fork(buf, sh, f, body);
+    while (str_len(buf) > mark && buf->end[-1] == '\n')
+        buf->end--;
+    if (buf->buf_start)
+        *buf->end = '\0';
+}
+
+// Returns -1 once exit has run. When root is the last of the script, its
+// last command may replace the shell.
+int run_shell(struct shell *sh, node_t *root, int last)
 {
     enum eval_exit ret;
+    struct flat *f = flatten(&sh->lex.arena, root);
     assert(!sh->break_depth && !sh->in_func && !sh->loop_depth);
-    ret = do_eval(sh, root);
+    // the shell may be gone without another chance to flush
+    if (last)
+        fflush(stdout);
+    ret = last ? run_tail(sh, f, 0) : run_node(sh, f, 0);
     assert(!sh->break_depth && !sh->in_func && !sh->loop_depth);
     switch (ret) {
     case EXIT_NEXT:
-        free_node(root);
-        return;
+        lex_release(&sh->lex);
+        return 0;
+    case EXIT_SHELL:
+        lex_release(&sh->lex);
+        return -1;
     default:
         abort();
     }
 }
 
-int main()
+// pshell [-c command [name [arg...]] | script [arg...]]
+int main(int argc, char **argv)
 {
     node_t *cmd;
     struct shell sh;
+    struct args_frame args = {NULL, argc, 0, argv, NULL};
+    struct ast_cache cache;
+    const char *eval;
+    int use_cache = 0, fd;
     setpgid(0, 0);
-    shell_init(&sh);
-    while (!sh.lex.errored) {
+    shell_init(&sh, &args);
+    eval = getenv("PSHELL_EVAL");
+    sh.tree_eval = eval && !strcmp(eval, "tree");
+    eval = getenv("PSHELL_SPAWN");
+    sh.fork_only = eval && !strcmp(eval, "fork");
+    if (argc > 1 && !strcmp(argv[1], "-c")) {
+        if (argc < 3) {
+            fprintf(stderr, "%s: -c requires an argument\n", argv[0]);
+            return 2;
+        }
+        init_lex(&sh.lex, str_view(argv[2], strlen(argv[2])), -1);
+        if (argc > 3) {
+            args.argc = argc - 3;
+            args.argv = argv + 3;
+        } else {
+            args.argc = 1;
+        }
+    } else if (argc > 1) {
+        if (init_lex_file(&sh.lex, argv[1]) < 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+            return 127;
+        }
+        args.argc = argc - 1;
+        args.argv = argv + 1;
+        use_cache = !init_ast_cache(&cache, argv[1], &sh.lex.in);
+    } else {
+        // a dup of stdin shares its offset, but stays on the script when a
+        // redirection moves fd 0 somewhere else
+        fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        init_lex(&sh.lex, NULL, fd < 0 ? STDIN_FILENO : fd);
+    }
+    if (use_cache) {
+        if (!(cmd = load_ast_cache(&cache, &sh.lex.arena))) {
+            cmd = parse_all(&sh.lex);
+            if (cmd && !sh.lex.errored)
+                store_ast_cache(&cache, cmd);
+        }
+        // what parsed before a syntax error runs, but the shell has to
+        // stay to report it
+        if (cmd)
+            run_shell(&sh, cmd, !sh.lex.errored);
+    }
+    while (!use_cache && !sh.lex.errored) {
         cmd = parse(&sh.lex);
-        if (!cmd)
+        if (!cmd || run_shell(&sh, cmd, 0) < 0)
             break;
-        run_shell(&sh, cmd);
     }
+    if (sh.lex.errored)
+        sh.exit_status = 2;
     destroy_shell(&sh);
+    if (use_cache)
+        destroy_ast_cache(&cache);
+    return sh.exit_status;
 }
 
@@ -6,9 +6,10 @@
 
 #include <unistd.h>
 
+#include "applet.h"
 #include "arg.h"
 
-int do_rmdir(const char *name)
+static int do_rmdir(const char *name)
 {
 	if (rmdir(name) < 0) {
 		fprintf(stderr, "rmdir: failed to remove '%s': %s\n", name, strerror(errno));
@@ -17,7 +18,7 @@ int do_rmdir(const char *name)
 	return 0;
 }
 
-int do_rmdir_parents(char *name)
+static int do_rmdir_parents(char *name)
 {
 	char *end = name + strlen(name);
 	int ret = 0, saved;
@@ -45,7 +46,7 @@ static const struct long_def long_args[] = {
 	{0, NULL},
 };
 
-int main(int argc, char *argv[])
+int rmdir_main(int argc, char *argv[])
 {
 	struct arg_state arg_state;
 	const char *arg;
@@ -0,0 +1,30 @@
+# Sourced by each test. $PSHELL is the shell under test and $TMP a scratch
+# directory that is removed afterwards.
+
+fails=0
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# expect NAME EXPECTED SCRIPT [ARG...]: runs SCRIPT with pshell -c and
+# compares its stdout and stderr, followed by "status N", with EXPECTED
+expect()
+{
+    name=$1 want=$2
+    shift 2
+    got=$(cd "$TMP" && "$PSHELL" -c "$@" 2>&1 < /dev/null; echo "status $?")
+    check "$name" "$want" "$got"
+}
+
+# check NAME EXPECTED GOT
+check()
+{
+    if [ "$2" != "$3" ]; then
+        printf '%s: expected\n%s\n%s: got\n%s\n' "$1" "$2" "$1" "$3"
+        fails=$((fails + 1))
+    fi
+}
+
+finish()
+{
+    exit $((fails != 0))
+}
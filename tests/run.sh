@@ -0,0 +1,21 @@
+#!/bin/sh
+# usage: tests/run.sh [shell]
+#
+# Runs every tests/*.test against shell (default ./pshell).
+
+PSHELL=${1:-./pshell}
+case $PSHELL in
+/*) ;;
+*) PSHELL=$PWD/$PSHELL ;;
+esac
+export PSHELL
+
+dir=$(dirname "$0")
+status=0
+for t in "$dir"/*.test; do
+    if ! sh "$t"; then
+        echo "FAIL: $t"
+        status=1
+    fi
+done
+exit $status
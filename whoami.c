@@ -3,7 +3,9 @@
 #include <sys/types.h>
 #include <pwd.h>
 
-int main(int argc, char *argv[]) {
+#include "applet.h"
+
+int whoami_main(int argc, char *argv[]) {
 	struct passwd *puid;
 	uid_t uid = geteuid();
 	(void)argc; (void)argv;